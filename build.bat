@@ -3,7 +3,7 @@ SetLocal EnableDelayedExpansion
 
 SET CFLAGS=-ggdb
 
-SET LIBS=-LC:\dev\radiance_cascades_2d\lib -lglfw3 -lUser32 -lGdi32 -lShell32 -lmsvcrt -lopengl32
+SET LIBS=-LC:\dev\radiance_cascades_2d\lib -lglfw3 -lUser32 -lGdi32 -lShell32 -lmsvcrt -lopengl32 -lpthread
 SET INCLUDES=-IC:\dev\radiance_cascades_2d\include
 
 REM SET PREPROCESSOR_DEFINITIONS=-D _CRT_SECURE_NO_WARNINGS
@@ -8,11 +8,19 @@ EXE_INSTANT="./bin/cascades_instant"
 SRCS="src/main.c src/glad.c"
 SRCS_INSTANT="src/main_instant.c src/glad.c"
 
+# headless benchmark, no GLFW/glad
+EXE_BENCH="./bin/bench"
+SRCS_BENCH="src/bench.c"
+LIBS_BENCH="-lpthread -lm"
+
 rm -rf bin
 mkdir bin
 
 echo "Compiling..."
-gcc -ggdb $LIBS $INCLUDES -o $EXE $SRCS
+gcc -O2 -ggdb $LIBS $INCLUDES -o $EXE $SRCS
 
 echo "Compiling instant..."
-gcc -ggdb $LIBS $INCLUDES -o $EXE_INSTANT $SRCS_INSTANT
+gcc -O2 -ggdb $LIBS $INCLUDES -o $EXE_INSTANT $SRCS_INSTANT
+
+echo "Compiling bench..."
+gcc -O2 -ggdb $INCLUDES -o $EXE_BENCH $SRCS_BENCH $LIBS_BENCH
@@ -0,0 +1,1101 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+// no window, no GL: only the solvers are compiled in
+#define RADIANCE_CASCADES_HEADLESS
+
+#define RADIANCE_CASCADES_MATHY_IMPLEMENTATION
+#include "mathy.h"
+
+#define RADIANCE_CASCADES_SHAPES_IMPLEMENTATION
+#include "shapes.h"
+
+#define RADIANCE_CASCADES_THREADS_IMPLEMENTATION
+#include "threads.h"
+
+#define RADIANCE_CASCADES_CPU_IMPLEMENTATION
+#include "cpu.h"
+
+#define RADIANCE_CASCADES_MAP_IMPLEMENTATION
+#include "map.h"
+
+#define RADIANCE_CASCADES_CASCADES_IMPLEMENTATION
+#include "cascades.h"
+
+#define RADIANCE_CASCADES_CASCADES_INSTANT_IMPLEMENTATION
+#include "cascades_instant.h"
+
+#define RADIANCE_CASCADES_TESTS_IMPLEMENTATION
+#include "tests.h"
+
+#define WIDTH 800
+#define HEIGHT 800
+
+#define BENCH_MAX_PHASES 32
+#define BENCH_COUNTER_NUMBER 3
+#define BENCH_MAX_ACCELS 8
+
+///
+/// Headless benchmark of the solvers.
+///
+/// Builds a scene and solves it a number of times with the accels,
+/// traversal and cascade settings picked on the command line (see usage,
+/// printed for any unknown flag), then writes a JSON report to stdout: the
+/// time of each phase, the checksum of the lit map and, where the hardware
+/// counters are readable, the cache and TLB misses of the merge.
+/// Everything the solvers log goes to stderr.
+///
+
+typedef struct bench_phase {
+    const char *name;
+    double *samples; // in milliseconds, one for each repetition
+    int32 samples_length;
+} bench_phase;
+
+typedef struct bench_accel {
+    const char *name;
+    void (*build)(map *m, thread_pool *pool); // NULL for plain pixels
+} bench_accel;
+
+typedef struct bench_traversal {
+    const char *name;
+    int32 traversal; // MAP_RAY_LEGACY, MAP_RAY_DDA or MAP_RAY_PACKET
+} bench_traversal;
+
+typedef struct bench_generator {
+    const char *name;
+    int32 generator; // CASCADE_GENERATE_RAYS or CASCADE_GENERATE_SWEEP
+} bench_generator;
+
+typedef struct bench_layout {
+    const char *name;
+    int32 layout; // CASCADE_LAYOUT_PROBE_MAJOR, ...
+} bench_layout;
+
+typedef struct bench_ray_encoding {
+    const char *name;
+    int32 ray_encoding; // CASCADE_RAYS_FULL or CASCADE_RAYS_PALETTE
+} bench_ray_encoding;
+
+typedef struct bench_gather {
+    const char *name;
+    int32 gather; // CASCADE_GATHER_STORED or CASCADE_GATHER_TRACED
+} bench_gather;
+
+typedef struct bench_mip_policy {
+    const char *name;
+    int32 mip_policy; // CASCADE_MIP_OFF, CASCADE_MIP_SPACING, ...
+} bench_mip_policy;
+
+// hardware event counted around the merge, fd is -1 when unavailable
+typedef struct bench_counter {
+    const char *name;
+    uint32 type;
+    uint64 config;
+    int fd;
+    uint64 *samples; // one for each repetition
+    int32 samples_length;
+} bench_counter;
+
+// difference between the solved map and the full resolution one
+typedef struct bench_quality {
+    double reference_total_ms;
+    double mean_abs_diff; // over the rgb channels
+    double max_abs_diff;
+    double psnr_db; // peak 1, infinite when the maps are the same
+} bench_quality;
+
+typedef struct bench_context {
+    int32 repetitions;
+    int32 repetition;
+    int32 thread_number;
+    thread_pool *pool;
+    bench_accel accels[BENCH_MAX_ACCELS];
+    int32 accels_length;
+    const char *accel_names; // as given on the command line
+    bench_traversal traversal;
+    bench_generator generator;
+    bench_phase phases[BENCH_MAX_PHASES];
+    int32 phases_length;
+    uint64 rays_per_solve;
+    int64 generate_rss_kb; // resident after the first generate, 0 if unknown
+    bench_mip_policy mip_policy;
+    bench_layout layout;
+    bench_ray_encoding ray_encoding;
+    bench_gather gather;
+    int32 fused; // 1 to generate and merge top-down in a pipelined arena
+    bench_counter counters[BENCH_COUNTER_NUMBER];
+    cascade_arena arena; // created by the first solve, reused by the others
+    uint64 checksum; // of the last solved map, to compare solvers output
+    vec4f *result; // pixels of the last solved map, for the quality report
+    int32 quality; // 1 if `quality_report` is filled
+    bench_quality quality_report;
+} bench_context;
+
+typedef struct bench_scene {
+    const char *name;
+    void (*init)(map m);
+} bench_scene;
+
+typedef struct bench_mode {
+    const char *name;
+    void (*run)(bench_context *ctx, bench_scene scene);
+} bench_mode;
+
+double
+bench_now_ms(void);
+
+void
+bench_record(bench_context *ctx, const char *name, double ms);
+
+uint64
+bench_map_checksum(map m);
+
+void
+bench_keep_result(bench_context *ctx, map m);
+
+bench_quality
+bench_compare_result(bench_context *ctx, bench_context *reference);
+
+void
+bench_build_accel(bench_context *ctx, map *m);
+
+void
+bench_run_cascades(bench_context *ctx, bench_scene scene);
+
+void
+bench_run_instant(bench_context *ctx, bench_scene scene);
+
+void
+bench_solve(
+        bench_context *ctx,
+        bench_scene scene,
+        bench_mode mode,
+        int32 quality);
+
+void
+bench_context_free(bench_context *ctx);
+
+void
+bench_report(FILE *out, bench_context *ctx, bench_scene scene, bench_mode mode);
+
+void
+bench_report_layouts(
+        FILE *out,
+        bench_context *contexts,
+        int32 contexts_length,
+        bench_scene scene,
+        bench_mode mode);
+
+static bench_scene scenes[] = {
+    { .name = "double_light", .init = test_double_light },
+    { .name = "spheres", .init = test_spheres },
+    { .name = "penumbra", .init = test_penumbra },
+    { .name = "slit", .init = test_slit },
+};
+
+static bench_accel accels[] = {
+    { .name = "none", .build = NULL },
+    { .name = "distance", .build = map_build_distance_field },
+    { .name = "occupancy", .build = map_build_occupancy },
+    { .name = "pyramid", .build = map_build_pyramid },
+    { .name = "mip", .build = map_build_mip },
+};
+
+static bench_traversal traversals[] = {
+    { .name = "legacy", .traversal = MAP_RAY_LEGACY },
+    { .name = "dda", .traversal = MAP_RAY_DDA },
+    { .name = "packet", .traversal = MAP_RAY_PACKET },
+};
+
+static bench_generator generators[] = {
+    { .name = "rays", .generator = CASCADE_GENERATE_RAYS },
+    { .name = "sweep", .generator = CASCADE_GENERATE_SWEEP },
+};
+
+static bench_mip_policy mip_policies[] = {
+    { .name = "off", .mip_policy = CASCADE_MIP_OFF },
+    { .name = "spacing", .mip_policy = CASCADE_MIP_SPACING },
+    { .name = "interval", .mip_policy = CASCADE_MIP_INTERVAL },
+};
+
+static bench_layout layouts[] = {
+    { .name = "probe", .layout = CASCADE_LAYOUT_PROBE_MAJOR },
+    { .name = "direction", .layout = CASCADE_LAYOUT_DIRECTION_MAJOR },
+    { .name = "morton", .layout = CASCADE_LAYOUT_MORTON },
+};
+
+static bench_ray_encoding ray_encodings[] = {
+    { .name = "full", .ray_encoding = CASCADE_RAYS_FULL },
+    { .name = "palette", .ray_encoding = CASCADE_RAYS_PALETTE },
+};
+
+static bench_gather gathers[] = {
+    { .name = "stored", .gather = CASCADE_GATHER_STORED },
+    { .name = "traced", .gather = CASCADE_GATHER_TRACED },
+};
+
+static bench_mode modes[] = {
+    { .name = "cascades", .run = bench_run_cascades },
+    { .name = "instant", .run = bench_run_instant },
+};
+
+double bench_now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec * 1000.0 + (double) ts.tv_nsec / 1000000.0;
+}
+
+void bench_record(bench_context *ctx, const char *name, double ms) {
+    bench_phase *phase = NULL;
+    for(int32 phase_index = 0;
+        phase_index < ctx->phases_length;
+        ++phase_index) {
+        if (strcmp(ctx->phases[phase_index].name, name) == 0) {
+            phase = &ctx->phases[phase_index];
+            break;
+        }
+    }
+    if (phase == NULL) {
+        if (ctx->phases_length >= BENCH_MAX_PHASES) return;
+        phase = &ctx->phases[ctx->phases_length++];
+        phase->name = name;
+        phase->samples = calloc(ctx->repetitions, sizeof(double));
+        phase->samples_length = 0;
+    }
+    if (phase->samples_length < ctx->repetitions) {
+        phase->samples[phase->samples_length++] = ms;
+    }
+}
+
+void bench_counters_open(bench_context *ctx) {
+    bench_counter counters[BENCH_COUNTER_NUMBER] = {
+#ifdef __linux__
+        {
+            .name = "l1d_read_misses",
+            .type = PERF_TYPE_HW_CACHE,
+            .config = PERF_COUNT_HW_CACHE_L1D |
+                (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)
+        },
+        {
+            .name = "llc_misses",
+            .type = PERF_TYPE_HARDWARE,
+            .config = PERF_COUNT_HW_CACHE_MISSES
+        },
+        {
+            .name = "dtlb_read_misses",
+            .type = PERF_TYPE_HW_CACHE,
+            .config = PERF_COUNT_HW_CACHE_DTLB |
+                (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)
+        },
+#endif
+    };
+
+    for(int32 counter_index = 0;
+        counter_index < BENCH_COUNTER_NUMBER;
+        ++counter_index) {
+        bench_counter *counter = &ctx->counters[counter_index];
+        *counter = counters[counter_index];
+        counter->fd = -1;
+        counter->samples = calloc(ctx->repetitions, sizeof(uint64));
+#ifdef __linux__
+        struct perf_event_attr attr = {
+            .size = sizeof(struct perf_event_attr),
+            .type = counter->type,
+            .config = counter->config,
+            .disabled = 1,
+            .exclude_kernel = 1,
+            .exclude_hv = 1
+        };
+        counter->fd = (int) syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#endif
+    }
+}
+
+void bench_counters_start(bench_context *ctx) {
+#ifdef __linux__
+    for(int32 counter_index = 0;
+        counter_index < BENCH_COUNTER_NUMBER;
+        ++counter_index) {
+        int fd = ctx->counters[counter_index].fd;
+        if (fd < 0) continue;
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+#endif
+}
+
+void bench_counters_stop(bench_context *ctx) {
+    for(int32 counter_index = 0;
+        counter_index < BENCH_COUNTER_NUMBER;
+        ++counter_index) {
+        bench_counter *counter = &ctx->counters[counter_index];
+        if (counter->fd < 0) continue;
+        uint64 value = 0;
+#ifdef __linux__
+        ioctl(counter->fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(counter->fd, &value, sizeof(value)) != sizeof(value)) {
+            value = 0;
+        }
+#endif
+        if (counter->samples_length < ctx->repetitions) {
+            counter->samples[counter->samples_length++] = value;
+        }
+    }
+}
+
+void bench_counters_close(bench_context *ctx) {
+    for(int32 counter_index = 0;
+        counter_index < BENCH_COUNTER_NUMBER;
+        ++counter_index) {
+        bench_counter *counter = &ctx->counters[counter_index];
+        if (counter->fd >= 0) close(counter->fd);
+        free(counter->samples);
+        counter->samples = NULL;
+        counter->fd = -1;
+    }
+}
+
+// current resident set, unlike ru_maxrss which is the peak
+int64 bench_current_rss_kb(void) {
+    int64 rss_kb = 0;
+#ifdef __linux__
+    FILE *statm = fopen("/proc/self/statm", "r");
+    if (statm == NULL) return 0;
+    long long size_pages = 0;
+    long long resident_pages = 0;
+    if (fscanf(statm, "%lld %lld", &size_pages, &resident_pages) == 2) {
+        rss_kb = resident_pages * (sysconf(_SC_PAGESIZE) / 1024);
+    }
+    fclose(statm);
+#endif
+    return rss_kb;
+}
+
+uint64 bench_map_checksum(map m) {
+    // FNV-1a over the raw pixel bytes
+    uint64 hash = 0xcbf29ce484222325;
+    uint8 *bytes = (uint8 *) m.pixels;
+    for(int64 byte_index = 0;
+        byte_index < (int64) m.w * m.h * (int64) sizeof(vec4f);
+        ++byte_index) {
+        hash ^= bytes[byte_index];
+        hash *= 0x100000001b3;
+    }
+    return hash;
+}
+
+void bench_keep_result(bench_context *ctx, map m) {
+    if (ctx->result == NULL) {
+        ctx->result = malloc(m.w * m.h * sizeof(vec4f));
+    }
+    memcpy(ctx->result, m.pixels, m.w * m.h * sizeof(vec4f));
+}
+
+bench_quality bench_compare_result(
+        bench_context *ctx,
+        bench_context *reference) {
+    bench_quality quality = {};
+    double squared_sum = 0.0;
+    int64 channel_number = (int64) WIDTH * HEIGHT * 3;
+    for(int64 pixel_index = 0;
+        pixel_index < (int64) WIDTH * HEIGHT;
+        ++pixel_index) {
+        vec4f a = ctx->result[pixel_index];
+        vec4f b = reference->result[pixel_index];
+        double diff[3] = { a.r - b.r, a.g - b.g, a.b - b.b };
+        for(int32 channel = 0; channel < 3; ++channel) {
+            double abs_diff = fabs(diff[channel]);
+            quality.mean_abs_diff += abs_diff;
+            quality.max_abs_diff = MAX(quality.max_abs_diff, abs_diff);
+            squared_sum += diff[channel] * diff[channel];
+        }
+    }
+    quality.mean_abs_diff /= (double) channel_number;
+    double mse = squared_sum / (double) channel_number;
+    quality.psnr_db = (mse > 0.0) ? 10.0 * log10(1.0 / mse) : INFINITY;
+
+    return quality;
+}
+
+void bench_build_accel(bench_context *ctx, map *m) {
+    double build_start = bench_now_ms();
+    for(int32 accel_index = 0;
+        accel_index < ctx->accels_length;
+        ++accel_index) {
+        if (ctx->accels[accel_index].build) {
+            ctx->accels[accel_index].build(m, ctx->pool);
+        }
+    }
+    bench_record(ctx, "build_accel", bench_now_ms() - build_start);
+}
+
+void bench_run_cascades(bench_context *ctx, bench_scene scene) {
+    static const char *generate_names[] = {
+        "generate_cascade0", "generate_cascade1", "generate_cascade2",
+        "generate_cascade3", "generate_cascade4", "generate_cascade5",
+        "generate_cascade6", "generate_cascade7", "generate_cascade8",
+        "generate_cascade9", "generate_cascade10", "generate_cascade11",
+    };
+
+    map m = map_create(WIDTH, HEIGHT);
+    scene.init(m);
+    bench_build_accel(ctx, &m);
+
+    if (ctx->arena.data == NULL) {
+        double arena_start = bench_now_ms();
+        ctx->arena = ctx->fused ?
+            cascade_arena_create_pipelined(m, CASCADE_NUMBER) :
+            cascade_arena_create(m, CASCADE_NUMBER);
+        bench_record(ctx, "arena_create", bench_now_ms() - arena_start);
+    }
+    radiance_cascade *cascades = ctx->arena.cascades;
+
+    double solve_start = bench_now_ms();
+
+    if (ctx->fused) {
+        double generate_and_merge_start = bench_now_ms();
+        cascades_generate_and_merge(m, cascades, CASCADE_NUMBER);
+        bench_record(ctx, "generate_and_merge",
+                bench_now_ms() - generate_and_merge_start);
+        if (ctx->repetition == 0) {
+            ctx->generate_rss_kb = bench_current_rss_kb();
+        }
+    } else {
+        double generate_start = bench_now_ms();
+        for(int32 cascade_index = 0;
+            cascade_index < CASCADE_NUMBER;
+            ++cascade_index) {
+            double cascade_start = bench_now_ms();
+            cascade_generate(m, &cascades[cascade_index], cascade_index);
+            if (cascade_index < (int32) ARR_LEN(generate_names)) {
+                bench_record(ctx, generate_names[cascade_index],
+                        bench_now_ms() - cascade_start);
+            }
+        }
+        bench_record(ctx, "generate", bench_now_ms() - generate_start);
+        if (ctx->repetition == 0) {
+            // the cascades memory the generation really touched
+            ctx->generate_rss_kb = bench_current_rss_kb();
+        }
+
+#if APPLY_SKYBOX != 0
+        double skybox_start = bench_now_ms();
+        cascade_apply_skybox(&cascades[CASCADE_NUMBER - 1], SKYBOX);
+        bench_record(ctx, "skybox", bench_now_ms() - skybox_start);
+#endif
+
+        double merge_start = bench_now_ms();
+        bench_counters_start(ctx);
+        cascades_merge(cascades, CASCADE_NUMBER);
+        bench_counters_stop(ctx);
+        bench_record(ctx, "merge", bench_now_ms() - merge_start);
+    }
+
+    double to_map_start = bench_now_ms();
+    cascades_to_map(m, cascades, CASCADE_NUMBER);
+    bench_record(ctx, "to_map", bench_now_ms() - to_map_start);
+
+    bench_record(ctx, "total", bench_now_ms() - solve_start);
+
+    ctx->rays_per_solve = 0;
+    for(int32 cascade_index = 0;
+        cascade_index < CASCADE_NUMBER;
+        ++cascade_index) {
+        ctx->rays_per_solve += cascades[cascade_index].data_length;
+    }
+
+    ctx->checksum = bench_map_checksum(m);
+    bench_keep_result(ctx, m);
+    map_free(&m);
+}
+
+void bench_run_instant(bench_context *ctx, bench_scene scene) {
+    map m_read = map_create(WIDTH, HEIGHT);
+    scene.init(m_read);
+    map m = map_copy(m_read);
+    // only m_read is used for tracing
+    bench_build_accel(ctx, &m_read);
+
+    double solve_start = bench_now_ms();
+    // the rays the solver really cast, the rows of the cached rows are
+    // traced again when they move
+#if BILINEAR_FIX_INSTANT_CASCADES != 0
+    ctx->rays_per_solve = calculate_cascades_and_apply_to_map(
+            m_read, m, CASCADE_NUMBER);
+#else
+    radiance_cascade cascade = cascade_instant_init(m);
+    ctx->rays_per_solve = cascade_instant_generate_and_apply(
+            m_read, m, cascade, CASCADE_NUMBER);
+#endif
+    double solve_ms = bench_now_ms() - solve_start;
+    bench_record(ctx, "generate_and_apply", solve_ms);
+    bench_record(ctx, "total", solve_ms);
+
+    ctx->checksum = bench_map_checksum(m);
+    bench_keep_result(ctx, m);
+    map_free(&m);
+    map_free(&m_read);
+}
+
+int bench_compare_double(const void *a, const void *b) {
+    double da = *(const double *) a;
+    double db = *(const double *) b;
+    return (da > db) - (da < db);
+}
+
+int bench_compare_uint64(const void *a, const void *b) {
+    uint64 ua = *(const uint64 *) a;
+    uint64 ub = *(const uint64 *) b;
+    return (ua > ub) - (ua < ub);
+}
+
+void bench_report(
+        FILE *out,
+        bench_context *ctx,
+        bench_scene scene,
+        bench_mode mode) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    fprintf(out, "{\n");
+    fprintf(out, "  \"scene\": \"%s\",\n", scene.name);
+    fprintf(out, "  \"mode\": \"%s\",\n", mode.name);
+    fprintf(out, "  \"repetitions\": %d,\n", ctx->repetitions);
+    fprintf(out, "  \"threads\": %d,\n", ctx->thread_number);
+    fprintf(out, "  \"accel\": \"%s\",\n", ctx->accel_names);
+    fprintf(out, "  \"traversal\": \"%s\",\n", ctx->traversal.name);
+    fprintf(out, "  \"generator\": \"%s\",\n", ctx->generator.name);
+    fprintf(out, "  \"mip_policy\": \"%s\",\n", ctx->mip_policy.name);
+    fprintf(out, "  \"layout\": \"%s\",\n", ctx->layout.name);
+    fprintf(out, "  \"ray_encoding\": \"%s\",\n", ctx->ray_encoding.name);
+    fprintf(out, "  \"fused\": %s,\n", ctx->fused ? "true" : "false");
+    fprintf(out, "  \"gather\": \"%s\",\n", ctx->gather.name);
+    fprintf(out, "  \"storage\": \"%s\",\n",
+            (CASCADE_STORAGE == CASCADE_STORAGE_F16) ? "f16" : "f32");
+    fprintf(out, "  \"isa\": \"%s\",\n", cpu_isa_name(cpu_isa()));
+    fprintf(out, "  \"map\": { \"w\": %d, \"h\": %d },\n", WIDTH, HEIGHT);
+    fprintf(out, "  \"cascades\": %d,\n", CASCADE_NUMBER);
+    fprintf(out, "  \"rays_per_solve\": %llu,\n",
+            (unsigned long long) ctx->rays_per_solve);
+    // ru_maxrss is in kilobytes on linux
+    fprintf(out, "  \"peak_rss_kb\": %ld,\n", usage.ru_maxrss);
+    if (ctx->generate_rss_kb > 0) {
+        fprintf(out, "  \"generate_rss_kb\": %lld,\n",
+                (long long) ctx->generate_rss_kb);
+    } else {
+        fprintf(out, "  \"generate_rss_kb\": null,\n");
+    }
+    fprintf(out, "  \"checksum\": \"%016llx\",\n",
+            (unsigned long long) ctx->checksum);
+    if (ctx->quality) {
+        bench_quality *quality = &ctx->quality_report;
+        // JSON has no infinity, identical maps get a null psnr
+        char psnr[32] = "null";
+        if (isfinite(quality->psnr_db)) {
+            snprintf(psnr, sizeof(psnr), "%.3f", quality->psnr_db);
+        }
+        fprintf(out,
+                "  \"quality\": { \"reference\": \"full_resolution\", "
+                "\"reference_total_ms\": %.3f, \"mean_abs_diff\": %.6g, "
+                "\"max_abs_diff\": %.6g, \"psnr_db\": %s },\n",
+                quality->reference_total_ms,
+                quality->mean_abs_diff,
+                quality->max_abs_diff,
+                psnr);
+    }
+    // medians, null when the counter is not readable (or the mode has no merge)
+    fprintf(out, "  \"merge_counters\": {");
+    for(int32 counter_index = 0;
+        counter_index < BENCH_COUNTER_NUMBER;
+        ++counter_index) {
+        bench_counter *counter = &ctx->counters[counter_index];
+        if (counter->name == NULL) continue;
+        char value[32] = "null";
+        if (counter->fd >= 0 && counter->samples_length > 0) {
+            qsort(counter->samples, counter->samples_length, sizeof(uint64),
+                    bench_compare_uint64);
+            snprintf(value, sizeof(value), "%llu", (unsigned long long)
+                    counter->samples[(counter->samples_length - 1) / 2]);
+        }
+        fprintf(out, "%s \"%s\": %s",
+                (counter_index > 0) ? "," : "",
+                counter->name,
+                value);
+    }
+    fprintf(out, " },\n");
+    fprintf(out, "  \"phases\": {\n");
+    for(int32 phase_index = 0;
+        phase_index < ctx->phases_length;
+        ++phase_index) {
+        bench_phase *phase = &ctx->phases[phase_index];
+        qsort(phase->samples, phase->samples_length, sizeof(double),
+                bench_compare_double);
+
+        // nearest-rank percentiles
+        int32 last = phase->samples_length - 1;
+        int32 median_index = last / 2;
+        int32 p95_index = (int32) ceil(0.95 * phase->samples_length) - 1;
+        p95_index = CLAMP(p95_index, 0, last);
+
+        fprintf(out,
+                "    \"%s\": { \"min_ms\": %.3f, \"median_ms\": %.3f, "
+                "\"p95_ms\": %.3f }%s\n",
+                phase->name,
+                phase->samples[0],
+                phase->samples[median_index],
+                phase->samples[p95_index],
+                (phase_index < ctx->phases_length - 1) ? "," : "");
+    }
+    fprintf(out, "  }\n");
+    fprintf(out, "}\n");
+}
+
+// the report of each layout, then their totals side by side: the phases
+// each layout recorded, and whether they all solved the same map
+void bench_report_layouts(
+        FILE *out,
+        bench_context *contexts,
+        int32 contexts_length,
+        bench_scene scene,
+        bench_mode mode) {
+    fprintf(out, "{\n");
+    fprintf(out, "  \"compare\": \"layout\",\n");
+    fprintf(out, "  \"reports\": [\n");
+    for(int32 i = 0; i < contexts_length; ++i) {
+        // indented to sit inside the array
+        char *text = NULL;
+        size_t text_length = 0;
+        FILE *buffer = open_memstream(&text, &text_length);
+        bench_report(buffer, &contexts[i], scene, mode);
+        fclose(buffer);
+        for(char *line = strtok(text, "\n");
+            line != NULL;
+            line = strtok(NULL, "\n")) {
+            char *next = line + strlen(line) + 1;
+            int32 last = (next >= text + text_length);
+            fprintf(out, "    %s%s\n",
+                    line,
+                    (last && i < contexts_length - 1) ? "," : "");
+        }
+        free(text);
+    }
+    fprintf(out, "  ],\n");
+
+    int32 checksums_equal = 1;
+    for(int32 i = 1; i < contexts_length; ++i) {
+        if (contexts[i].checksum != contexts[0].checksum) checksums_equal = 0;
+    }
+    fprintf(out, "  \"checksums_equal\": %s,\n",
+            checksums_equal ? "true" : "false");
+
+    // min and median of each phase, the samples are sorted by bench_report
+    fprintf(out, "  \"phases\": {\n");
+    bench_context *first = &contexts[0];
+    for(int32 phase_index = 0;
+        phase_index < first->phases_length;
+        ++phase_index) {
+        const char *name = first->phases[phase_index].name;
+        fprintf(out, "    \"%s\": {", name);
+        for(int32 i = 0; i < contexts_length; ++i) {
+            bench_phase *phase = NULL;
+            for(int32 j = 0; j < contexts[i].phases_length; ++j) {
+                if (strcmp(contexts[i].phases[j].name, name) == 0) {
+                    phase = &contexts[i].phases[j];
+                }
+            }
+            fprintf(out, "%s \"%s\": ",
+                    (i > 0) ? "," : "",
+                    contexts[i].layout.name);
+            if (phase == NULL || phase->samples_length == 0) {
+                fprintf(out, "null");
+                continue;
+            }
+            fprintf(out, "{ \"min_ms\": %.3f, \"median_ms\": %.3f }",
+                    phase->samples[0],
+                    phase->samples[(phase->samples_length - 1) / 2]);
+        }
+        fprintf(out, " }%s\n",
+                (phase_index < first->phases_length - 1) ? "," : "");
+    }
+    fprintf(out, "  }\n");
+    fprintf(out, "}\n");
+}
+
+// the repetitions of `mode` with the settings of ctx, then the full
+// resolution reference if `quality`
+void bench_solve(
+        bench_context *ctx,
+        bench_scene scene,
+        bench_mode mode,
+        int32 quality) {
+    cascades_set_layout(ctx->layout.layout);
+    bench_counters_open(ctx);
+
+    for(ctx->repetition = 0;
+        ctx->repetition < ctx->repetitions;
+        ++ctx->repetition) {
+        fprintf(stderr, "[bench] %s/%s repetition %d/%d\n",
+                scene.name, mode.name,
+                ctx->repetition + 1, ctx->repetitions);
+        mode.run(ctx, scene);
+        fflush(stdout);
+    }
+
+    if (quality) {
+        // same solve with every cascade tracing the full resolution map,
+        // not part of the timed phases
+        bench_context reference = *ctx;
+        reference.repetitions = 1;
+        reference.repetition = 0;
+        reference.phases_length = 0;
+        reference.result = NULL;
+        cascades_set_mip_policy(CASCADE_MIP_OFF);
+        fprintf(stderr, "[bench] %s/%s full resolution reference\n",
+                scene.name, mode.name);
+        mode.run(&reference, scene);
+        fflush(stdout);
+        cascades_set_mip_policy(ctx->mip_policy.mip_policy);
+
+        ctx->quality = 1;
+        ctx->quality_report = bench_compare_result(ctx, &reference);
+        for(int32 phase_index = 0;
+            phase_index < reference.phases_length;
+            ++phase_index) {
+            bench_phase *phase = &reference.phases[phase_index];
+            if (strcmp(phase->name, "total") == 0) {
+                ctx->quality_report.reference_total_ms = phase->samples[0];
+            }
+            free(phase->samples);
+        }
+        free(reference.result);
+    }
+}
+
+void bench_context_free(bench_context *ctx) {
+    for(int32 phase_index = 0;
+        phase_index < ctx->phases_length;
+        ++phase_index) {
+        free(ctx->phases[phase_index].samples);
+    }
+    free(ctx->result);
+    bench_counters_close(ctx);
+    cascade_arena_free(&ctx->arena);
+}
+
+int main(int argc, char **argv) {
+    bench_scene scene = scenes[0];
+    bench_mode mode = modes[0];
+    int32 repetitions = 3;
+    int32 thread_number = CASCADE_THREAD_NUMBER;
+    const char *accel_names = accels[0].name;
+    bench_traversal traversal = traversals[MAP_RAY_TRAVERSAL];
+    bench_generator generator = generators[CASCADE_GENERATOR];
+    bench_mip_policy mip_policy = mip_policies[CASCADE_MIP_POLICY];
+    bench_layout layout = layouts[CASCADE_LAYOUT];
+    bench_ray_encoding ray_encoding = ray_encodings[CASCADE_RAY_ENCODING];
+    bench_gather gather = gathers[CASCADE_GATHER];
+    int32 quality = 0;
+    int32 fused = 0;
+    int32 all_layouts = 0;
+
+    for(int32 arg_index = 1; arg_index < argc; ++arg_index) {
+        const char *arg = argv[arg_index];
+        const char *value = (arg_index + 1 < argc) ? argv[arg_index + 1] : NULL;
+
+        if (value && strcmp(arg, "-s") == 0) {
+            int32 found = 0;
+            for(int32 i = 0; i < (int32) ARR_LEN(scenes); ++i) {
+                if (strcmp(scenes[i].name, value) == 0) {
+                    scene = scenes[i];
+                    found = 1;
+                }
+            }
+            if (!found) {
+                fprintf(stderr, "[ERROR] Unknown scene: %s\n", value);
+                return 1;
+            }
+            ++arg_index;
+        } else if (value && strcmp(arg, "-m") == 0) {
+            int32 found = 0;
+            for(int32 i = 0; i < (int32) ARR_LEN(modes); ++i) {
+                if (strcmp(modes[i].name, value) == 0) {
+                    mode = modes[i];
+                    found = 1;
+                }
+            }
+            if (!found) {
+                fprintf(stderr, "[ERROR] Unknown mode: %s\n", value);
+                return 1;
+            }
+            ++arg_index;
+        } else if (value && strcmp(arg, "-n") == 0) {
+            repetitions = atoi(value);
+            if (repetitions <= 0) {
+                fprintf(stderr, "[ERROR] Invalid repetitions: %s\n", value);
+                return 1;
+            }
+            ++arg_index;
+        } else if (value && strcmp(arg, "-a") == 0) {
+            accel_names = value;
+            ++arg_index;
+        } else if (value && strcmp(arg, "-r") == 0) {
+            int32 found = 0;
+            for(int32 i = 0; i < (int32) ARR_LEN(traversals); ++i) {
+                if (strcmp(traversals[i].name, value) == 0) {
+                    traversal = traversals[i];
+                    found = 1;
+                }
+            }
+            if (!found) {
+                fprintf(stderr, "[ERROR] Unknown traversal: %s\n", value);
+                return 1;
+            }
+            ++arg_index;
+        } else if (value && strcmp(arg, "-g") == 0) {
+            int32 found = 0;
+            for(int32 i = 0; i < (int32) ARR_LEN(generators); ++i) {
+                if (strcmp(generators[i].name, value) == 0) {
+                    generator = generators[i];
+                    found = 1;
+                }
+            }
+            if (!found) {
+                fprintf(stderr, "[ERROR] Unknown generator: %s\n", value);
+                return 1;
+            }
+            ++arg_index;
+        } else if (value && strcmp(arg, "-p") == 0) {
+            int32 found = 0;
+            for(int32 i = 0; i < (int32) ARR_LEN(mip_policies); ++i) {
+                if (strcmp(mip_policies[i].name, value) == 0) {
+                    mip_policy = mip_policies[i];
+                    found = 1;
+                }
+            }
+            if (!found) {
+                fprintf(stderr, "[ERROR] Unknown mip policy: %s\n", value);
+                return 1;
+            }
+            ++arg_index;
+        } else if (value && strcmp(arg, "-l") == 0) {
+            // "all" runs every layout, one after the other
+            int32 found = all_layouts = (strcmp(value, "all") == 0);
+            for(int32 i = 0; i < (int32) ARR_LEN(layouts); ++i) {
+                if (strcmp(layouts[i].name, value) == 0) {
+                    layout = layouts[i];
+                    found = 1;
+                }
+            }
+            if (!found) {
+                fprintf(stderr, "[ERROR] Unknown layout: %s\n", value);
+                return 1;
+            }
+            ++arg_index;
+        } else if (value && strcmp(arg, "-e") == 0) {
+            int32 found = 0;
+            for(int32 i = 0; i < (int32) ARR_LEN(ray_encodings); ++i) {
+                if (strcmp(ray_encodings[i].name, value) == 0) {
+                    ray_encoding = ray_encodings[i];
+                    found = 1;
+                }
+            }
+            if (!found) {
+                fprintf(stderr, "[ERROR] Unknown ray encoding: %s\n", value);
+                return 1;
+            }
+            ++arg_index;
+        } else if (value && strcmp(arg, "-c") == 0) {
+            int32 found = 0;
+            for(int32 i = 0; i < (int32) ARR_LEN(gathers); ++i) {
+                if (strcmp(gathers[i].name, value) == 0) {
+                    gather = gathers[i];
+                    found = 1;
+                }
+            }
+            if (!found) {
+                fprintf(stderr, "[ERROR] Unknown gather: %s\n", value);
+                return 1;
+            }
+            ++arg_index;
+        } else if (strcmp(arg, "-f") == 0) {
+            fused = 1;
+        } else if (strcmp(arg, "-q") == 0) {
+            quality = 1;
+        } else if (value && strcmp(arg, "-t") == 0) {
+            // 0 means one thread for each core
+            thread_number = atoi(value);
+            if (thread_number < 0) {
+                fprintf(stderr, "[ERROR] Invalid threads: %s\n", value);
+                return 1;
+            }
+            ++arg_index;
+        } else {
+            fprintf(stderr,
+                    "usage: %s [-s scene] [-m mode] [-n repetitions] "
+                    "[-t threads] [-a accel,...] [-r traversal] "
+                    "[-g generator] [-p mip_policy] [-l layout] "
+                    "[-e ray_encoding] [-f] [-c gather] [-q]\n",
+                    argv[0]);
+            fprintf(stderr,
+                    "-n solves (default 3), -t threads, -a accels to build "
+                    "(comma separated)\n"
+                    "-p the mip level each cascade traces (needs the mip "
+                    "accel)\n"
+                    "-f merges each cascade as soon as it is generated, "
+                    "generate and merge timed as one phase\n"
+                    "-c traced traces the rays of cascade0 again in the "
+                    "final gather instead of storing them\n"
+                    "-q solves once more at full resolution and reports "
+                    "the difference\n"
+                    "the merge counters are for the calling thread only, "
+                    "use -t 1 to count all of it\n"
+                    "-DCASCADE_STORAGE=1 builds with half float cascades\n"
+                    "%s=scalar, sse41, avx2 or avx512 forces the SIMD "
+                    "kernels (see cpu.h)\n",
+                    CPU_ISA_ENV);
+            fprintf(stderr, "scenes:");
+            for(int32 i = 0; i < (int32) ARR_LEN(scenes); ++i) {
+                fprintf(stderr, " %s", scenes[i].name);
+            }
+            fprintf(stderr, "\nmodes:");
+            for(int32 i = 0; i < (int32) ARR_LEN(modes); ++i) {
+                fprintf(stderr, " %s", modes[i].name);
+            }
+            fprintf(stderr, "\naccels:");
+            for(int32 i = 0; i < (int32) ARR_LEN(accels); ++i) {
+                fprintf(stderr, " %s", accels[i].name);
+            }
+            fprintf(stderr, "\ntraversals:");
+            for(int32 i = 0; i < (int32) ARR_LEN(traversals); ++i) {
+                fprintf(stderr, " %s", traversals[i].name);
+            }
+            fprintf(stderr, "\ngenerators:");
+            for(int32 i = 0; i < (int32) ARR_LEN(generators); ++i) {
+                fprintf(stderr, " %s", generators[i].name);
+            }
+            fprintf(stderr, "\nmip policies:");
+            for(int32 i = 0; i < (int32) ARR_LEN(mip_policies); ++i) {
+                fprintf(stderr, " %s", mip_policies[i].name);
+            }
+            fprintf(stderr, "\nlayouts:");
+            for(int32 i = 0; i < (int32) ARR_LEN(layouts); ++i) {
+                fprintf(stderr, " %s", layouts[i].name);
+            }
+            fprintf(stderr, " all");
+            fprintf(stderr, "\nray encodings:");
+            for(int32 i = 0; i < (int32) ARR_LEN(ray_encodings); ++i) {
+                fprintf(stderr, " %s", ray_encodings[i].name);
+            }
+            fprintf(stderr, "\ngathers:");
+            for(int32 i = 0; i < (int32) ARR_LEN(gathers); ++i) {
+                fprintf(stderr, " %s", gathers[i].name);
+            }
+            fprintf(stderr, "\n");
+            fprintf(stderr,
+                    "-l all runs each layout in turn and compares them, "
+                    "peak_rss_kb is the whole process\n"
+                    "and the direction layout merges without the SIMD "
+                    "kernel (RC_ISA=scalar for equal checksums)\n");
+            return 1;
+        }
+    }
+
+    if (all_layouts && strcmp(mode.name, "cascades") != 0) {
+        fprintf(stderr, "[ERROR] -l all needs the cascades mode\n");
+        return 1;
+    }
+
+    // keep stdout for the report only, everything else goes to stderr
+    fflush(stdout);
+    int report_fd = dup(STDOUT_FILENO);
+    dup2(STDERR_FILENO, STDOUT_FILENO);
+    FILE *report = fdopen(report_fd, "w");
+    if (report == NULL) {
+        fprintf(stderr, "[ERROR] Failed to open report output\n");
+        return 1;
+    }
+
+    // the SIMD kernels, picked before any thread can ask
+    cpu_isa();
+
+    // created once, reused by every repetition
+    thread_pool *pool = thread_pool_create(thread_number);
+    cascades_set_thread_pool(pool);
+
+    bench_context ctx = {
+        .repetitions = repetitions,
+        .thread_number = pool->thread_number,
+        .pool = pool,
+        .accel_names = accel_names,
+        .traversal = traversal,
+        .generator = generator,
+        .mip_policy = mip_policy,
+        .layout = layout,
+        .ray_encoding = ray_encoding,
+        .gather = gather,
+        .fused = fused,
+    };
+    map_set_ray_traversal(traversal.traversal);
+    cascades_set_generator(generator.generator);
+    cascades_set_mip_policy(mip_policy.mip_policy);
+    cascades_set_ray_encoding(ray_encoding.ray_encoding);
+    cascades_set_gather(gather.gather);
+
+    // comma separated, built on the map in the given order
+    char accel_buffer[256];
+    snprintf(accel_buffer, sizeof(accel_buffer), "%s", accel_names);
+    for(char *accel_name = strtok(accel_buffer, ",");
+        accel_name != NULL;
+        accel_name = strtok(NULL, ",")) {
+        int32 found = 0;
+        for(int32 i = 0; i < (int32) ARR_LEN(accels); ++i) {
+            if (strcmp(accels[i].name, accel_name) == 0 &&
+                ctx.accels_length < BENCH_MAX_ACCELS) {
+                ctx.accels[ctx.accels_length++] = accels[i];
+                found = 1;
+            }
+        }
+        if (!found) {
+            fprintf(stderr, "[ERROR] Unknown accel: %s\n", accel_name);
+            return 1;
+        }
+    }
+
+    if (all_layouts) {
+        // one context for each layout, same settings otherwise
+        bench_context contexts[ARR_LEN(layouts)];
+        for(int32 i = 0; i < (int32) ARR_LEN(layouts); ++i) {
+            contexts[i] = ctx;
+            contexts[i].layout = layouts[i];
+            bench_solve(&contexts[i], scene, mode, quality);
+        }
+        bench_report_layouts(
+                report, contexts, (int32) ARR_LEN(layouts), scene, mode);
+        fclose(report);
+        for(int32 i = 0; i < (int32) ARR_LEN(layouts); ++i) {
+            bench_context_free(&contexts[i]);
+        }
+    } else {
+        bench_solve(&ctx, scene, mode, quality);
+        bench_report(report, &ctx, scene, mode);
+        fclose(report);
+        bench_context_free(&ctx);
+    }
+
+    cascades_set_thread_pool(NULL);
+    thread_pool_destroy(pool);
+
+    return 0;
+}
@@ -2,13 +2,22 @@
 #define _RC_CASCADES_H_
 
 #include <stdlib.h>
+#include <assert.h>
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+#include "threads.h"
+#include "cpu.h"
 
 // ### CASCADES PARAMETERS ###
 #define CASCADE_NUMBER 8
 
 #define MERGE_CASCADES 1
 
+#ifndef APPLY_SKYBOX // can be picked when compiling, e.g. for the bench
 #define APPLY_SKYBOX 0
+#endif
 
 #define APPLY_CASCADE_TO_MAP 1
 #define CASCADE_TO_APPLY_TO_MAP 0
@@ -26,24 +35,313 @@
 #define INTERVAL_OVERLAP 0.f // from 0 (no overlap) to 1 (full overlap)
 // ###########################
 
+// ### THREADING PARAMETERS ###
+#define CASCADE_THREAD_NUMBER 0 // 0 means one thread for each core
+#define CASCADE_GENERATE_TILE_SIZE 16 // probes per side of a generate job
+#define CASCADE_MERGE_L2_SIZE (256 * 1024) // bytes, to size the merge tiles
+// ###########################
+
+// ### GENERATOR PARAMETERS ###
+#define CASCADE_GENERATE_RAYS 0 // one ray for each probe and direction
+#define CASCADE_GENERATE_SWEEP 1 // one sweep of the map for each direction
+#define CASCADE_GENERATOR CASCADE_GENERATE_RAYS
+// generate and merge from the last cascade down, with only two levels of
+// memory (see cascades_generate_and_merge and cascade_arena_create_pipelined)
+#define CASCADE_GENERATE_AND_MERGE 0
+// ###########################
+
+// ### GATHER PARAMETERS ###
+// where the final gather (cascades_to_map) takes the rays of cascade0 from
+#define CASCADE_GATHER_STORED 0 // generated and merged into cascade0 data
+#define CASCADE_GATHER_TRACED 1 // traced by the gather and merged with
+                                // cascade1 there, cascade0 has no data
+#define CASCADE_GATHER CASCADE_GATHER_STORED
+// ###########################
+
+// ### MIP PARAMETERS ###
+// which level of the map mip chain (see map_build_mip) a cascade traces
+#define CASCADE_MIP_OFF 0 // full resolution for every cascade
+#define CASCADE_MIP_SPACING 1 // level with texels as big as the probe spacing
+#define CASCADE_MIP_INTERVAL 2 // about CASCADE_MIP_STEPS texels along a ray
+#define CASCADE_MIP_POLICY CASCADE_MIP_OFF
+#define CASCADE_MIP_FIRST_CASCADE 3 // lower cascades stay at full resolution
+#define CASCADE_MIP_STEPS 16
+// ###########################
+
+// ### LAYOUT PARAMETERS ###
+// order of the values inside a row of probes of a cascade
+#define CASCADE_LAYOUT_PROBE_MAJOR 0 // the directions of a probe are contiguous
+#define CASCADE_LAYOUT_DIRECTION_MAJOR 1 // the probes of a direction are contiguous
+#define CASCADE_LAYOUT_MORTON 2 // probe major, probes in Z-order tiles
+#define CASCADE_LAYOUT CASCADE_LAYOUT_PROBE_MAJOR
+#define CASCADE_MORTON_TILE_SIZE 8 // probes per side of a tile, power of 2
+// ###########################
+
+// ### RAY ENCODING PARAMETERS ###
+// how cascade_generate stores the rays, until they are merged
+#define CASCADE_RAYS_FULL 0 // straight into data
+#define CASCADE_RAYS_PALETTE 1 // a byte per ray: 0 on a miss, else the
+                               // palette index of the pixel hit (needs the
+                               // map occupancy, not used with the mip chain)
+#define CASCADE_RAY_ENCODING CASCADE_RAYS_FULL
+// ###########################
+
+// ### STORAGE PARAMETERS ###
+// type of the values of radiance_cascade.data, math is always done in vec4f
+#define CASCADE_STORAGE_F32 0 // vec4f, 16 bytes for each ray
+#define CASCADE_STORAGE_F16 1 // vec4h, 8 bytes for each ray (F16C with -mf16c)
+#ifndef CASCADE_STORAGE // can be picked when compiling, e.g. for the bench
+#define CASCADE_STORAGE CASCADE_STORAGE_F32
+#endif
+// ###########################
+
+// ### MEMORY PARAMETERS ###
+// back the cascade arena with huge pages when the system has them
+#define CASCADE_ARENA_HUGE_PAGES 1
+#define CASCADE_ARENA_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+#define CASCADE_ARENA_ALIGNMENT 64 // bytes, each level starts on a cache line
+// ###########################
+
+#if CASCADE_STORAGE == CASCADE_STORAGE_F16
+typedef vec4h cascade_texel;
+#define CASCADE_TEXEL_GL_TYPE GL_HALF_FLOAT
+#else
+typedef vec4f cascade_texel;
+#define CASCADE_TEXEL_GL_TYPE GL_FLOAT
+#endif
+
+// NOTE(gio): the merge does 8 directions at a time on AVX2 hosts (see
+//              cpu_isa), only for pairs of directions up to average, and 4
+//              at a time on SSE4.1 hosts
+#if CPU_DISPATCH && ANGULAR_SCALING % 2 == 0
+#define CASCADE_MERGE_AVX2 1
+#else
+#define CASCADE_MERGE_AVX2 0
+#endif
+
 typedef struct radiance_cascade {
-    vec4f *data;
+    cascade_texel *data;
     int32 data_length;
+    int32 stride; // texels from a row of probes to the next one
+    int32 atlas_row; // first row of the level in its cascade_arena atlas
+    int32 layout; // CASCADE_LAYOUT_PROBE_MAJOR, ...
+    int32 probe_step; // texels from a probe to the next one in a row (not morton)
+    int32 direction_step; // texels from a direction to the next one
     vec2i probe_number;
     int32 angular_number;
     vec2f interval;
     vec2f probe_size;
+    map_ray_template *templates; // one for each direction
+    int32 mip_level; // of the map traced by the rays, 0 is full resolution
+    int32 in_arena; // data belongs to a cascade_arena, not freed with it
+    // NOTE(gio): with CASCADE_RAYS_PALETTE the rays are in `rays`, at the
+    //              same offsets they would have in data, until merged.
+    //              palette is NULL when data holds the rays.
+    uint8 *rays;
+    vec4f *palette; // of the map occupancy, colors of the ray codes
+    uint8 *palette_lookup; // of the map occupancy, codes of the colors
 } radiance_cascade;
 
+#define CASCADE_ARENA_PAGES_NORMAL 0
+#define CASCADE_ARENA_PAGES_TRANSPARENT 1 // transparent huge pages (madvise)
+#define CASCADE_ARENA_PAGES_HUGE 2 // explicit huge pages (MAP_HUGETLB)
+
+// NOTE(gio): the data of every cascade level in a single allocation, sized
+//              up front from the cascade parameters. Every value is written
+//              by cascade_generate before being read, so a second solve
+//              reuses it as it is: no allocation, no zeroing, no page faults
+//              The allocation is an atlas: one 2D texture `atlas_size` wide
+//              with the levels stacked by rows, each level starting at its
+//              `atlas_row` and using the atlas width as stride.
+//              A pipelined arena only has two slots of rows, the even
+//              levels share the first one and the odd levels the second
+typedef struct cascade_arena {
+    radiance_cascade *cascades; // levels with data pointing into `data`
+    int32 cascades_number;
+    cascade_texel *data;
+    uint8 *rays; // a byte for each texel, see CASCADE_RAYS_PALETTE
+    vec2i atlas_size; // in texels, x is the stride of every level
+    size_t bytes;
+    int32 mapped; // 1 if data comes from mmap, 0 from calloc
+    int32 pages; // CASCADE_ARENA_PAGES_NORMAL, ...
+    int32 pipelined; // 1 if levels share two slots
+} cascade_arena;
+
+// NOTE(bilinear): the two probes, along one axis, around a coordinate of a
+//                  lower level (or a pixel) and their weights. A probe
+//                  outside the level gets no weight (and a clamped index),
+//                  the other one all of it: the same as a border of copies
+//                  of the edge probes, without storing it. The 2D taps are
+//                  the products of the taps of x and y.
+//                  This is why the levels here have no padded rows (only
+//                  the cached rows of cascades_instant.h do): the 4 loads
+//                  are already unconditional and in bounds, with no
+//                  branches, and an edge probe times 1 plus its clamped
+//                  copy times 0 is the edge probe to the bit, the average
+//                  of the valid taps. A border would only add memory and a
+//                  fill pass for each level.
+typedef struct cascade_tap {
+    int32 index[2];
+    float weight[2];
+} cascade_tap;
+
+typedef struct cascade_generate_job {
+    map m;
+    radiance_cascade cascade;
+    vec2i tile_number;
+} cascade_generate_job;
+
+typedef struct cascade_sweep_job {
+    map m;
+    radiance_cascade cascade;
+    // one for each thread of the pool (see thread_pool_thread_index),
+    // grown by the thread as needed
+    int32 **next_hit;
+    int64 *next_hit_length;
+} cascade_sweep_job;
+
+typedef struct cascade_merge_job {
+    radiance_cascade cascade;
+    radiance_cascade cascade_up;
+    vec2i tile_size; // in probes
+    int32 tiles_x; // tiles in a row of tiles
+    cascade_tap *taps_x; // into cascade_up, one for each probe column
+    cascade_tap *taps_y; // into cascade_up, one for each probe row
+} cascade_merge_job;
+
+typedef struct cascade_fluence_job {
+    map m;
+    radiance_cascade cascade;
+    radiance_cascade cascade_up; // only for the traced gather
+    vec4f *fluence; // one value for each probe
+    cascade_tap *taps_x; // into the probes for each pixel column, or into
+    cascade_tap *taps_y; // cascade_up for each probe with the traced gather
+} cascade_fluence_job;
+
+#ifndef RADIANCE_CASCADES_HEADLESS
 texture
 cascade_generate_texture(radiance_cascade cascade);
 
+texture
+cascade_arena_generate_texture(cascade_arena arena);
+#endif
+
+cascade_texel
+cascade_texel_pack(vec4f v, int32 isa);
+
+vec4f
+cascade_texel_unpack(cascade_texel texel, int32 isa);
+
+void
+cascade_texels_pack(cascade_texel *dst, vec4f *src, int32 n, int32 isa);
+
+vec4f *
+cascade_texels_unpack(
+        vec4f *scratch,
+        cascade_texel *texels,
+        int32 n,
+        int32 isa);
+
+uint8
+cascade_ray_encode(radiance_cascade *cascade, vec4f ray);
+
+vec4f
+cascade_ray_decode(radiance_cascade *cascade, uint8 code);
+
+void
+cascade_store_rays(
+        radiance_cascade *cascade,
+        int64 offset,
+        vec4f *rays,
+        int32 n,
+        int32 isa);
+
+void
+cascade_expand_rays(radiance_cascade *cascade);
+
+int64
+cascade_probe_offset(radiance_cascade *cascade, int32 probe_x, int32 probe_y);
+
+cascade_texel *
+cascade_probe(radiance_cascade *cascade, int32 probe_x, int32 probe_y);
+
+int64
+cascade_morton_offset(radiance_cascade *cascade, int32 probe_x, int32 probe_y);
+
+vec2i
+cascade_morton_probe(
+        radiance_cascade *cascade,
+        int32 tile_start,
+        int32 band_start,
+        int32 local_index);
+
+void
+cascades_set_thread_pool(thread_pool *pool);
+
+void
+cascades_set_generator(int32 generator);
+
+void
+cascades_set_mip_policy(int32 mip_policy);
+
+void
+cascades_set_layout(int32 layout);
+
+void
+cascades_set_ray_encoding(int32 ray_encoding);
+
+void
+cascades_set_gather(int32 gather);
+
+void
+cascade_apply_layout(radiance_cascade *cascade);
+
+int32
+cascade_mip_level(radiance_cascade *cascade, int32 cascade_index, map m);
+
+void
+cascade_setup(map m, radiance_cascade *cascade, int32 cascade_index);
+
 void
 cascade_generate(map m, radiance_cascade *cascade, int32 cascade_index);
 
+vec4f
+cascade_trace(
+        map *m,
+        radiance_cascade *cascade,
+        int32 probe_x,
+        int32 probe_y,
+        int32 direction_index);
+
+void
+cascade_trace_probe(
+        map *m,
+        radiance_cascade *cascade,
+        int32 probe_x,
+        int32 probe_y,
+        vec4f *results);
+
+void
+cascade_generate_tile(void *data, int32 tile_index);
+
+void
+cascade_generate_sweep(void *data, int32 direction_index);
+
 void
 cascade_free(radiance_cascade *cascade);
 
+cascade_arena
+cascade_arena_create(map m, int32 cascades_number);
+
+cascade_arena
+cascade_arena_create_pipelined(map m, int32 cascades_number);
+
+cascade_arena
+cascade_arena_allocate(map m, int32 cascades_number, int32 pipelined);
+
+void
+cascade_arena_free(cascade_arena *arena);
+
 vec4f
 cascade_merge_intervals(vec4f near, vec4f far);
 
@@ -53,6 +351,79 @@ merge_intervals(vec4f near, vec4f far);
 void
 cascades_merge(radiance_cascade *cascades, int32 cascades_number);
 
+void
+cascade_merge(radiance_cascade *cascade, radiance_cascade *cascade_up);
+
+void
+cascades_generate_and_merge(
+        map m,
+        radiance_cascade *cascades,
+        int32 cascades_number);
+
+void
+cascade_merge_tile(void *data, int32 tile_index);
+
+cascade_tap *
+cascade_taps_create(int32 length, float scale, int32 length_up);
+
+void
+cascade_merge_probes_up(
+        radiance_cascade *cascade_up,
+        cascade_tap tap_x,
+        cascade_tap tap_y,
+        cascade_texel **probes_up,
+        float *weights);
+
+vec4f
+cascade_merge_radiance_up(
+        radiance_cascade *cascade_up,
+        cascade_texel **probes_up,
+        float *weights,
+        int32 direction_index,
+        int32 isa);
+
+void
+cascade_merge_probe(
+        radiance_cascade *cascade,
+        radiance_cascade *cascade_up,
+        int64 probe_offset,
+        cascade_texel **probes_up,
+        float *weights,
+        int32 isa);
+
+void
+cascade_merge_direction(
+        radiance_cascade *cascade,
+        radiance_cascade *cascade_up,
+        int64 probe_offset,
+        cascade_texel **probes_up,
+        float *weights,
+        int32 direction_index,
+        int32 isa);
+
+#if CASCADE_MERGE_AVX2
+CPU_TARGET_AVX2 void
+cascade_merge_directions_avx2(
+        radiance_cascade *cascade,
+        int64 probe_offset,
+        cascade_texel **probes_up,
+        float *weights,
+        int32 direction_index);
+
+CPU_TARGET_AVX2 void
+cascade_transpose_avx2(__m256 *v);
+#endif
+
+#if CPU_DISPATCH
+CPU_TARGET_SSE41 void
+cascade_merge_directions_sse41(
+        radiance_cascade *cascade,
+        int64 probe_offset,
+        cascade_texel **probes_up,
+        float *weights,
+        int32 direction_index);
+#endif
+
 vec4f
 bilinear_weights(vec2f ratio);
 
@@ -60,16 +431,127 @@ vec2i
 bilinear_offset(int32 index);
 
 void
-cascade_apply_skybox(radiance_cascade cascade, vec3f skybox);
+cascade_apply_skybox(radiance_cascade *cascade, vec3f skybox);
+
+void
+cascades_to_map(map m, radiance_cascade *cascades, int32 cascades_number);
 
 void
 cascade_to_map(map m, radiance_cascade cascade);
 
+void
+cascade_gather_to_map(
+        map m,
+        radiance_cascade *cascade,
+        radiance_cascade *cascade_up);
+
+void
+cascade_gather_fluence_row(void *data, int32 probe_y);
+
+void
+cascade_integrate_fluence(radiance_cascade cascade, vec4f *fluence);
+
+void
+cascade_integrate_fluence_row(void *data, int32 probe_y);
+
+void
+cascade_fluence_to_map(map m, radiance_cascade cascade, vec4f *fluence);
+
+void
+cascade_fluence_to_map_row(void *data, int32 y);
+
+#if CPU_DISPATCH
+CPU_TARGET_AVX2 void
+cascade_fluence_average_avx2(vec4f *fluence, vec4f **probes, int32 angular_number);
+
+CPU_TARGET_AVX2 void
+cascade_fluence_accumulate_avx2(vec4f *fluence_row, vec4f *row, int32 length, int32 angular_number);
+
+CPU_TARGET_AVX2 int32
+cascade_fluence_to_map_pixels_avx2(cascade_fluence_job *job, int32 y, vec4f **fluence_rows);
+#endif
+
 #ifdef RADIANCE_CASCADES_CASCADES_IMPLEMENTATION
 
+// NULL means everything runs serially on the calling thread
+static thread_pool *cascades_thread_pool = NULL;
+
+void cascades_set_thread_pool(thread_pool *pool) {
+    cascades_thread_pool = pool;
+}
+
+// CASCADE_GENERATE_RAYS or CASCADE_GENERATE_SWEEP
+static int32 cascades_generator = CASCADE_GENERATOR;
+
+void cascades_set_generator(int32 generator) {
+    cascades_generator = generator;
+}
+
+// CASCADE_MIP_OFF, CASCADE_MIP_SPACING or CASCADE_MIP_INTERVAL
+static int32 cascades_mip_policy = CASCADE_MIP_POLICY;
+
+void cascades_set_mip_policy(int32 mip_policy) {
+    cascades_mip_policy = mip_policy;
+}
+
+// CASCADE_LAYOUT_PROBE_MAJOR, CASCADE_LAYOUT_DIRECTION_MAJOR, ...
+static int32 cascades_layout = CASCADE_LAYOUT;
+
+void cascades_set_layout(int32 layout) {
+    cascades_layout = layout;
+}
+
+// CASCADE_RAYS_FULL or CASCADE_RAYS_PALETTE
+static int32 cascades_ray_encoding = CASCADE_RAY_ENCODING;
+
+void cascades_set_ray_encoding(int32 ray_encoding) {
+    cascades_ray_encoding = ray_encoding;
+}
+
+// CASCADE_GATHER_STORED or CASCADE_GATHER_TRACED, before creating the arena
+static int32 cascades_gather = CASCADE_GATHER;
+
+void cascades_set_gather(int32 gather) {
+    cascades_gather = gather;
+}
+
+// NOTE(gio): a row of probes takes the same room in both layouts, so a
+//              level can switch layout in place (its values are rewritten
+//              by the next cascade_generate anyway)
+void cascade_apply_layout(radiance_cascade *cascade) {
+    cascade->layout = cascades_layout;
+    if (cascade->layout == CASCADE_LAYOUT_DIRECTION_MAJOR) {
+        cascade->probe_step = 1;
+        cascade->direction_step = cascade->probe_number.x;
+    } else {
+        cascade->probe_step = cascade->angular_number;
+        cascade->direction_step = 1;
+    }
+}
+
+// NOTE(gio): 0 when the map has no mip chain, otherwise the level picked by
+//              the policy, at most the last level of the chain
+int32 cascade_mip_level(radiance_cascade *cascade, int32 cascade_index, map m) {
+    if (m.mip == NULL || cascade_index < CASCADE_MIP_FIRST_CASCADE) return 0;
+
+    float texel_size = 1.f;
+    if (cascades_mip_policy == CASCADE_MIP_SPACING) {
+        texel_size = MIN(cascade->probe_size.x, cascade->probe_size.y);
+    } else if (cascades_mip_policy == CASCADE_MIP_INTERVAL) {
+        texel_size = (cascade->interval.y - cascade->interval.x) /
+            (float) CASCADE_MIP_STEPS;
+    }
+
+    int32 level = (int32) floorf(log2f(MAX(texel_size, 1.f)));
+    return MIN(level, m.mip->level_number - 1);
+}
+
+#ifndef RADIANCE_CASCADES_HEADLESS
 texture cascade_generate_texture(radiance_cascade cascade) {
     texture tex;
     glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    // rows of a level in an atlas are longer than the level itself
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, cascade.stride);
 
     glGenTextures(1, &tex);
     glBindTexture(GL_TEXTURE_2D, tex);
@@ -86,75 +568,344 @@ texture cascade_generate_texture(radiance_cascade cascade) {
             cascade.probe_number.y,
             0,
             GL_RGBA,
-            GL_FLOAT, 
+            CASCADE_TEXEL_GL_TYPE,
             cascade.data);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
     return tex;
 }
 
+// NOTE(gio): every level in a single upload, a level is the rows
+//              [atlas_row, atlas_row + probe_number.y) of the texture
+texture cascade_arena_generate_texture(cascade_arena arena) {
+    texture tex;
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
+    glGenTextures(1, &tex);
+    glBindTexture(GL_TEXTURE_2D, tex);
+
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexImage2D(
+            GL_TEXTURE_2D,
+            0,
+            GL_RGBA,
+            arena.atlas_size.x,
+            arena.atlas_size.y,
+            0,
+            GL_RGBA,
+            CASCADE_TEXEL_GL_TYPE,
+            arena.data);
+    return tex;
+}
+#endif // RADIANCE_CASCADES_HEADLESS
+
+// NOTE(gio): the half floats are converted with F16C where the host has
+//              it, the portable conversions give the same bits. isa is
+//              the cpu_isa() of the caller, read once per job and not
+//              once per texel
+cascade_texel cascade_texel_pack(vec4f v, int32 isa) {
+    (void) isa;
+#if CASCADE_STORAGE == CASCADE_STORAGE_F16
+#if MATHY_F16C
+    if (isa >= CPU_ISA_AVX2) return vec4h_from_vec4f_f16c(v);
+#endif
+    return vec4h_from_vec4f(v);
+#else
+    return v;
+#endif
+}
+
+vec4f cascade_texel_unpack(cascade_texel texel, int32 isa) {
+    (void) isa;
+#if CASCADE_STORAGE == CASCADE_STORAGE_F16
+#if MATHY_F16C
+    if (isa >= CPU_ISA_AVX2) return vec4f_from_vec4h_f16c(texel);
+#endif
+    return vec4f_from_vec4h(texel);
+#else
+    return texel;
+#endif
+}
+
+void cascade_texels_pack(cascade_texel *dst, vec4f *src, int32 n, int32 isa) {
+    (void) isa;
+#if CASCADE_STORAGE == CASCADE_STORAGE_F16
+#if MATHY_F16C
+    if (isa >= CPU_ISA_AVX2) {
+        vec4h_from_vec4f_n_f16c(dst, src, n);
+        return;
+    }
+#endif
+    vec4h_from_vec4f_n(dst, src, n);
+#else
+    memcpy(dst, src, n * sizeof(vec4f));
+#endif
+}
+
+// the texels as vec4f: themselves with vec4f storage, else converted in
+// bulk into scratch (room for n)
+vec4f *cascade_texels_unpack(
+        vec4f *scratch,
+        cascade_texel *texels,
+        int32 n,
+        int32 isa) {
+    (void) isa;
+#if CASCADE_STORAGE == CASCADE_STORAGE_F16
+#if MATHY_F16C
+    if (isa >= CPU_ISA_AVX2) {
+        vec4f_from_vec4h_n_f16c(scratch, texels, n);
+        return scratch;
+    }
+#endif
+    vec4f_from_vec4h_n(scratch, texels, n);
+    return scratch;
+#else
+    (void) scratch;
+    (void) n;
+    return texels;
+#endif
+}
+
+// NOTE(gio): a hit ray is the color of the pixel with alpha 0 and a miss
+//              is { 0, 0, 0, 1 }, so the rgb of the pixel is enough to
+//              find its palette index. Index 0 is VOID, never hit, so it
+//              is free for the misses. The tracers read the colors from
+//              the occupancy palette, so a hit is always in it (unless the
+//              map changed after its occupancy was built)
+uint8 cascade_ray_encode(radiance_cascade *cascade, vec4f ray) {
+    if (ray.a != 0.f) return 0;
+    int32 index = map_palette_find(
+            cascade->palette,
+            cascade->palette_lookup,
+            ray);
+    assert(index != 0 && "hit color not in the map palette");
+    return (uint8) index;
+}
+
+vec4f cascade_ray_decode(radiance_cascade *cascade, uint8 code) {
+    if (code == 0) return (vec4f) { .r = 0.f, .g = 0.f, .b = 0.f, .a = 1.f };
+    vec4f color = cascade->palette[code];
+    return (vec4f) { .r = color.r, .g = color.g, .b = color.b, .a = 0.f };
+}
+
+// the rays at [offset, offset + n), encoded if the cascade is using a palette
+void cascade_store_rays(
+        radiance_cascade *cascade,
+        int64 offset,
+        vec4f *rays,
+        int32 n,
+        int32 isa) {
+    if (cascade->palette) {
+        for(int32 ray_index = 0; ray_index < n; ++ray_index) {
+            cascade->rays[offset + ray_index] =
+                cascade_ray_encode(cascade, rays[ray_index]);
+        }
+        return;
+    }
+    cascade_texels_pack(&cascade->data[offset], rays, n, isa);
+}
+
+// every ray into data, after that data holds the rays
+void cascade_expand_rays(radiance_cascade *cascade) {
+    if (cascade->palette == NULL) return;
+
+    int32 isa = cpu_isa();
+    vec4f *rays = malloc(cascade->angular_number * sizeof(vec4f));
+    for(int32 probe_y = 0; probe_y < cascade->probe_number.y; ++probe_y) {
+        for(int32 probe_x = 0; probe_x < cascade->probe_number.x; ++probe_x) {
+            int64 offset = cascade_probe_offset(cascade, probe_x, probe_y);
+            for(int32 direction_index = 0;
+                direction_index < cascade->angular_number;
+                ++direction_index) {
+                rays[direction_index] = cascade_ray_decode(
+                        cascade,
+                        cascade->rays[offset +
+                            direction_index * cascade->direction_step]);
+            }
+            if (cascade->direction_step == 1) {
+                cascade_texels_pack(&cascade->data[offset], rays,
+                        cascade->angular_number, isa);
+            } else {
+                for(int32 direction_index = 0;
+                    direction_index < cascade->angular_number;
+                    ++direction_index) {
+                    cascade->data[offset +
+                        direction_index * cascade->direction_step] =
+                        cascade_texel_pack(rays[direction_index], isa);
+                }
+            }
+        }
+    }
+    free(rays);
+
+    cascade->palette = NULL;
+}
+
+// texels from the start of data to the first direction of the probe at
+//  (probe_x, probe_y), the others follow every direction_step texels
+int64 cascade_probe_offset(
+        radiance_cascade *cascade,
+        int32 probe_x,
+        int32 probe_y) {
+    if (cascade->layout == CASCADE_LAYOUT_MORTON) {
+        return cascade_morton_offset(cascade, probe_x, probe_y);
+    }
+    return (int64) probe_y * cascade->stride +
+        probe_x * cascade->probe_step;
+}
+
+cascade_texel *cascade_probe(radiance_cascade *cascade, int32 probe_x, int32 probe_y) {
+    return &cascade->data[cascade_probe_offset(cascade, probe_x, probe_y)];
+}
+
+// NOTE(gio): morton layout: the rows of probes are grouped in bands of
+//              CASCADE_MORTON_TILE_SIZE rows, taking the same room as those
+//              rows would. A band is split in square tiles stored one after
+//              the other, the probes of a tile are in Z-order, so a 2x2
+//              block of probes is contiguous and the probes of cascade_up
+//              it merges from are in the tile at the same place.
+//              Tiles cut by the right or bottom border are stored row by row
+int64 cascade_morton_offset(
+        radiance_cascade *cascade,
+        int32 probe_x,
+        int32 probe_y) {
+    int32 band_start = probe_y & ~(CASCADE_MORTON_TILE_SIZE - 1);
+    int32 band_height = MIN(CASCADE_MORTON_TILE_SIZE,
+            cascade->probe_number.y - band_start);
+    int32 tile_start = probe_x & ~(CASCADE_MORTON_TILE_SIZE - 1);
+    int32 tile_width = MIN(CASCADE_MORTON_TILE_SIZE,
+            cascade->probe_number.x - tile_start);
+
+    int32 local_x = probe_x - tile_start;
+    int32 local_y = probe_y - band_start;
+    int32 local_index = local_y * tile_width + local_x;
+    if (tile_width == CASCADE_MORTON_TILE_SIZE &&
+        band_height == CASCADE_MORTON_TILE_SIZE) {
+        local_index = (int32) morton_encode(local_x, local_y);
+    }
+
+    return (int64) band_start * cascade->stride +
+        (tile_start * band_height + local_index) * cascade->angular_number;
+}
+
+// inverse of the local index of cascade_morton_offset
+vec2i cascade_morton_probe(
+        radiance_cascade *cascade,
+        int32 tile_start,
+        int32 band_start,
+        int32 local_index) {
+    int32 band_height = MIN(CASCADE_MORTON_TILE_SIZE,
+            cascade->probe_number.y - band_start);
+    int32 tile_width = MIN(CASCADE_MORTON_TILE_SIZE,
+            cascade->probe_number.x - tile_start);
+
+    vec2i local = {
+        .x = local_index % tile_width,
+        .y = local_index / tile_width
+    };
+    if (tile_width == CASCADE_MORTON_TILE_SIZE &&
+        band_height == CASCADE_MORTON_TILE_SIZE) {
+        local = morton_decode((uint32) local_index);
+    }
+
+    return (vec2i) {
+        .x = tile_start + local.x,
+        .y = band_start + local.y
+    };
+}
+
+// NOTE(gio): level parameters and ray templates, everything but the data
+void cascade_setup(
+        map m,
+        radiance_cascade *cascade,
+        int32 cascade_index) {
+    // probe count for each dimension
+    float cascade_dimension_scaling =
+        powf((float) DIMENSION_SCALING, (float) cascade_index);
+    cascade->probe_number = (vec2i) {
+        .x = CASCADE0_PROBE_NUMBER_X * cascade_dimension_scaling,
+            .y = CASCADE0_PROBE_NUMBER_Y * cascade_dimension_scaling
+    };
+
+    // angular frequency
+    float cascade_angular_scaling =
+        powf((float) ANGULAR_SCALING, (float) cascade_index);
+    cascade->angular_number = CASCADE0_ANGULAR_NUMBER * cascade_angular_scaling;
+
+    // ray cast interval dimension - method 1
+    //float base_interval = CASCADE0_INTERVAL_LENGTH;
+    //float cascade_interval_scaling =
+    //    powf((float) INTERVAL_SCALING, (float) cascade_index);
+    //float interval_length =
+    //    base_interval * cascade_interval_scaling;
+    //float interval_start =
+    //    ((powf((float) base_interval, (float) cascade_index + 1.f) -
+    //      (float) base_interval) /
+    //    (float) (base_interval - 1)) * (1.f - (float)INTERVAL_OVERLAP);
+    //float interval_end = interval_start + interval_length;
+
+    // method 2
+    float base_interval = CASCADE0_INTERVAL_LENGTH;
+    float interval_start_multiplier = 0;
+    if (cascade_index > 0) {
+        interval_start_multiplier =
+            powf((float) 2, (float) cascade_index-1.f);
+    }
+    float interval_end_multiplier = powf((float) 2, (float) cascade_index);
+    float interval_start = base_interval * interval_start_multiplier;
+    float interval_end = base_interval * interval_end_multiplier;
+
+    cascade->interval = (vec2f) {
+        .x = interval_start,
+        .y = interval_end
+    };
+    printf("cascade(%d) interval(%f, %f)\n",
+            cascade_index,
+            cascade->interval.x,
+            cascade->interval.y);
+    cascade->probe_size = (vec2f) {
+        .x = (float) m.w / (float) cascade->probe_number.x,
+        .y = (float) m.h / (float) cascade->probe_number.y
+    };
+
+    cascade->data_length =
+        cascade->probe_number.x *
+        cascade->probe_number.y *
+        cascade->angular_number;
+    // tightly packed, unless the level lives in an atlas
+    cascade->stride = cascade->probe_number.x * cascade->angular_number;
+    cascade->atlas_row = 0;
+    cascade_apply_layout(cascade);
+
+    // same directions and interval for every probe
+    cascade->templates = map_ray_templates_create(
+            cascade->angular_number,
+            cascade->interval);
+}
+
 void cascade_generate(
         map m,
         radiance_cascade *cascade,
         int32 cascade_index) {
     // ### Calculate parameters for this cascade index only if necessary
     if (cascade == NULL) return;
+    if (cascade_index == 0 && cascades_gather == CASCADE_GATHER_TRACED) {
+        // NOTE(gio): nothing to store, the rays are traced by the gather
+        if (cascade->templates == NULL) cascade_setup(m, cascade, cascade_index);
+        cascade->mip_level = cascade_mip_level(cascade, cascade_index, m);
+        cascade_apply_layout(cascade);
+        cascade->palette = NULL;
+        return;
+    }
     if (cascade->data == NULL) {
-        // probe count for each dimension
-        float cascade_dimension_scaling =
-            powf((float) DIMENSION_SCALING, (float) cascade_index);
-        cascade->probe_number = (vec2i) {
-            .x = CASCADE0_PROBE_NUMBER_X * cascade_dimension_scaling,
-                .y = CASCADE0_PROBE_NUMBER_Y * cascade_dimension_scaling
-        };
-
-        // angular frequency
-        float cascade_angular_scaling =
-            powf((float) ANGULAR_SCALING, (float) cascade_index);
-        cascade->angular_number = CASCADE0_ANGULAR_NUMBER * cascade_angular_scaling;
-
-        // ray cast interval dimension - method 1
-        //float base_interval = CASCADE0_INTERVAL_LENGTH;
-        //float cascade_interval_scaling =
-        //    powf((float) INTERVAL_SCALING, (float) cascade_index);
-        //float interval_length =
-        //    base_interval * cascade_interval_scaling;
-        //float interval_start =
-        //    ((powf((float) base_interval, (float) cascade_index + 1.f) -
-        //      (float) base_interval) /
-        //    (float) (base_interval - 1)) * (1.f - (float)INTERVAL_OVERLAP);
-        //float interval_end = interval_start + interval_length;
-
-        // method 2
-        float base_interval = CASCADE0_INTERVAL_LENGTH;
-        float interval_start_multiplier = 0;
-        if (cascade_index > 0) {
-            interval_start_multiplier =
-                powf((float) 2, (float) cascade_index-1.f);
-        }
-        float interval_end_multiplier = powf((float) 2, (float) cascade_index);
-        float interval_start = base_interval * interval_start_multiplier;
-        float interval_end = base_interval * interval_end_multiplier;
-
-        cascade->interval = (vec2f) {
-            .x = interval_start,
-            .y = interval_end
-        };
-        printf("cascade(%d) interval(%f, %f)\n",
-                cascade_index,
-                cascade->interval.x,
-                cascade->interval.y);
-        cascade->probe_size = (vec2f) {
-            .x = (float) m.w / (float) cascade->probe_number.x,
-            .y = (float) m.h / (float) cascade->probe_number.y
-        };
+        cascade_setup(m, cascade, cascade_index);
 
         // allocate cascade memory
-        cascade->data_length =
-            cascade->probe_number.x *
-            cascade->probe_number.y *
-            cascade->angular_number;
         cascade->data = calloc(
                 cascade->data_length,
-                sizeof(vec4f));
+                sizeof(cascade_texel));
         printf("cascade(%d) data_length(%d) probe_number(%d, %d) directions(%d)\n",
                 cascade_index,
                 cascade->data_length,
@@ -163,49 +914,507 @@ void cascade_generate(
                 cascade->angular_number);
     }
 
-    // ### Do the rest
-    for(int32 x = 0; x < cascade->probe_number.x; ++x) {
-        for(int32 y = 0; y < cascade->probe_number.y; ++y) {
-            // probe center position to raycast from
-            vec2f probe_center = {
-                .x = (float) cascade->probe_size.x * (x + 0.5f),
-                .y = (float) cascade->probe_size.y * (y + 0.5f),
-            };
+    cascade->mip_level = cascade_mip_level(cascade, cascade_index, m);
+    cascade_apply_layout(cascade);
 
-            for(int32 direction_index = 0;
-                direction_index < cascade->angular_number;
-                ++direction_index) {
-                float direction_angle =
-                    2.f * PI *
-                    (((float) direction_index + 0.5f) /
-                     (float) cascade->angular_number);
-
-                vec2f ray_direction = vec2f_from_angle(direction_angle);
-
-                int32 result_index =
-                    (y * cascade->probe_number.x + x) *
-                    cascade->angular_number + direction_index;
-
-                vec4f result =
-                    map_ray_intersect(
-                            m,
-                            probe_center,
-                            ray_direction,
-                            cascade->interval.x,
-                            cascade->interval.y);
-
-                cascade->data[result_index] = result;
+    // a byte for each ray when the hits are map pixels with a palette
+    cascade->palette = NULL;
+    if (cascades_ray_encoding == CASCADE_RAYS_PALETTE &&
+        m.occupancy != NULL &&
+        cascade->mip_level == 0) {
+        if (cascade->rays == NULL) {
+            cascade->rays = calloc(cascade->data_length, sizeof(uint8));
+        }
+        cascade->palette = m.occupancy->palette;
+        cascade->palette_lookup = m.occupancy->palette_lookup;
+    }
+
+    // NOTE(gio): a sweep finds first hits, a mip level blends the texels
+    //              along the whole ray, so those levels trace their rays
+    if (cascades_generator == CASCADE_GENERATE_SWEEP &&
+        cascade->mip_level == 0) {
+        int32 thread_number =
+            cascades_thread_pool ? cascades_thread_pool->thread_number : 1;
+        // one direction for each job
+        cascade_sweep_job job = {
+            .m = m,
+            .cascade = *cascade,
+            .next_hit = calloc(thread_number, sizeof(int32 *)),
+            .next_hit_length = calloc(thread_number, sizeof(int64))
+        };
+        thread_pool_run(
+                cascades_thread_pool,
+                cascade_generate_sweep,
+                &job,
+                cascade->angular_number);
+        for(int32 thread_index = 0;
+            thread_index < thread_number;
+            ++thread_index) {
+            free(job.next_hit[thread_index]);
+        }
+        free(job.next_hit);
+        free(job.next_hit_length);
+        return;
+    }
+
+    // ### Do the rest, one tile of probes for each job
+    cascade_generate_job job = {
+        .m = m,
+        .cascade = *cascade,
+        .tile_number = (vec2i) {
+            .x = (cascade->probe_number.x + CASCADE_GENERATE_TILE_SIZE - 1) /
+                    CASCADE_GENERATE_TILE_SIZE,
+            .y = (cascade->probe_number.y + CASCADE_GENERATE_TILE_SIZE - 1) /
+                    CASCADE_GENERATE_TILE_SIZE
+        }
+    };
+    thread_pool_run(
+            cascades_thread_pool,
+            cascade_generate_tile,
+            &job,
+            job.tile_number.x * job.tile_number.y);
+}
+
+// one ray of the probe at (probe_x, probe_y)
+vec4f cascade_trace(
+        map *m,
+        radiance_cascade *cascade,
+        int32 probe_x,
+        int32 probe_y,
+        int32 direction_index) {
+    // probe center position to raycast from
+    vec2f probe_center = {
+        .x = (float) cascade->probe_size.x * (probe_x + 0.5f),
+        .y = (float) cascade->probe_size.y * (probe_y + 0.5f),
+    };
+
+    if (cascade->mip_level > 0) {
+        return map_ray_intersect_mip(
+                *m,
+                cascade->mip_level,
+                probe_center,
+                cascade->templates[direction_index].direction,
+                cascade->interval.x,
+                cascade->interval.y);
+    }
+    return map_ray_intersect_template(
+            *m,
+            probe_center,
+            &cascade->templates[direction_index]);
+}
+
+// every ray of the probe at (probe_x, probe_y), as packets with
+// MAP_RAY_PACKET (see map_rays_intersect_templates)
+void cascade_trace_probe(
+        map *m,
+        radiance_cascade *cascade,
+        int32 probe_x,
+        int32 probe_y,
+        vec4f *results) {
+    if (cascade->mip_level > 0) {
+        for(int32 direction_index = 0;
+            direction_index < cascade->angular_number;
+            ++direction_index) {
+            results[direction_index] = cascade_trace(
+                    m, cascade, probe_x, probe_y, direction_index);
+        }
+        return;
+    }
+
+    vec2f probe_center = {
+        .x = (float) cascade->probe_size.x * (probe_x + 0.5f),
+        .y = (float) cascade->probe_size.y * (probe_y + 0.5f),
+    };
+    map_rays_intersect_templates(
+            *m,
+            probe_center,
+            cascade->templates,
+            cascade->angular_number,
+            results);
+}
+
+void cascade_generate_tile(void *data, int32 tile_index) {
+    cascade_generate_job *job = (cascade_generate_job *) data;
+    map m = job->m;
+    radiance_cascade *cascade = &job->cascade;
+    int32 isa = cpu_isa();
+
+    // every ray is independent, so the result does not depend on
+    // which thread traces which tile
+    vec2i tile_start = {
+        .x = (tile_index % job->tile_number.x) * CASCADE_GENERATE_TILE_SIZE,
+        .y = (tile_index / job->tile_number.x) * CASCADE_GENERATE_TILE_SIZE
+    };
+    vec2i tile_end = {
+        .x = MIN(tile_start.x + CASCADE_GENERATE_TILE_SIZE,
+                cascade->probe_number.x),
+        .y = MIN(tile_start.y + CASCADE_GENERATE_TILE_SIZE,
+                cascade->probe_number.y)
+    };
+
+    // NOTE(gio): direction major data is written a direction at a time,
+    //              so trace that way too: consecutive rays share template
+    //              and step pattern, and walk next to each other on the map
+    //              Results are packed into the storage type in bulk,
+    //              a run of contiguous values at a time
+    if (cascade->layout == CASCADE_LAYOUT_DIRECTION_MAJOR) {
+        vec4f results[CASCADE_GENERATE_TILE_SIZE];
+        for(int32 direction_index = 0;
+            direction_index < cascade->angular_number;
+            ++direction_index) {
+            for(int32 y = tile_start.y; y < tile_end.y; ++y) {
+                for(int32 x = tile_start.x; x < tile_end.x; ++x) {
+                    results[x - tile_start.x] =
+                        cascade_trace(&m, cascade, x, y, direction_index);
+                }
+                cascade_store_rays(
+                        cascade,
+                        cascade_probe_offset(cascade, tile_start.x, y) +
+                            direction_index * cascade->direction_step,
+                        results,
+                        tile_end.x - tile_start.x,
+                        isa);
+            }
+        }
+        return;
+    }
+
+    vec4f *results = malloc(cascade->angular_number * sizeof(vec4f));
+    for(int32 x = tile_start.x; x < tile_end.x; ++x) {
+        for(int32 y = tile_start.y; y < tile_end.y; ++y) {
+            cascade_trace_probe(&m, cascade, x, y, results);
+            cascade_store_rays(
+                    cascade,
+                    cascade_probe_offset(cascade, x, y),
+                    results,
+                    cascade->angular_number,
+                    isa);
+        }
+    }
+    free(results);
+}
+
+// NOTE(gio): the rays of a direction all follow the same family of
+//              parallel digital lines: stepping along the major axis of the
+//              direction, line `line` holds the pixel
+//              (a, line + offset[a]) of each major coordinate a. Every line
+//              that starts a probe ray is swept once backwards, over the
+//              part covered by its rays, recording for each pixel the
+//              nearest non VOID pixel ahead, and then every probe reads its
+//              first hit from its line: rays sharing a line share the sweep
+//              and the cost is bounded by the map pixels, whatever the
+//              interval length.
+//              Lines are one pixel thick and the ray starts from its
+//              rounded start pixel like the legacy stepper, so the result is
+//              close to, but not the same as, the traced rays.
+void cascade_generate_sweep(void *data, int32 direction_index) {
+    cascade_sweep_job *job = (cascade_sweep_job *) data;
+    map m = job->m;
+    radiance_cascade *cascade = &job->cascade;
+    int32 isa = cpu_isa();
+    map_ray_template *ray = &cascade->templates[direction_index];
+    vec2f direction = ray->direction;
+
+    int32 x_major = fabsf(direction.x) >= fabsf(direction.y);
+    int32 major_length = x_major ? m.w : m.h;
+    int32 minor_length = x_major ? m.h : m.w;
+    float slope = x_major ?
+        direction.y / direction.x :
+        direction.x / direction.y;
+    int32 step = DIRECTION(x_major ? direction.x : direction.y);
+
+    int32 *offset = malloc(major_length * sizeof(int32));
+    int32 offset_min = 0;
+    int32 offset_max = 0;
+    for(int32 a = 0; a < major_length; ++a) {
+        offset[a] = (int32) floorf(slope * (float) a + 0.5f);
+        offset_min = MIN(offset_min, offset[a]);
+        offset_max = MAX(offset_max, offset[a]);
+    }
+    // lines out of this range never cross the map
+    int32 line_min = -offset_max;
+    int32 line_number = minor_length + offset_max - offset_min;
+
+    int32 *line_slot = malloc(line_number * sizeof(int32));
+    int32 *slot_line = malloc(line_number * sizeof(int32));
+    // part of each line covered by some ray, inside the map
+    vec2i *slot_span = malloc(line_number * sizeof(vec2i));
+    for(int32 line_index = 0; line_index < line_number; ++line_index) {
+        line_slot[line_index] = -1;
+    }
+
+    int32 probe_number = cascade->probe_number.x * cascade->probe_number.y;
+
+    // ### Find the lines the probe rays start on
+    int32 slot_number = 0;
+    for(int32 probe_index = 0; probe_index < probe_number; ++probe_index) {
+        vec2f probe_center = {
+            .x = (float) cascade->probe_size.x *
+                (probe_index % cascade->probe_number.x + 0.5f),
+            .y = (float) cascade->probe_size.y *
+                (probe_index / cascade->probe_number.x + 0.5f),
+        };
+        vec2i start = {
+            .x = (int32) ((probe_center.x + direction.x * ray->interval.x) + 0.5f),
+            .y = (int32) ((probe_center.y + direction.y * ray->interval.x) + 0.5f)
+        };
+        vec2i end = {
+            .x = (int32) ((probe_center.x + direction.x * ray->interval.y) + 0.5f),
+            .y = (int32) ((probe_center.y + direction.y * ray->interval.y) + 0.5f)
+        };
+        int32 a0 = x_major ? start.x : start.y;
+        int32 b0 = x_major ? start.y : start.x;
+        int32 a1 = x_major ? end.x : end.y;
+        int32 line =
+            b0 - (int32) floorf(slope * (float) a0 + 0.5f) - line_min;
+        if (!(0 <= line && line < line_number)) continue;
+
+        vec2i span = {
+            .x = CLAMP(MIN(a0, a1), 0, major_length - 1),
+            .y = CLAMP(MAX(a0, a1), 0, major_length - 1)
+        };
+        int32 slot = line_slot[line];
+        if (slot < 0) {
+            slot = slot_number++;
+            line_slot[line] = slot;
+            slot_line[slot] = line + line_min;
+            slot_span[slot] = span;
+        } else {
+            slot_span[slot].x = MIN(slot_span[slot].x, span.x);
+            slot_span[slot].y = MAX(slot_span[slot].y, span.y);
+        }
+    }
+
+    // ### Sweep them, against the ray direction
+    // nearest major coordinate ahead with a non VOID pixel, -1 if none
+    int32 thread_index = thread_pool_thread_index();
+    int64 next_hit_length = (int64) MAX(slot_number, 1) * major_length;
+    if (job->next_hit_length[thread_index] < next_hit_length) {
+        free(job->next_hit[thread_index]);
+        job->next_hit[thread_index] = malloc(next_hit_length * sizeof(int32));
+        job->next_hit_length[thread_index] = next_hit_length;
+    }
+    int32 *next_hit = job->next_hit[thread_index];
+    for(int32 slot = 0; slot < slot_number; ++slot) {
+        int32 line = slot_line[slot];
+        int32 *next = &next_hit[slot * major_length];
+
+        vec2i span = slot_span[slot];
+
+        int32 hit = -1;
+        for(int32 i = 0; i <= span.y - span.x; ++i) {
+            int32 a = (step > 0) ? span.y - i : span.x + i;
+            int32 b = line + offset[a];
+            if (0 <= b && b < minor_length) {
+                int32 index = x_major ? b * m.w + a : a * m.w + b;
+                if (!map_is_void(&m, index)) hit = a;
             }
+            next[a] = hit;
         }
     }
+
+    // ### Read the first hit of every probe ray
+    for(int32 probe_index = 0; probe_index < probe_number; ++probe_index) {
+        vec2f probe_center = {
+            .x = (float) cascade->probe_size.x *
+                (probe_index % cascade->probe_number.x + 0.5f),
+            .y = (float) cascade->probe_size.y *
+                (probe_index / cascade->probe_number.x + 0.5f),
+        };
+        vec2i start = {
+            .x = (int32) ((probe_center.x + direction.x * ray->interval.x) + 0.5f),
+            .y = (int32) ((probe_center.y + direction.y * ray->interval.x) + 0.5f)
+        };
+        vec2i end = {
+            .x = (int32) ((probe_center.x + direction.x * ray->interval.y) + 0.5f),
+            .y = (int32) ((probe_center.y + direction.y * ray->interval.y) + 0.5f)
+        };
+        int32 a0 = x_major ? start.x : start.y;
+        int32 b0 = x_major ? start.y : start.x;
+        int32 a1 = x_major ? end.x : end.y;
+        int32 line =
+            b0 - (int32) floorf(slope * (float) a0 + 0.5f) - line_min;
+
+        // alpha 1 means it hit nothing
+        vec4f result = { .r = 0.f, .g = 0.f, .b = 0.f, .a = 1.f };
+
+        // first pixel of the line inside the map, if the ray gets there
+        int32 a = CLAMP(a0, 0, major_length - 1);
+        if (0 <= line && line < line_number &&
+            0 <= (a - a0) * step && (a - a0) * step <= (a1 - a0) * step) {
+            int32 hit = next_hit[line_slot[line] * major_length + a];
+            if (hit >= 0 && (hit - a0) * step <= (a1 - a0) * step) {
+                int32 b = line + line_min + offset[hit];
+                int32 index = x_major ? b * m.w + hit : hit * m.w + b;
+                vec4f pixel = map_pixel(&m, index);
+                result = (vec4f) {
+                    .r = pixel.r,
+                    .g = pixel.g,
+                    .b = pixel.b,
+                    .a = 0.f // alpha 0 means it hit something
+                };
+            }
+        }
+
+        cascade_store_rays(
+                cascade,
+                cascade_probe_offset(cascade,
+                    probe_index % cascade->probe_number.x,
+                    probe_index / cascade->probe_number.x) +
+                    direction_index * cascade->direction_step,
+                &result,
+                1,
+                isa);
+    }
+
+    free(slot_span);
+    free(slot_line);
+    free(line_slot);
+    free(offset);
 }
 
 void cascade_free(radiance_cascade *cascade) {
     if (cascade == NULL) return;
     if (cascade->data) {
-        free(cascade->data);
+        if (!cascade->in_arena) free(cascade->data);
         cascade->data = NULL;
     }
+    if (cascade->rays) {
+        if (!cascade->in_arena) free(cascade->rays);
+        cascade->rays = NULL;
+    }
+    if (cascade->templates) {
+        map_ray_templates_free(cascade->templates);
+        cascade->templates = NULL;
+    }
+}
+
+cascade_arena cascade_arena_create(map m, int32 cascades_number) {
+    return cascade_arena_allocate(m, cascades_number, 0);
+}
+
+// NOTE(gio): for cascades_generate_and_merge, a level is overwritten by the
+//              one two levels below it, after it has been merged
+cascade_arena cascade_arena_create_pipelined(map m, int32 cascades_number) {
+    return cascade_arena_allocate(m, cascades_number, 1);
+}
+
+cascade_arena cascade_arena_allocate(
+        map m,
+        int32 cascades_number,
+        int32 pipelined) {
+    cascade_arena arena = {
+        .cascades = calloc(cascades_number, sizeof(radiance_cascade)),
+        .cascades_number = cascades_number,
+        .pipelined = pipelined
+    };
+
+    // ### Size the atlas: as wide as the widest level, rounded up so that
+    //      every row (hence every level) starts on a cache line
+    int32 alignment = CASCADE_ARENA_ALIGNMENT / sizeof(cascade_texel);
+    int32 slot_rows[2] = { 0, 0 }; // even and odd levels when pipelined
+    // cascade0 has no data when the gather traces it
+    int32 first_stored = (cascades_gather == CASCADE_GATHER_TRACED) ? 1 : 0;
+    for(int32 cascade_index = 0;
+        cascade_index < cascades_number;
+        ++cascade_index) {
+        radiance_cascade *cascade = &arena.cascades[cascade_index];
+        cascade_setup(m, cascade, cascade_index);
+        if (cascade_index < first_stored) continue;
+        arena.atlas_size.x = MAX(arena.atlas_size.x, cascade->stride);
+        arena.atlas_size.y += cascade->probe_number.y;
+        slot_rows[cascade_index % 2] =
+            MAX(slot_rows[cascade_index % 2], cascade->probe_number.y);
+    }
+    if (pipelined) arena.atlas_size.y = slot_rows[0] + slot_rows[1];
+    arena.atlas_size.x =
+        (arena.atlas_size.x + alignment - 1) / alignment * alignment;
+    size_t data_length = (size_t) arena.atlas_size.x * arena.atlas_size.y;
+    arena.bytes = data_length * sizeof(cascade_texel);
+
+    // ### One allocation for all of them
+#ifdef __linux__
+    size_t mapped_bytes =
+        (arena.bytes + CASCADE_ARENA_HUGE_PAGE_SIZE - 1) /
+        CASCADE_ARENA_HUGE_PAGE_SIZE * CASCADE_ARENA_HUGE_PAGE_SIZE;
+    void *pages = MAP_FAILED;
+#if CASCADE_ARENA_HUGE_PAGES != 0
+    // only works if the system reserved huge pages, fall back otherwise
+    pages = mmap(NULL, mapped_bytes, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (pages != MAP_FAILED) arena.pages = CASCADE_ARENA_PAGES_HUGE;
+#endif
+    if (pages == MAP_FAILED) {
+        pages = mmap(NULL, mapped_bytes, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+#if CASCADE_ARENA_HUGE_PAGES != 0 && defined(MADV_HUGEPAGE)
+        if (pages != MAP_FAILED &&
+            madvise(pages, mapped_bytes, MADV_HUGEPAGE) == 0) {
+            arena.pages = CASCADE_ARENA_PAGES_TRANSPARENT;
+        }
+#endif
+    }
+    if (pages != MAP_FAILED) {
+        arena.data = (cascade_texel *) pages;
+        arena.bytes = mapped_bytes;
+        arena.mapped = 1;
+    }
+#endif
+    if (arena.data == NULL) {
+        arena.data = calloc(data_length, sizeof(cascade_texel));
+    }
+
+    // only touched with CASCADE_RAYS_PALETTE, calloc maps it lazily
+    arena.rays = calloc(data_length, sizeof(uint8));
+
+    // ### Point each level into it
+    int32 atlas_row = (pipelined && first_stored % 2 == 1) ? slot_rows[0] : 0;
+    for(int32 cascade_index = first_stored;
+        cascade_index < cascades_number;
+        ++cascade_index) {
+        radiance_cascade *cascade = &arena.cascades[cascade_index];
+        cascade->data = arena.data + (size_t) atlas_row * arena.atlas_size.x;
+        cascade->rays = arena.rays + (size_t) atlas_row * arena.atlas_size.x;
+        cascade->stride = arena.atlas_size.x;
+        cascade->atlas_row = atlas_row;
+        cascade->in_arena = 1;
+        atlas_row += cascade->probe_number.y;
+        // the next level goes in the other slot
+        if (pipelined) atlas_row = (cascade_index % 2 == 0) ? slot_rows[0] : 0;
+    }
+
+    printf("cascade_arena levels(%d)%s atlas(%d, %d) bytes(%zu) pages(%s)\n",
+            cascades_number,
+            pipelined ? " pipelined" : "",
+            arena.atlas_size.x,
+            arena.atlas_size.y,
+            arena.bytes,
+            (arena.pages == CASCADE_ARENA_PAGES_HUGE) ? "huge" :
+            (arena.pages == CASCADE_ARENA_PAGES_TRANSPARENT) ?
+                "transparent huge" : "normal");
+
+    return arena;
+}
+
+void cascade_arena_free(cascade_arena *arena) {
+    if (arena == NULL) return;
+    for(int32 cascade_index = 0;
+        cascade_index < arena->cascades_number;
+        ++cascade_index) {
+        cascade_free(&arena->cascades[cascade_index]);
+    }
+    free(arena->cascades);
+    arena->cascades = NULL;
+
+    if (arena->data) {
+#ifdef __linux__
+        if (arena->mapped) munmap(arena->data, arena->bytes);
+#endif
+        if (!arena->mapped) free(arena->data);
+        arena->data = NULL;
+    }
+    free(arena->rays);
+    arena->rays = NULL;
 }
 
 vec4f cascade_merge_intervals(vec4f near, vec4f far) {
@@ -224,169 +1433,568 @@ void cascades_merge(
         int32 cascades_number) {
     if (cascades_number <= 0) return;
 
-    // merging cascades into cascade0
+    // the last cascade has nothing to merge, its rays are its values
+    cascade_expand_rays(&cascades[cascades_number - 1]);
+
+    // merging cascades into cascade0, one level at a time because
+    // each level needs the one above to be already merged
     for(int32 cascade_index = cascades_number - 2;
             cascade_index >= 0;
             --cascade_index) {
-        radiance_cascade cascade_up = cascades[cascade_index + 1];
-        radiance_cascade cascade = cascades[cascade_index];
-
-        for(int32 probe_up_index = 0;
-                probe_up_index < cascade_up.probe_number.x *
-                cascade_up.probe_number.y;
-                ++probe_up_index) {
-
-            // vec4f *probe_up =
-            //     &cascade_up.data[probe_up_index * cascade_up.angular_number];
-
-            int32 probes_per_up_probe_row =
-                (int32) (1.f / (float) DIMENSION_SCALING);
-
-            int32 probe_up_x = probe_up_index % cascade_up.probe_number.x;
-            int32 probe_up_y = probe_up_index / cascade_up.probe_number.x;
-
-            int32 probe_index_base =
-                probe_up_y *
-                    cascade_up.probe_number.x *
-                    POW2(probes_per_up_probe_row) +
-                probe_up_x * probes_per_up_probe_row;
-
-            for(int32 probe_index_offset = 0;
-                    probe_index_offset < POW2(probes_per_up_probe_row);
-                    ++probe_index_offset) {
-
-                // which row of the probe_up we are considering
-                int32 probe_index_base_row =
-                    probe_index_offset / probes_per_up_probe_row;
-
-                // which probe of the row of the probe_up we are considering
-                int32 probe_index_base_offset =
-                    probe_index_offset % probes_per_up_probe_row;
-
-                int32 probe_index =
-                    // number of probes in the previous probe_ups
-                    probe_index_base +
-                    // number of rows I'm skipping
-                    probe_index_base_row *
-                        // number of probes in a row
-                        cascade_up.probe_number.x * probes_per_up_probe_row +
-                    probe_index_base_offset;
-
-                int32 probe_x = probe_index % cascade.probe_number.x;
-                int32 probe_y = probe_index / cascade.probe_number.x;
-
-                // NOTE(bilinear): for finding top-left bilinear probe (of cascade_up obv)
-                vec2f base_coord = vec2f_sum_vec2f(
-                    (vec2f) {
-                        .x = (float) ((probe_x + 0.5f) * cascade.probe_size.x) /
-                                (float) cascade_up.probe_size.x,
-                        .y = (float) ((probe_y + 0.5f) * cascade.probe_size.y) /
-                                (float) cascade_up.probe_size.y
-                    },
-                    (vec2f) { .x = -0.5f, .y = -0.5f }
-                );
-                vec2i bilinear_base = (vec2i) {
-                    .x = (int32) floorf(base_coord.x),
-                    .y = (int32) floorf(base_coord.y)
-                };
-                vec2f ratio = (vec2f) {
-                    .x = (base_coord.x - (int32) base_coord.x) *
-                            SIGN(base_coord.x),
-                    .y = (base_coord.y - (int32) base_coord.y) *
-                            SIGN(base_coord.y)
-                };
-                vec4f weights = bilinear_weights(ratio);
+        cascade_merge(&cascades[cascade_index], &cascades[cascade_index + 1]);
+    }
+}
 
-                vec4f *probe =
-                    &cascade.data[probe_index * cascade.angular_number];
+// NOTE(gio): cascade_up must be already merged
+void cascade_merge(radiance_cascade *cascade, radiance_cascade *cascade_up) {
+    // traced and merged by the gather instead (CASCADE_GATHER_TRACED)
+    if (cascade->data == NULL) return;
+
+    // NOTE(gio): a job is a square tile of probes of the lower cascade,
+    //              sized so that its probes and the probes of cascade_up
+    //              it reads (a quarter as many, with ANGULAR_SCALING times
+    //              the directions) stay in L2. A whole row of probes is
+    //              already bigger than L2 on every level.
+    //              The direction-major layout is walked a direction at a
+    //              time along whole rows, where its texels are contiguous,
+    //              so there a tile is a single row
+    float probe_up_ratio =
+        (float) (cascade_up->probe_number.x * cascade_up->probe_number.y) /
+        (float) (cascade->probe_number.x * cascade->probe_number.y);
+    float probe_bytes = (float) sizeof(cascade_texel) *
+        ((float) cascade->angular_number +
+         (float) cascade_up->angular_number * probe_up_ratio);
+    int32 tile_side = MAX(1,
+            (int32) sqrtf((float) CASCADE_MERGE_L2_SIZE / probe_bytes));
+    vec2i tile_size = { .x = tile_side, .y = tile_side };
+    if (cascade->layout == CASCADE_LAYOUT_MORTON) {
+        // whole tiles of the layout
+        tile_side = (tile_side + CASCADE_MORTON_TILE_SIZE - 1) &
+            ~(CASCADE_MORTON_TILE_SIZE - 1);
+        tile_size = (vec2i) { .x = tile_side, .y = tile_side };
+    } else if (cascade->layout == CASCADE_LAYOUT_DIRECTION_MAJOR) {
+        tile_size = (vec2i) { .x = cascade->probe_number.x, .y = 1 };
+    }
+    int32 tiles_x =
+        (cascade->probe_number.x + tile_size.x - 1) / tile_size.x;
+    int32 tiles_y =
+        (cascade->probe_number.y + tile_size.y - 1) / tile_size.y;
+
+    cascade_merge_job job = {
+        .cascade = *cascade,
+        .cascade_up = *cascade_up,
+        .tile_size = tile_size,
+        .tiles_x = tiles_x,
+        .taps_x = cascade_taps_create(
+                cascade->probe_number.x,
+                cascade->probe_size.x / cascade_up->probe_size.x,
+                cascade_up->probe_number.x),
+        .taps_y = cascade_taps_create(
+                cascade->probe_number.y,
+                cascade->probe_size.y / cascade_up->probe_size.y,
+                cascade_up->probe_number.y)
+    };
+    thread_pool_run(
+            cascades_thread_pool,
+            cascade_merge_tile,
+            &job,
+            tiles_x * tiles_y);
+    free(job.taps_y);
+    free(job.taps_x);
+
+    // the rays, if encoded, have been expanded by the merge
+    cascade->palette = NULL;
+}
 
-                for(int32 direction_index = 0;
-                        direction_index < cascade.angular_number;
-                        ++direction_index) {
-
-                    vec4f average_radiance_up = {};
-                    int32 direction_up_index_base =
-                        direction_index * ANGULAR_SCALING;
-                    // int32 average_alpha = 1.0f;
-                    for(int32 direction_up_index_offset = 0;
-                            direction_up_index_offset < ANGULAR_SCALING;
-                            ++direction_up_index_offset) {
-
-                        int32 direction_up_index =
-                            direction_up_index_base + direction_up_index_offset;
-
-                        // NOTE(bilinear): get the radiance from 4 probes around
-                        //                  only valid probes are used
-                        //                  (e.g. on the corners, some positions
-                        //                          might be invalid, hence
-                        //                          will not be used)
-                        vec4f radiance_up = {};
-
-                        // Count how many values have been used in the average
-                        int32 usable_probe_up_count = 0;
-
-                        for(int32 bilinear_index = 0;
-                            bilinear_index < 4;
-                            ++bilinear_index) {
-
-                            vec2i offset = bilinear_offset(bilinear_index);
-                            
-                            vec4f bilinear_radiance_up = (vec4f) { 0, 0, 0, 0 };
-
-                            if (0 <= bilinear_base.x + offset.x &&
-                                bilinear_base.x + offset.x <
-                                    cascade_up.probe_number.x &&
-                                0 <= bilinear_base.y + offset.y &&
-                                bilinear_base.y + offset.y <
-                                    cascade_up.probe_number.y) {
-
-                                // here the value is usable for the average
-                                usable_probe_up_count++;
-
-                                int32 bilinear_probe_up_index =
-                                    (bilinear_base.y + offset.y) *
-                                    cascade_up.probe_number.x +
-                                    (bilinear_base.x + offset.x);
-
-                                vec4f *bilinear_probe_up =
-                                    &cascade_up.data[bilinear_probe_up_index *
-                                    cascade_up.angular_number];
-                                bilinear_radiance_up =
-                                    bilinear_probe_up[direction_up_index];
-
-                                radiance_up = vec4f_sum_vec4f(
-                                        radiance_up,
-                                        vec4f_divide(
-                                            vec4f_diff_vec4f(
-                                                bilinear_radiance_up,
-                                                radiance_up),
-                                            (float) usable_probe_up_count));
-                            }
-
-                            // radiance_up = vec4f_sum_vec4f(
-                            //         radiance_up,
-                            //         vec4f_mult(
-                            //             bilinear_radiance_up,
-                            //             weights.e[bilinear_index]));
-                        }
-
-                        average_radiance_up = vec4f_sum_vec4f(
-                                average_radiance_up,
-                                vec4f_divide(
-                                    radiance_up,
-                                    (float) ANGULAR_SCALING));
-                    }
-
-                    vec4f probe_direction_radiance = probe[direction_index];
-                    probe[direction_index] = cascade_merge_intervals(
-                            probe_direction_radiance,
-                            average_radiance_up);
+// NOTE(gio): same values as generating every cascade (and applying the
+//              skybox) and then merging them, but each level is merged as
+//              soon as it's generated, starting from the last one, so a
+//              level is not needed anymore once the one below it has been
+//              merged into. With a pipelined arena only two levels of
+//              memory are used, and in the end only cascade0 and cascade1
+//              are left.
+void cascades_generate_and_merge(
+        map m,
+        radiance_cascade *cascades,
+        int32 cascades_number) {
+    if (cascades_number <= 0) return;
+
+    for(int32 cascade_index = cascades_number - 1;
+        cascade_index >= 0;
+        --cascade_index) {
+        cascade_generate(m, &cascades[cascade_index], cascade_index);
+        if (cascade_index == cascades_number - 1) {
+            // same as applying it to the last cascade before cascades_merge
+#if APPLY_SKYBOX != 0
+            cascade_apply_skybox(&cascades[cascade_index], SKYBOX);
+#else
+            cascade_expand_rays(&cascades[cascade_index]);
+#endif
+        } else {
+            cascade_merge(
+                    &cascades[cascade_index],
+                    &cascades[cascade_index + 1]);
+        }
+    }
+}
+
+void cascade_merge_tile(void *data, int32 tile_index) {
+    cascade_merge_job *job = (cascade_merge_job *) data;
+    radiance_cascade cascade = job->cascade;
+    radiance_cascade cascade_up = job->cascade_up;
+    int32 isa = cpu_isa();
+
+    int32 tile_start_x = (tile_index % job->tiles_x) * job->tile_size.x;
+    int32 tile_start_y = (tile_index / job->tiles_x) * job->tile_size.y;
+    int32 tile_end_x =
+        MIN(tile_start_x + job->tile_size.x, cascade.probe_number.x);
+    int32 tile_end_y =
+        MIN(tile_start_y + job->tile_size.y, cascade.probe_number.y);
+
+    if (cascade.layout == CASCADE_LAYOUT_MORTON) {
+        // NOTE(gio): probes in the order they are stored, a tile at a time
+        for(int32 tile_y = tile_start_y;
+            tile_y < tile_end_y;
+            tile_y += CASCADE_MORTON_TILE_SIZE) {
+            int32 tile_height =
+                MIN(CASCADE_MORTON_TILE_SIZE, cascade.probe_number.y - tile_y);
+            for(int32 tile_x = tile_start_x;
+                tile_x < tile_end_x;
+                tile_x += CASCADE_MORTON_TILE_SIZE) {
+                int32 tile_length = tile_height *
+                    MIN(CASCADE_MORTON_TILE_SIZE,
+                            cascade.probe_number.x - tile_x);
+                for(int32 local_index = 0;
+                    local_index < tile_length;
+                    ++local_index) {
+                    vec2i probe_position = cascade_morton_probe(
+                            &cascade, tile_x, tile_y, local_index);
+
+                    cascade_texel *probes_up[4];
+                    float weights[4];
+                    cascade_merge_probes_up(
+                            &cascade_up,
+                            job->taps_x[probe_position.x],
+                            job->taps_y[probe_position.y],
+                            probes_up,
+                            weights);
+                    cascade_merge_probe(
+                            &cascade,
+                            &cascade_up,
+                            cascade_probe_offset(
+                                &cascade, probe_position.x, probe_position.y),
+                            probes_up,
+                            weights,
+                            isa);
                 }
             }
         }
+        return;
     }
+
+    // bilinear probes of cascade_up for each probe of a row of the tile
+    int32 tile_width = tile_end_x - tile_start_x;
+    cascade_texel *(*row_probes_up)[4] =
+        malloc(tile_width * sizeof(*row_probes_up));
+    float (*row_weights)[4] =
+        malloc(tile_width * sizeof(*row_weights));
+
+    for(int32 probe_y = tile_start_y; probe_y < tile_end_y; ++probe_y) {
+        for(int32 probe_x = tile_start_x; probe_x < tile_end_x; ++probe_x) {
+            cascade_merge_probes_up(
+                    &cascade_up,
+                    job->taps_x[probe_x],
+                    job->taps_y[probe_y],
+                    row_probes_up[probe_x - tile_start_x],
+                    row_weights[probe_x - tile_start_x]);
+        }
+
+        // NOTE(gio): same values either way, only the order changes to
+        //              walk the memory of the layout linearly
+        if (cascade.layout == CASCADE_LAYOUT_DIRECTION_MAJOR) {
+            for(int32 direction_index = 0;
+                direction_index < cascade.angular_number;
+                ++direction_index) {
+                for(int32 probe_x = tile_start_x;
+                    probe_x < tile_end_x;
+                    ++probe_x) {
+                    cascade_merge_direction(
+                            &cascade,
+                            &cascade_up,
+                            cascade_probe_offset(&cascade, probe_x, probe_y),
+                            row_probes_up[probe_x - tile_start_x],
+                            row_weights[probe_x - tile_start_x],
+                            direction_index,
+                            isa);
+                }
+            }
+        } else {
+            for(int32 probe_x = tile_start_x;
+                probe_x < tile_end_x;
+                ++probe_x) {
+                cascade_merge_probe(
+                        &cascade,
+                        &cascade_up,
+                        cascade_probe_offset(&cascade, probe_x, probe_y),
+                        row_probes_up[probe_x - tile_start_x],
+                        row_weights[probe_x - tile_start_x],
+                        isa);
+            }
+        }
+    }
+
+    free(row_weights);
+    free(row_probes_up);
 }
 
+// NOTE(bilinear): coordinate c of a level is at (c + 0.5) * scale - 0.5 in
+//                  the level above (scale is the ratio of their probe
+//                  sizes), between the probes floor() and floor() + 1.
+//                  The pattern repeats every few probes, but a whole axis
+//                  is small and needs no modulo to be looked up.
+cascade_tap *cascade_taps_create(int32 length, float scale, int32 length_up) {
+    cascade_tap *taps = malloc(length * sizeof(cascade_tap));
+    for(int32 coord = 0; coord < length; ++coord) {
+        float coord_up = (coord + 0.5f) * scale - 0.5f;
+        int32 base = (int32) floorf(coord_up);
+        float ratio = coord_up - (float) base;
+
+        cascade_tap tap = {
+            .index = { base, base + 1 },
+            .weight = { 1.f - ratio, ratio }
+        };
+        for(int32 side = 0; side < 2; ++side) {
+            if (0 <= tap.index[side] && tap.index[side] < length_up) continue;
+            // outside the level, the other probe takes all the weight
+            tap.index[side] = CLAMP(tap.index[side], 0, length_up - 1);
+            tap.weight[side] = 0.f;
+            tap.weight[1 - side] = 1.f;
+        }
+        taps[coord] = tap;
+    }
+    return taps;
+}
+
+// NOTE(bilinear): the 4 probes of cascade_up around a probe of the level
+//                  below and their weights, the same for every direction so
+//                  they are found once per probe. Probes outside cascade_up
+//                  have weight 0. The weights include the average of the
+//                  ANGULAR_SCALING directions merged into one.
+void cascade_merge_probes_up(
+        radiance_cascade *cascade_up,
+        cascade_tap tap_x,
+        cascade_tap tap_y,
+        cascade_texel **probes_up,
+        float *weights) {
+    for(int32 tap_index = 0; tap_index < 4; ++tap_index) {
+        int32 side_x = tap_index % 2;
+        int32 side_y = tap_index / 2;
+        probes_up[tap_index] = cascade_probe(
+                cascade_up,
+                tap_x.index[side_x],
+                tap_y.index[side_y]);
+        weights[tap_index] = tap_x.weight[side_x] * tap_y.weight[side_y] /
+            (float) ANGULAR_SCALING;
+    }
+}
+
+// every direction of a probe, 8 at a time when they are contiguous and
+// the host has AVX2 (4 with SSE4.1), the rest (or all of them) one at a time
+void cascade_merge_probe(
+        radiance_cascade *cascade,
+        radiance_cascade *cascade_up,
+        int64 probe_offset,
+        cascade_texel **probes_up,
+        float *weights,
+        int32 isa) {
+    int32 direction_index = 0;
+#if CASCADE_MERGE_AVX2
+    if (isa >= CPU_ISA_AVX2 &&
+        cascade->direction_step == 1 &&
+        cascade_up->direction_step == 1) {
+        for(; direction_index + 8 <= cascade->angular_number;
+            direction_index += 8) {
+            cascade_merge_directions_avx2(
+                    cascade,
+                    probe_offset,
+                    probes_up,
+                    weights,
+                    direction_index);
+        }
+    }
+#endif
+#if CPU_DISPATCH
+    if (isa >= CPU_ISA_SSE41 &&
+        cascade->direction_step == 1 &&
+        cascade_up->direction_step == 1) {
+        for(; direction_index + 4 <= cascade->angular_number;
+            direction_index += 4) {
+            cascade_merge_directions_sse41(
+                    cascade,
+                    probe_offset,
+                    probes_up,
+                    weights,
+                    direction_index);
+        }
+    }
+#endif
+    for(; direction_index < cascade->angular_number; ++direction_index) {
+        cascade_merge_direction(
+                cascade,
+                cascade_up,
+                probe_offset,
+                probes_up,
+                weights,
+                direction_index,
+                isa);
+    }
+}
+
+void cascade_merge_direction(
+        radiance_cascade *cascade,
+        radiance_cascade *cascade_up,
+        int64 probe_offset,
+        cascade_texel **probes_up,
+        float *weights,
+        int32 direction_index,
+        int32 isa) {
+    vec4f average_radiance_up = cascade_merge_radiance_up(
+            cascade_up,
+            probes_up,
+            weights,
+            direction_index,
+            isa);
+
+    // the near interval, straight from the encoded rays if there are any
+    int64 index = probe_offset + direction_index * cascade->direction_step;
+    vec4f radiance = (cascade->palette) ?
+        cascade_ray_decode(cascade, cascade->rays[index]) :
+        cascade_texel_unpack(cascade->data[index], isa);
+    cascade->data[index] = cascade_texel_pack(
+            cascade_merge_intervals(radiance, average_radiance_up),
+            isa);
+}
+
+// the far interval of a direction: its ANGULAR_SCALING directions of
+// cascade_up, weighted by the bilinear probes (see cascade_merge_probes_up)
+vec4f cascade_merge_radiance_up(
+        radiance_cascade *cascade_up,
+        cascade_texel **probes_up,
+        float *weights,
+        int32 direction_index,
+        int32 isa) {
+    vec4f average_radiance_up = {};
+    int32 direction_up_index_base =
+        direction_index * ANGULAR_SCALING;
+    for(int32 direction_up_index_offset = 0;
+            direction_up_index_offset < ANGULAR_SCALING;
+            ++direction_up_index_offset) {
+
+        int32 direction_up_offset =
+            (direction_up_index_base + direction_up_index_offset) *
+            cascade_up->direction_step;
+
+        for(int32 tap_index = 0; tap_index < 4; ++tap_index) {
+            average_radiance_up = vec4f_sum_vec4f(
+                    average_radiance_up,
+                    vec4f_mult(
+                        cascade_texel_unpack(
+                            probes_up[tap_index][direction_up_offset],
+                            isa),
+                        weights[tap_index]));
+        }
+    }
+
+    return average_radiance_up;
+}
+
+#if CASCADE_MERGE_AVX2
+// NOTE(gio): cascade_merge_direction for directions [direction_index,
+//              direction_index + 8) of a probe, with its directions and the
+//              ones of cascade_up contiguous. The far intervals are summed
+//              as they are stored, each register holding the two texels of
+//              a pair of directions up (so the same direction below), then
+//              both intervals are turned into separate r, g, b, a registers
+//              of 8 directions for cascade_merge_intervals. Same values as
+//              the scalar code but for the order of the sums.
+CPU_TARGET_AVX2 void cascade_merge_directions_avx2(
+        radiance_cascade *cascade,
+        int64 probe_offset,
+        cascade_texel **probes_up,
+        float *weights,
+        int32 direction_index) {
+    __m256 tap_weights[4];
+    for(int32 tap_index = 0; tap_index < 4; ++tap_index) {
+        tap_weights[tap_index] = _mm256_set1_ps(weights[tap_index]);
+    }
+
+    // the ANGULAR_SCALING directions up of each direction, two at a time
+    // (two half float texels are converted by a single F16C op)
+    __m256 pair_sums[8];
+    int32 direction_up_index_base = direction_index * ANGULAR_SCALING;
+    for(int32 lane = 0; lane < 8; ++lane) {
+        __m256 sum = _mm256_setzero_ps();
+        for(int32 direction_up_index_offset = 0;
+            direction_up_index_offset < ANGULAR_SCALING;
+            direction_up_index_offset += 2) {
+            int32 direction_up_index = direction_up_index_base +
+                lane * ANGULAR_SCALING + direction_up_index_offset;
+            for(int32 tap_index = 0; tap_index < 4; ++tap_index) {
+                cascade_texel *pair =
+                    &probes_up[tap_index][direction_up_index];
+#if CASCADE_STORAGE == CASCADE_STORAGE_F16
+                __m256 texels = _mm256_cvtph_ps(
+                        _mm_loadu_si128((__m128i *) pair->e));
+#else
+                __m256 texels = _mm256_loadu_ps(pair->e);
+#endif
+                sum = _mm256_add_ps(sum, _mm256_mul_ps(
+                            texels,
+                            tap_weights[tap_index]));
+            }
+        }
+        pair_sums[lane] = sum;
+    }
+
+    // NOTE(gio): register j holds directions j and j + 4, one in each half,
+    //              as the AVX2 shuffles work inside the two halves
+    __m256 far[4];
+    for(int32 j = 0; j < 4; ++j) {
+        far[j] = _mm256_add_ps(
+                _mm256_permute2f128_ps(pair_sums[j], pair_sums[j + 4], 0x20),
+                _mm256_permute2f128_ps(pair_sums[j], pair_sums[j + 4], 0x31));
+    }
+    cascade_transpose_avx2(far);
+
+    // the near intervals, straight from the encoded rays if there are any
+    cascade_texel *texels = &cascade->data[probe_offset + direction_index];
+    vec4f decoded[8];
+    vec4f *near_texels = decoded;
+    if (cascade->palette) {
+        for(int32 lane = 0; lane < 8; ++lane) {
+            decoded[lane] = cascade_ray_decode(cascade,
+                    cascade->rays[probe_offset + direction_index + lane]);
+        }
+    } else {
+#if CASCADE_STORAGE == CASCADE_STORAGE_F16
+        vec4f_from_vec4h_n_f16c(decoded, texels, 8);
+#else
+        near_texels = texels;
+#endif
+    }
+    __m256 near[4];
+    for(int32 j = 0; j < 4; ++j) {
+        near[j] = _mm256_set_m128(
+                _mm_loadu_ps(near_texels[j + 4].e),
+                _mm_loadu_ps(near_texels[j].e));
+    }
+    cascade_transpose_avx2(near);
+
+    // cascade_merge_intervals, r, g, b, a
+    __m256 merged[4];
+    for(int32 channel = 0; channel < 3; ++channel) {
+        merged[channel] = _mm256_add_ps(
+                near[channel],
+                _mm256_mul_ps(far[channel], near[3]));
+    }
+    merged[3] = _mm256_mul_ps(near[3], far[3]);
+
+    cascade_transpose_avx2(merged);
+    for(int32 j = 0; j < 4; ++j) {
+        __m128 low = _mm256_castps256_ps128(merged[j]);
+        __m128 high = _mm256_extractf128_ps(merged[j], 1);
+#if CASCADE_STORAGE == CASCADE_STORAGE_F16
+        _mm_storel_epi64((__m128i *) texels[j].e,
+                _mm_cvtps_ph(low, _MM_FROUND_TO_NEAREST_INT));
+        _mm_storel_epi64((__m128i *) texels[j + 4].e,
+                _mm_cvtps_ph(high, _MM_FROUND_TO_NEAREST_INT));
+#else
+        _mm_storeu_ps(texels[j].e, low);
+        _mm_storeu_ps(texels[j + 4].e, high);
+#endif
+    }
+}
+
+// 4x4 transpose in each half: 4 vec4 become their x, y, z, w and back
+CPU_TARGET_AVX2 void cascade_transpose_avx2(__m256 *v) {
+    __m256 xy01 = _mm256_unpacklo_ps(v[0], v[1]);
+    __m256 zw01 = _mm256_unpackhi_ps(v[0], v[1]);
+    __m256 xy23 = _mm256_unpacklo_ps(v[2], v[3]);
+    __m256 zw23 = _mm256_unpackhi_ps(v[2], v[3]);
+    v[0] = _mm256_shuffle_ps(xy01, xy23, 0x44);
+    v[1] = _mm256_shuffle_ps(xy01, xy23, 0xee);
+    v[2] = _mm256_shuffle_ps(zw01, zw23, 0x44);
+    v[3] = _mm256_shuffle_ps(zw01, zw23, 0xee);
+}
+#endif
+
+#if CPU_DISPATCH
+// NOTE(gio): cascade_merge_direction for directions [direction_index,
+//              direction_index + 4) of a probe, with its directions and the
+//              ones of cascade_up contiguous, for the hosts without AVX2.
+//              Each direction is a register (r, g, b, a): its far interval
+//              summed in the order of cascade_merge_radiance_up, and
+//              cascade_merge_intervals with a blend for the alpha. Same
+//              values as the scalar code, the half floats converted by it
+CPU_TARGET_SSE41 void cascade_merge_directions_sse41(
+        radiance_cascade *cascade,
+        int64 probe_offset,
+        cascade_texel **probes_up,
+        float *weights,
+        int32 direction_index) {
+    __m128 tap_weights[4];
+    for(int32 tap_index = 0; tap_index < 4; ++tap_index) {
+        tap_weights[tap_index] = _mm_set1_ps(weights[tap_index]);
+    }
+
+    cascade_texel *texels = &cascade->data[probe_offset + direction_index];
+    for(int32 lane = 0; lane < 4; ++lane) {
+        __m128 far = _mm_setzero_ps();
+        int32 direction_up_index_base =
+            (direction_index + lane) * ANGULAR_SCALING;
+        for(int32 direction_up_index_offset = 0;
+            direction_up_index_offset < ANGULAR_SCALING;
+            ++direction_up_index_offset) {
+            for(int32 tap_index = 0; tap_index < 4; ++tap_index) {
+                cascade_texel *texel = &probes_up[tap_index][
+                    direction_up_index_base + direction_up_index_offset];
+#if CASCADE_STORAGE == CASCADE_STORAGE_F16
+                __m128 radiance_up = _mm_loadu_ps(vec4f_from_vec4h(*texel).e);
+#else
+                __m128 radiance_up = _mm_loadu_ps(texel->e);
+#endif
+                far = _mm_add_ps(far, _mm_mul_ps(
+                            radiance_up,
+                            tap_weights[tap_index]));
+            }
+        }
+
+        // the near interval, straight from the encoded rays if there are any
+        vec4f near_texel = (cascade->palette) ?
+            cascade_ray_decode(cascade,
+                    cascade->rays[probe_offset + direction_index + lane]) :
+#if CASCADE_STORAGE == CASCADE_STORAGE_F16
+            vec4f_from_vec4h(texels[lane]);
+#else
+            texels[lane];
+#endif
+        __m128 near = _mm_loadu_ps(near_texel.e);
+        __m128 near_alpha = _mm_shuffle_ps(near, near, 0xff);
+        __m128 merged = _mm_blend_ps(
+                _mm_add_ps(near, _mm_mul_ps(far, near_alpha)),
+                _mm_mul_ps(near, far),
+                0x8);
+#if CASCADE_STORAGE == CASCADE_STORAGE_F16
+        vec4f merged_texel;
+        _mm_storeu_ps(merged_texel.e, merged);
+        texels[lane] = vec4h_from_vec4f(merged_texel);
+#else
+        _mm_storeu_ps(texels[lane].e, merged);
+#endif
+    }
+}
+#endif
+
 vec4f bilinear_weights(vec2f ratio) {
     return (vec4f){
         .x = (1.f - ratio.x) * (1.f - ratio.y),
@@ -412,9 +2020,11 @@ vec2i bilinear_offset(int32 index) {
 // TODO(gio): do this better, result sucks rn
 //              merge the skybox to the last cascade instead of this
 void cascade_apply_skybox(
-        radiance_cascade cascade,
+        radiance_cascade *cascade,
         vec3f skybox) {
+    cascade_expand_rays(cascade);
 
+    int32 isa = cpu_isa();
     vec4f skybox_hit = {
         .r = skybox.r,
         .g = skybox.g,
@@ -422,117 +2032,382 @@ void cascade_apply_skybox(
         .a = 1.f // because it "hit" the skybox
     };
 
-    // merge skybox into cascade
-    for(int32 data_index = 0;
-        data_index < cascade.data_length;
-        ++data_index) {
+    // merge skybox into cascade, whatever the layout
+    for(int32 probe_y = 0; probe_y < cascade->probe_number.y; ++probe_y) {
+        for(int32 probe_x = 0; probe_x < cascade->probe_number.x; ++probe_x) {
+            cascade_texel *probe = cascade_probe(cascade, probe_x, probe_y);
+            for(int32 direction_index = 0;
+                direction_index < cascade->angular_number;
+                ++direction_index) {
+                cascade_texel *radiance =
+                    &probe[direction_index * cascade->direction_step];
+                *radiance = cascade_texel_pack(
+                    // cascade_merge_intervals(*radiance, skybox_hit);
+                    cascade_merge_intervals(
+                        skybox_hit,
+                        cascade_texel_unpack(*radiance, isa)),
+                    isa);
+            }
+        }
+    }
+}
 
-        cascade.data[data_index] =
-            // cascade_merge_intervals(cascade.data[data_index], skybox_hit);
-            cascade_merge_intervals(skybox_hit, cascade.data[data_index]);
+// NOTE(gio): the final gather, from cascade0 (merged) into the map pixels
+void cascades_to_map(map m, radiance_cascade *cascades, int32 cascades_number) {
+    if (cascades[0].data == NULL && cascades_number > 1) {
+        cascade_gather_to_map(m, &cascades[0], &cascades[1]);
+        return;
     }
+    cascade_to_map(m, cascades[0]);
 }
 
 void cascade_to_map(map m, radiance_cascade cascade) {
-    // applying cascades into the pixels
-    for (int32 pixel_index = 0; pixel_index < m.w * m.h; ++pixel_index) {
-        int32 x = pixel_index % m.w;
-        int32 y = pixel_index / m.w;
-
-        // int32 probe_x = x / cascade.probe_size.x;
-        // int32 probe_y = y / cascade.probe_size.y;
-        // int32 probe_index =
-        //     (probe_y * cascade.probe_number.x + probe_x) *
-        //     cascade.angular_number;
-
-        // printf("pixel(%d, %d) probe(%d, %d) probe_index(%d)\n",
-        //         x, y, probe_x, probe_y, probe_index);
-
-        // vec4f *probe = &cascade.data[probe_index];
-
-        // NOTE(bilinear): for finding top-left bilinear probe (of cascade_up obv)
-        vec2f base_coord = vec2f_sum_vec2f(
-            (vec2f) {
-                .x = (float) (x + 0.5f) / (float) cascade.probe_size.x,
-                .y = (float) (y + 0.5f) / (float) cascade.probe_size.y
-            },
-            (vec2f) { .x = -0.5f, .y = -0.5f }
-        );
-        vec2i bilinear_base = (vec2i) {
-            .x = (int32) floorf(base_coord.x),
-            .y = (int32) floorf(base_coord.y)
-        };
-        vec2f ratio = (vec2f) {
-            .x = (base_coord.x - (int32) base_coord.x) * SIGN(base_coord.x),
-            .y = (base_coord.y - (int32) base_coord.y) * SIGN(base_coord.y),
-        };
-        vec4f weights = bilinear_weights(ratio);
+    // unmerged rays, expanded into data for this copy of the cascade
+    cascade_expand_rays(&cascade);
+
+    // NOTE(gio): averaging the directions is linear, so do it once per
+    //              probe and interpolate the result for each pixel,
+    //              instead of interpolating every direction for every pixel
+    vec4f *fluence = calloc(
+            cascade.probe_number.x * cascade.probe_number.y,
+            sizeof(vec4f));
+
+    cascade_integrate_fluence(cascade, fluence);
+    cascade_fluence_to_map(m, cascade, fluence);
+
+    free(fluence);
+}
+
+// NOTE(gio): same values as cascade_to_map on the merged cascade, with the
+//              same rays traced, but each probe's rays are traced, merged
+//              with cascade_up (already merged) and reduced to its fluence
+//              right away, so the cascade is never stored
+void cascade_gather_to_map(
+        map m,
+        radiance_cascade *cascade,
+        radiance_cascade *cascade_up) {
+    vec4f *fluence = calloc(
+            cascade->probe_number.x * cascade->probe_number.y,
+            sizeof(vec4f));
+
+    cascade_fluence_job job = {
+        .m = m,
+        .cascade = *cascade,
+        .cascade_up = *cascade_up,
+        .fluence = fluence,
+        .taps_x = cascade_taps_create(
+                cascade->probe_number.x,
+                cascade->probe_size.x / cascade_up->probe_size.x,
+                cascade_up->probe_number.x),
+        .taps_y = cascade_taps_create(
+                cascade->probe_number.y,
+                cascade->probe_size.y / cascade_up->probe_size.y,
+                cascade_up->probe_number.y)
+    };
+    thread_pool_run(
+            cascades_thread_pool,
+            cascade_gather_fluence_row,
+            &job,
+            cascade->probe_number.y);
+    free(job.taps_y);
+    free(job.taps_x);
+    cascade_fluence_to_map(m, *cascade, fluence);
+
+    free(fluence);
+}
+
+void cascade_gather_fluence_row(void *data, int32 probe_y) {
+    cascade_fluence_job *job = (cascade_fluence_job *) data;
+    map m = job->m;
+    radiance_cascade cascade = job->cascade;
+    radiance_cascade cascade_up = job->cascade_up;
+    int32 isa = cpu_isa();
+
+    vec4f *rays = malloc(cascade.angular_number * sizeof(vec4f));
+    for(int32 probe_x = 0; probe_x < cascade.probe_number.x; ++probe_x) {
+        cascade_trace_probe(&m, &cascade, probe_x, probe_y, rays);
+
+        cascade_texel *probes_up[4];
+        float weights[4];
+        cascade_merge_probes_up(
+                &cascade_up,
+                job->taps_x[probe_x],
+                job->taps_y[probe_y],
+                probes_up,
+                weights);
 
         vec4f average = {};
         for(int32 direction_index = 0;
             direction_index < cascade.angular_number;
             ++direction_index) {
+            vec4f radiance = cascade_merge_intervals(
+                    rays[direction_index],
+                    cascade_merge_radiance_up(
+                        &cascade_up,
+                        probes_up,
+                        weights,
+                        direction_index,
+                        isa));
+            average = vec4f_sum_vec4f(
+                    average,
+                    vec4f_divide(radiance, cascade.angular_number));
+        }
 
-            // vec4f radiance = probe[direction_index];
-            // NOTE(bilinear): get the radiance from 4 probes around
-            vec4f radiance_up = {};
+        job->fluence[probe_y * cascade.probe_number.x + probe_x] = average;
+    }
+    free(rays);
+}
 
-            // Count how many values have been used in the average
-            int32 usable_probe_up_count = 0;
+void cascade_integrate_fluence(radiance_cascade cascade, vec4f *fluence) {
+    cascade_fluence_job job = {
+        .cascade = cascade,
+        .fluence = fluence
+    };
+    thread_pool_run(
+            cascades_thread_pool,
+            cascade_integrate_fluence_row,
+            &job,
+            cascade.probe_number.y);
+}
 
-            for(int32 bilinear_index = 0;
-                    bilinear_index < 4;
-                    ++bilinear_index) {
+void cascade_integrate_fluence_row(void *data, int32 probe_y) {
+    cascade_fluence_job *job = (cascade_fluence_job *) data;
+    radiance_cascade cascade = job->cascade;
+    int32 isa = cpu_isa();
+
+    if (cascade.layout == CASCADE_LAYOUT_DIRECTION_MAJOR) {
+        // the fluence row accumulates one direction at a time, in the same
+        // order as below so that both layouts give the same values
+        vec4f *fluence_row = &job->fluence[probe_y * cascade.probe_number.x];
+        vec4f *scratch = malloc(cascade.probe_number.x * sizeof(vec4f));
+        for(int32 probe_x = 0; probe_x < cascade.probe_number.x; ++probe_x) {
+            fluence_row[probe_x] = (vec4f) {};
+        }
+        for(int32 direction_index = 0;
+            direction_index < cascade.angular_number;
+            ++direction_index) {
+            vec4f *row = cascade_texels_unpack(
+                    scratch,
+                    &cascade_probe(&cascade, 0, probe_y)[
+                        direction_index * cascade.direction_step],
+                    cascade.probe_number.x,
+                    isa);
+#if CPU_DISPATCH
+            if (isa >= CPU_ISA_AVX2) {
+                cascade_fluence_accumulate_avx2(
+                        fluence_row,
+                        row,
+                        cascade.probe_number.x,
+                        cascade.angular_number);
+                continue;
+            }
+#endif
+            for(int32 probe_x = 0; probe_x < cascade.probe_number.x; ++probe_x) {
+                fluence_row[probe_x] = vec4f_sum_vec4f(
+                        fluence_row[probe_x],
+                        vec4f_divide(row[probe_x], cascade.angular_number));
+            }
+        }
+        free(scratch);
+        return;
+    }
 
-                vec2i offset = bilinear_offset(bilinear_index);
+    // with AVX2 the probes are averaged 2 at a time, the last one (if the
+    // row is odd) below
+    vec4f *scratch = malloc(2 * cascade.angular_number * sizeof(vec4f));
+    int32 probe_x = 0;
+#if CPU_DISPATCH
+    if (isa >= CPU_ISA_AVX2) {
+        for(; probe_x + 2 <= cascade.probe_number.x; probe_x += 2) {
+            vec4f *probes[2];
+            for(int32 probe_offset = 0; probe_offset < 2; ++probe_offset) {
+                probes[probe_offset] = cascade_texels_unpack(
+                        &scratch[probe_offset * cascade.angular_number],
+                        cascade_probe(
+                            &cascade, probe_x + probe_offset, probe_y),
+                        cascade.angular_number,
+                        isa);
+            }
+            cascade_fluence_average_avx2(
+                    &job->fluence[probe_y * cascade.probe_number.x + probe_x],
+                    probes,
+                    cascade.angular_number);
+        }
+    }
+#endif
+    for(; probe_x < cascade.probe_number.x; ++probe_x) {
+        int32 probe_index = probe_y * cascade.probe_number.x + probe_x;
+        vec4f *probe = cascade_texels_unpack(
+                scratch,
+                cascade_probe(&cascade, probe_x, probe_y),
+                cascade.angular_number,
+                isa);
 
-                vec4f bilinear_radiance = (vec4f) { 0, 0, 0, 0 };
+        vec4f average = {};
+        for(int32 direction_index = 0;
+            direction_index < cascade.angular_number;
+            ++direction_index) {
+            average = vec4f_sum_vec4f(
+                    average,
+                    vec4f_divide(
+                        probe[direction_index],
+                        cascade.angular_number));
+        }
 
-                if (0 <= bilinear_base.x + offset.x &&
-                    bilinear_base.x + offset.x < cascade.probe_number.x &&
-                    0 <= bilinear_base.y + offset.y &&
-                    bilinear_base.y + offset.y < cascade.probe_number.y) {
+        job->fluence[probe_index] = average;
+    }
+    free(scratch);
+}
 
-                    // here the value is usable for the average
-                    usable_probe_up_count++;
+void cascade_fluence_to_map(map m, radiance_cascade cascade, vec4f *fluence) {
+    // NOTE(gio): a pixel is 1 wide, so its coordinate in the probes is
+    //              scaled by 1 / probe_size
+    cascade_fluence_job job = {
+        .m = m,
+        .cascade = cascade,
+        .fluence = fluence,
+        .taps_x = cascade_taps_create(
+                m.w, 1.f / cascade.probe_size.x, cascade.probe_number.x),
+        .taps_y = cascade_taps_create(
+                m.h, 1.f / cascade.probe_size.y, cascade.probe_number.y)
+    };
+    thread_pool_run(
+            cascades_thread_pool,
+            cascade_fluence_to_map_row,
+            &job,
+            m.h);
+    free(job.taps_y);
+    free(job.taps_x);
+}
 
-                    int32 bilinear_probe_index =
-                        (bilinear_base.y + offset.y) * cascade.probe_number.x +
-                        (bilinear_base.x + offset.x);
+void cascade_fluence_to_map_row(void *data, int32 y) {
+    cascade_fluence_job *job = (cascade_fluence_job *) data;
+    map m = job->m;
+    radiance_cascade cascade = job->cascade;
+    cascade_tap tap_y = job->taps_y[y];
 
-                    vec4f *bilinear_probe =
-                        &cascade.data[bilinear_probe_index *
-                        cascade.angular_number];
-                    bilinear_radiance =
-                        bilinear_probe[direction_index];
+    // applying the probes fluence into the pixels
+    vec4f *fluence_rows[2] = {
+        &job->fluence[tap_y.index[0] * cascade.probe_number.x],
+        &job->fluence[tap_y.index[1] * cascade.probe_number.x]
+    };
+    int32 x = 0;
+#if CPU_DISPATCH
+    if (cpu_isa() >= CPU_ISA_AVX2) {
+        x = cascade_fluence_to_map_pixels_avx2(job, y, fluence_rows);
+    }
+#endif
+    for (; x < m.w; ++x) {
+        cascade_tap tap_x = job->taps_x[x];
 
-                    radiance_up = vec4f_sum_vec4f(
-                            radiance_up,
-                            vec4f_divide(
-                                vec4f_diff_vec4f(
-                                    bilinear_radiance,
-                                    radiance_up),
-                                (float) usable_probe_up_count));
-                }
+        // NOTE(bilinear): get the fluence from the 4 probes around
+        vec4f average = {};
+        for(int32 side_y = 0; side_y < 2; ++side_y) {
+            for(int32 side_x = 0; side_x < 2; ++side_x) {
+                average = vec4f_sum_vec4f(
+                        average,
+                        vec4f_mult(
+                            fluence_rows[side_y][tap_x.index[side_x]],
+                            tap_x.weight[side_x] * tap_y.weight[side_y]));
+            }
+        }
+        average.a = 1.f;
 
+        m.pixels[y * m.w + x] = average;
+    }
+}
+
+#if CPU_DISPATCH
+// NOTE(gio): the gather kernels work on 2 probes or pixels at a time, a
+//              vec4f in each 128 bit lane, doing for each lane the same
+//              operations in the same order as the scalar code: same
+//              values to the bit (the AVX2 target has no FMA to contract
+//              the products and sums into)
+
+// the average of the directions of 2 probes, see cascade_integrate_fluence_row
+CPU_TARGET_AVX2 void cascade_fluence_average_avx2(
+        vec4f *fluence,
+        vec4f **probes,
+        int32 angular_number) {
+    __m256 divisor = _mm256_set1_ps((float) angular_number);
+    __m256 average = _mm256_setzero_ps();
+    for(int32 direction_index = 0;
+        direction_index < angular_number;
+        ++direction_index) {
+        __m256 radiance = _mm256_set_m128(
+                _mm_loadu_ps(probes[1][direction_index].e),
+                _mm_loadu_ps(probes[0][direction_index].e));
+        average = _mm256_add_ps(average, _mm256_div_ps(radiance, divisor));
+    }
+    _mm256_storeu_ps(fluence[0].e, average);
+}
+
+// one direction of a row of probes added to its fluence, with the
+// direction-major layout (contiguous probes, so plain loads)
+CPU_TARGET_AVX2 void cascade_fluence_accumulate_avx2(
+        vec4f *fluence_row,
+        vec4f *row,
+        int32 length,
+        int32 angular_number) {
+    __m256 divisor = _mm256_set1_ps((float) angular_number);
+    int32 probe_x = 0;
+    for(; probe_x + 2 <= length; probe_x += 2) {
+        __m256 fluence = _mm256_add_ps(
+                _mm256_loadu_ps(fluence_row[probe_x].e),
+                _mm256_div_ps(_mm256_loadu_ps(row[probe_x].e), divisor));
+        _mm256_storeu_ps(fluence_row[probe_x].e, fluence);
+    }
+    if (probe_x < length) {
+        __m128 fluence = _mm_add_ps(
+                _mm_loadu_ps(fluence_row[probe_x].e),
+                _mm_div_ps(
+                    _mm_loadu_ps(row[probe_x].e),
+                    _mm256_castps256_ps128(divisor)));
+        _mm_storeu_ps(fluence_row[probe_x].e, fluence);
+    }
+}
 
-                // radiance_up = vec4f_sum_vec4f(
-                //         radiance_up,
-                //         vec4f_mult(
-                //             bilinear_radiance,
-                //             weights.e[bilinear_index]));
+// the pixels of row y 2 at a time, see cascade_fluence_to_map_row,
+// returns how many were done (the rest are left to it)
+CPU_TARGET_AVX2 int32 cascade_fluence_to_map_pixels_avx2(
+        cascade_fluence_job *job,
+        int32 y,
+        vec4f **fluence_rows) {
+    map m = job->m;
+    cascade_tap tap_y = job->taps_y[y];
+    vec4f *pixels = &m.pixels[y * m.w];
+    __m256 alpha = _mm256_set1_ps(1.f);
+
+    int32 x = 0;
+    for(; x + 2 <= m.w; x += 2) {
+        cascade_tap *tap_x = &job->taps_x[x];
+
+        // NOTE(bilinear): get the fluence from the 4 probes around
+        __m256 average = _mm256_setzero_ps();
+        for(int32 side_y = 0; side_y < 2; ++side_y) {
+            for(int32 side_x = 0; side_x < 2; ++side_x) {
+                __m256 fluence = _mm256_set_m128(
+                        _mm_loadu_ps(
+                            fluence_rows[side_y][tap_x[1].index[side_x]].e),
+                        _mm_loadu_ps(
+                            fluence_rows[side_y][tap_x[0].index[side_x]].e));
+                __m256 weight = _mm256_set_m128(
+                        _mm_set1_ps(
+                            tap_x[1].weight[side_x] * tap_y.weight[side_y]),
+                        _mm_set1_ps(
+                            tap_x[0].weight[side_x] * tap_y.weight[side_y]));
+                average = _mm256_add_ps(
+                        average,
+                        _mm256_mul_ps(fluence, weight));
             }
-            average = vec4f_sum_vec4f(
-                    average,
-                    vec4f_divide(
-                        radiance_up,
-                        cascade.angular_number));
         }
-        average.a = 1.f;
+        average = _mm256_blend_ps(average, alpha, 0x88);
 
-        m.pixels[pixel_index] = average;
+        _mm256_storeu_ps(pixels[x].e, average);
     }
+    return x;
 }
+#endif
 
 #endif // RADIANCE_CASCADES_CASCADES_IMPLEMENTATION
 
@@ -6,12 +6,18 @@
 
 #include "cascades.h"
 
+#ifndef BILINEAR_FIX_INSTANT_CASCADES
 #define BILINEAR_FIX_INSTANT_CASCADES 0
+#endif
 
 #if BILINEAR_FIX_INSTANT_CASCADES != 0
 
+// NOTE(gio): a row has a border of one probe on each side, data[-1] and
+//              data[probe_number.x] (in probes), copies of the probes at
+//              the edges, and a row asked for outside the cascade is the
+//              edge row (see cascade_tap). The taps are summed by row
 typedef struct cached_row {
-    int32 data_length;
+    int32 data_length; // without the border
     vec4f *data;
     int32 y;
 } cached_row;
@@ -21,7 +27,9 @@ typedef struct cached_rows_radiance_cascade {
     int32 angular_number;
     vec2f interval;
     vec2f probe_size;
+    map_ray_template *templates; // one for each direction
     cached_row rows[2]; // need 2 rows to apply bilinear fix on all levels
+    uint64 rays_cast; // by this level
 } cached_rows_radiance_cascade;
 
 
@@ -31,8 +39,9 @@ Method:
  - iterate the pixels by row
  - for each new pixel row check if the cache has to be updated
  - to update (same as top-down):
-    - calculate from the upper cascade downwards, so to apply the bilinear fix
-    - kind of the same
+    - ask the two rows of cascade0 around the pixel row, each row asks the
+        two rows of the cascade above around it before merging, so the rows
+        are calculated from the upper cascade downwards
 
 key differences:
  - in Method 1 it would all start from the iteration of the upper cascade
@@ -48,7 +57,16 @@ void
 cached_rows_cascade_from_cascade0(cached_rows_radiance_cascade cascade0, cached_rows_radiance_cascade *cached_rows_cascade, int32 cascade_index);
 
 void
-calculate_cascades_and_apply_to_map(map m, int32 cascades_number);
+cached_row_fill_border(cached_row *row, int32 probe_number_x, int32 angular_number);
+
+// the row y of the cascade, traced and merged with the rows of the cascades
+// above (calculated first, if not cached already)
+cached_row *
+cached_rows_get_row(map m_read, cached_rows_radiance_cascade *cascades, int32 cascades_number, int32 cascade_index, int32 y);
+
+// returns the number of rays cast
+uint64
+calculate_cascades_and_apply_to_map(map m_read, map m, int32 cascades_number);
 
 
 #ifdef RADIANCE_CASCADES_CASCADES_INSTANT_IMPLEMENTATION
@@ -75,20 +93,27 @@ void cached_rows_cascade0_init(map m, cached_rows_radiance_cascade *cascade) {
         .y = (float) m.h / (float) cascade->probe_number.y
     };
 
-    // allocate cascade memory
+    // allocate cascade memory, with the border probes
     int32 row_data_length =
         cascade->probe_number.x * cascade->angular_number;
+    int32 border_length = cascade->angular_number;
 
-    vec4f *data_start = calloc(row_data_length * 2, sizeof(vec4f));
+    vec4f *data_start = calloc(
+            (row_data_length + 2 * border_length) * 2,
+            sizeof(vec4f));
 
     cascade->rows[0].data_length = row_data_length;
-    cascade->rows[0].data = data_start;
+    cascade->rows[0].data = data_start + border_length;
     cascade->rows[0].y =  -100;
 
     cascade->rows[1].data_length = row_data_length;
-    cascade->rows[1].data = data_start + row_data_length;
+    cascade->rows[1].data =
+        data_start + row_data_length + 3 * border_length;
     cascade->rows[1].y =  -100;
 
+    cascade->templates =
+        map_ray_templates_create(cascade->angular_number, cascade->interval);
+
     printf("allocated cascade0 rows(%d x 2)\n", row_data_length);
 }
 
@@ -133,24 +158,174 @@ void cached_rows_cascade_from_cascade0(
         .y = (float) cascade0.probe_size.y / current_cascade_dimension_scaling
     };
 
+    // with the border probes
     int32 row_data_length =
         cached_rows_cascade->probe_number.x * cached_rows_cascade->angular_number;
-    vec4f *data_start = calloc(row_data_length * 2, sizeof(vec4f));
+    int32 border_length = cached_rows_cascade->angular_number;
+    vec4f *data_start = calloc(
+            (row_data_length + 2 * border_length) * 2,
+            sizeof(vec4f));
 
     cached_rows_cascade->rows[0].data_length = row_data_length;
-    cached_rows_cascade->rows[0].data = data_start;
+    cached_rows_cascade->rows[0].data = data_start + border_length;
     cached_rows_cascade->rows[0].y =  -100;
 
     cached_rows_cascade->rows[1].data_length = row_data_length;
-    cached_rows_cascade->rows[1].data = data_start + row_data_length;
+    cached_rows_cascade->rows[1].data =
+        data_start + row_data_length + 3 * border_length;
     cached_rows_cascade->rows[1].y =  -100;
 
+    cached_rows_cascade->templates = map_ray_templates_create(
+            cached_rows_cascade->angular_number,
+            cached_rows_cascade->interval);
+
     printf("allocated cascade(%d) rows(%d x 2)\n",
             cascade_index,
             row_data_length);
 }
 
-void calculate_cascades_and_apply_to_map(map m, int32 cascades_number) {
+// copies of the edge probes, once the row is calculated (and merged)
+void cached_row_fill_border(
+        cached_row *row,
+        int32 probe_number_x,
+        int32 angular_number) {
+    memcpy(&row->data[-angular_number],
+           &row->data[0],
+           angular_number * sizeof(vec4f));
+    memcpy(&row->data[probe_number_x * angular_number],
+           &row->data[(probe_number_x - 1) * angular_number],
+           angular_number * sizeof(vec4f));
+}
+
+cached_row *cached_rows_get_row(
+        map m_read,
+        cached_rows_radiance_cascade *cascades,
+        int32 cascades_number,
+        int32 cascade_index,
+        int32 y) {
+    cached_rows_radiance_cascade *cascade = &cascades[cascade_index];
+
+    // rows outside the cascade are copies of the edge rows
+    y = CLAMP(y, 0, cascade->probe_number.y - 1);
+
+    // NOTE(gio): the rows are asked for in pairs (y, y + 1) with y never
+    //              going back, so a row only has to live until the row two
+    //              after it is asked for and can take its slot
+    cached_row *row = &cascade->rows[y & 1];
+    if (row->y == y) return row;
+    row->y = y;
+
+    // calculate cascade row
+    for(int32 x = 0; x < cascade->probe_number.x; ++x) {
+        // probe center position to raycast from
+        vec2f probe_center = {
+            .x = (float) cascade->probe_size.x * (x + 0.5f),
+            .y = (float) cascade->probe_size.y * (y + 0.5f),
+        };
+        map_rays_intersect_templates(
+                m_read,
+                probe_center,
+                cascade->templates,
+                cascade->angular_number,
+                &row->data[x * cascade->angular_number]);
+    }
+    cascade->rays_cast += cascade->probe_number.x * cascade->angular_number;
+
+    // no need to merge if it's the upper most cascade
+    if (cascade_index == cascades_number - 1) {
+        cached_row_fill_border(
+                row,
+                cascade->probe_number.x,
+                cascade->angular_number);
+        return row;
+    }
+
+    // [START] merge with the cascade above
+    cached_rows_radiance_cascade *cascade_up = &cascades[cascade_index + 1];
+
+    // NOTE(bilinear): for finding top-left bilinear probe (of cascade_up obv)
+    int32 bilinear_base_y = (int32) floorf(
+            ((y + 0.5f) * cascade->probe_size.y) /
+                cascade_up->probe_size.y - 0.5f);
+    cached_row *rows_up[2];
+    rows_up[0] = cached_rows_get_row(
+            m_read, cascades, cascades_number,
+            cascade_index + 1, bilinear_base_y);
+    rows_up[1] = cached_rows_get_row(
+            m_read, cascades, cascades_number,
+            cascade_index + 1, bilinear_base_y + 1);
+
+    for(int32 probe_x = 0; probe_x < cascade->probe_number.x; ++probe_x) {
+        int32 bilinear_base_x = (int32) floorf(
+                ((probe_x + 0.5f) * cascade->probe_size.x) /
+                    cascade_up->probe_size.x - 0.5f);
+
+        vec4f *probe = &row->data[probe_x * cascade->angular_number];
+
+        for(int32 direction_index = 0;
+                direction_index < cascade->angular_number;
+                ++direction_index) {
+
+            vec4f average_radiance_up = {};
+            int32 direction_up_index_base =
+                direction_index * ANGULAR_SCALING;
+            for(int32 direction_up_index_offset = 0;
+                    direction_up_index_offset < ANGULAR_SCALING;
+                    ++direction_up_index_offset) {
+
+                int32 direction_up_index =
+                    direction_up_index_base + direction_up_index_offset;
+
+                // NOTE(bilinear): get the radiance from 4 probes around, the
+                //                  ones outside the cascade are in the border
+                //                  (see cached_row), summed by row
+                vec4f row_radiance_up[2] = {};
+
+                for(int32 bilinear_index = 0;
+                        bilinear_index < 4;
+                        ++bilinear_index) {
+
+                    vec2i offset = bilinear_offset(bilinear_index);
+
+                    vec4f *bilinear_probe_up = &rows_up[offset.y]->data[
+                        (bilinear_base_x + offset.x) *
+                            cascade_up->angular_number];
+
+                    row_radiance_up[offset.y] = vec4f_sum_vec4f(
+                            row_radiance_up[offset.y],
+                            vec4f_mult(
+                                bilinear_probe_up[direction_up_index],
+                                0.25f));
+                }
+
+                average_radiance_up = vec4f_sum_vec4f(
+                        average_radiance_up,
+                        vec4f_divide(
+                            vec4f_sum_vec4f(
+                                row_radiance_up[0],
+                                row_radiance_up[1]),
+                            (float) ANGULAR_SCALING));
+            }
+
+            vec4f probe_direction_radiance = probe[direction_index];
+            probe[direction_index] = cascade_merge_intervals(
+                    probe_direction_radiance,
+                    average_radiance_up);
+        }
+    }
+    // [END]
+
+    cached_row_fill_border(
+            row,
+            cascade->probe_number.x,
+            cascade->angular_number);
+    return row;
+}
+
+uint64 calculate_cascades_and_apply_to_map(
+        map m_read,
+        map m,
+        int32 cascades_number) {
     cached_rows_radiance_cascade *cascades =
         calloc(cascades_number, sizeof(cached_rows_radiance_cascade));
 
@@ -167,320 +342,54 @@ void calculate_cascades_and_apply_to_map(map m, int32 cascades_number) {
                 cascade_index);
     }
 
+    cached_rows_radiance_cascade cascade0 = cascades[0];
+
     // NOTE(gio): iterate each pixel row
     for(int32 pix_y = 0; pix_y < m.h; ++pix_y) {
-        int32 cascade0_bilinear_base_y = (int32)
-            floorf(((float) (pix_y + 0.5f) /
-                        (float) cascades[0].probe_size.y) - 0.5f);
-        printf("pix_y(%d)\n", pix_y);
-        // NOTE(gio): check for each cascade if I need to calculate a new row
-        for(int32 cascade_index = cascades_number - 1;
-                cascade_index >= 0;
-                --cascade_index) {
-
-            cached_rows_radiance_cascade *cascade = &cascades[cascade_index];
-            // will need this later for the merging
-
-            // loop constant: every higher cascade is already calculated
-
-            int32 bilinear_base_y = cascade0_bilinear_base_y;
-            for(int32 i = 0; i < cascade_index; i++) {
-                cached_rows_radiance_cascade *current = &cascades[i];
-                cached_rows_radiance_cascade *current_up = &cascades[i+1];
-
-                bilinear_base_y = floorf(((bilinear_base_y + 1 + 0.5f) *
-                                    current->probe_size.y /
-                                    current_up->probe_size.y) - 0.5f);
-                printf("cascade(%d, size(%f, %f)) bilinear_base_y(%d)\n",
-                        i+1,
-                        current_up->probe_size.x, current_up->probe_size.y,
-                        bilinear_base_y
-                        );
-            }
-
-            for(int32 row_index = 0; row_index < 2; ++row_index) {
-                cached_row *row = &cascade->rows[row_index];
-
-                // this `if` is for when the first row will replace the second row
-                // if (row_index == 0 &&
-                //     row->y != bilinear_base_y &&
-                //     cascade->rows[1].y == bilinear_base_y) {
-                //     // just need to copy the row content
-                //     memcpy(row->data,
-                //            cascade->rows[1].data,
-                //            row->data_length * sizeof(vec4f));
-                //     printf("cascade(%d) row(old: %d, new: %d) just copying\n",
-                //             cascade_index,
-                //             row->y,
-                //             bilinear_base_y + row_index);
-                //     row->y = bilinear_base_y;
-
-                // // this is for the generic case, where the data is outdated
-                // } else
-                printf("cascade(%d) row_index(%d) row(old: %d, new: %d)\n",
-                        cascade_index,
-                        row_index,
-                        row->y,
-                        bilinear_base_y + row_index);
-                if (row->y != bilinear_base_y + row_index) {
-                    row->y = bilinear_base_y + row_index;
-                    // calculate cascade row
-                    for(int32 x = 0; x < cascade->probe_number.x; ++x) {
-                        int32 y = row->y;
-
-                        // probe center position to raycast from
-                        vec2f probe_center = {
-                            .x = (float) cascade->probe_size.x * (x + 0.5f),
-                            .y = (float) cascade->probe_size.y * (y + 0.5f),
-                        };
-                        // printf("angular_number(%d)\n",
-                        //         cascade->angular_number);
-                        for(int32 direction_index = 0;
-                            direction_index < cascade->angular_number;
-                            ++direction_index) {
-                            float direction_angle =
-                                2.f * PI *
-                                (((float) direction_index + 0.5f) /
-                                 (float) cascade->angular_number);
-
-                            vec2f ray_direction =
-                                vec2f_from_angle(direction_angle);
-
-                            int32 result_index =
-                                x * cascade->angular_number + direction_index;
-
-                            vec4f result =
-                                map_ray_intersect(
-                                        m,
-                                        probe_center,
-                                        ray_direction,
-                                        cascade->interval.x,
-                                        cascade->interval.y);
-
-                            row->data[result_index] = result;
-                        }
-                    }
-
-                    // no need to merge if it's the upper most cascade
-                    if (cascade_index == cascades_number - 1) {
-                        continue;
-                    }
+        int32 bilinear_base_y = (int32) floorf(
+                ((float) (pix_y + 0.5f) /
+                    (float) cascade0.probe_size.y) - 0.5f);
+
+        // the two rows of cascade0 around the pixel row, the ones of the
+        // cascades above are calculated on the way (if not cached already)
+        cached_row *rows[2];
+        rows[0] = cached_rows_get_row(
+                m_read, cascades, cascades_number, 0, bilinear_base_y);
+        rows[1] = cached_rows_get_row(
+                m_read, cascades, cascades_number, 0, bilinear_base_y + 1);
 
-                    cached_rows_radiance_cascade *cascade_up =
-                        &cascades[cascade_index + 1];
-                    float angular_scaling =
-                        cascade_up->angular_number / cascade->angular_number;
-                    // [START] merge with the cascade above if necessary
-
-                    int32 probe_y = row->y;
-
-                    // NOTE(bilinear): for finding top-left bilinear probe (of cascade_up obv)
-                    vec2f base_coord = vec2f_sum_vec2f(
-                        (vec2f) {
-                            .x = 0.f,
-                            .y = (float)
-                                ((probe_y + 0.5f) * cascade->probe_size.y) /
-                                    (float) cascade_up->probe_size.y
-                        }, (vec2f) { .x = 0.f, .y = -0.5f });
-                    vec2i bilinear_base = (vec2i) {
-                        .x = 0,
-                        .y = (int32) floorf(base_coord.y)
-                    };
-                    vec2f ratio = (vec2f) {
-                        .x = 0.f,
-                        .y = (base_coord.y - (int32) base_coord.y) *
-                                SIGN(base_coord.y)
-                    };
-
-                    for(int32 probe_x = 0;
-                        probe_x < cascade->probe_number.x;
-                        ++probe_x) {
-
-                        base_coord.x = (float)
-                            (((probe_x + 0.5f) * cascade->probe_size.x) /
-                             (float) cascade_up->probe_size.x) - 0.5f;
-                        bilinear_base.x = (int32) floorf(base_coord.x);
-                        ratio.x = (base_coord.x - (int32) base_coord.x) *
-                            SIGN(base_coord.x);
-                        vec4f weights = bilinear_weights(ratio);
-
-                        vec4f *probe =
-                            &row->data[probe_x * cascade->angular_number];
-
-                        printf("cascade_up(%d) row0(%d, %d) row1(%d, %d) pix_y(%d)\n",
-                                cascade_index + 1,
-                                cascade_up->rows[0].y,
-                                bilinear_base.y,
-                                cascade_up->rows[1].y,
-                                bilinear_base.y+1,
-                                pix_y);
-                        printf("cascade_up(probe_size(%f, %f))\n",
-                                cascade_up->probe_size.x,
-                                cascade_up->probe_size.y);
-                        printf("cascade(probe_size(%f, %f))\n",
-                                cascade->probe_size.x,
-                                cascade->probe_size.y);
-                        assert(cascade_up->rows[0].y == bilinear_base.y);
-                        assert(cascade_up->rows[1].y == bilinear_base.y+1);
-
-                        for(int32 direction_index = 0;
-                                direction_index < cascade->angular_number;
-                                ++direction_index) {
-
-                            vec4f average_radiance_up = {};
-                            int32 direction_up_index_base =
-                                direction_index * ANGULAR_SCALING;
-                            for(int32 direction_up_index_offset = 0;
-                                    direction_up_index_offset < ANGULAR_SCALING;
-                                    ++direction_up_index_offset) {
-
-                                int32 direction_up_index =
-                                    direction_up_index_base + direction_up_index_offset;
-
-                                // NOTE(bilinear): get the radiance from
-                                //                  4 probes around only
-                                //                  valid probes are used
-                                //                  (e.g. on the corners,
-                                //                      some positions might
-                                //                      be invalid, hence will
-                                //                      not be used)
-                                vec4f radiance_up = {};
-
-                                // Count how many values
-                                // have been used in the average
-                                int32 usable_probe_up_count = 0;
-
-                                for(int32 bilinear_index = 0;
-                                        bilinear_index < 4;
-                                        ++bilinear_index) {
-
-                                    vec2i offset = bilinear_offset(bilinear_index);
-
-                                    if (0 <= bilinear_base.x + offset.x &&
-                                            bilinear_base.x + offset.x <
-                                            cascade_up->probe_number.x &&
-                                        0 <= bilinear_base.y + offset.y &&
-                                            bilinear_base.y + offset.y <
-                                            cascade_up->probe_number.y) {
-
-                                        // here the value is usable for the average
-                                        usable_probe_up_count++;
-
-                                        cached_row bilinear_row_up = cascade_up->rows[offset.y];
-                                        int32 bilinear_probe_up_index = bilinear_base.x + offset.x;
-
-                                        vec4f *bilinear_probe_up = &bilinear_row_up.data[
-                                            bilinear_probe_up_index * cascade_up->angular_number];
-
-                                        vec4f bilinear_radiance_up =
-                                            bilinear_probe_up[direction_up_index];
-
-                                        radiance_up = vec4f_sum_vec4f(
-                                                radiance_up,
-                                                vec4f_divide(
-                                                    vec4f_diff_vec4f(
-                                                        bilinear_radiance_up,
-                                                        radiance_up),
-                                                    (float) usable_probe_up_count));
-                                    }
-                                }
-
-                                average_radiance_up = vec4f_sum_vec4f(
-                                        average_radiance_up,
-                                        vec4f_divide(
-                                            radiance_up,
-                                            (float) ANGULAR_SCALING));
-                            }
-
-                            vec4f probe_direction_radiance = probe[direction_index];
-                            probe[direction_index] = cascade_merge_intervals(
-                                    probe_direction_radiance,
-                                    average_radiance_up);
-                        }
-                    }
-                    // [END]
-                }
-            }
-        }
-
-        cached_rows_radiance_cascade cascade0 = cascades[0];
-
-        vec2f base_coord = (vec2f) {
-            .x = -1, // updated for each pixel
-            .y = ((float) (pix_y + 0.5f) /
-                  (float) cascade0.probe_size.y) - 0.5f
-        };
-        vec2i bilinear_base = (vec2i) {
-            .x = -1, // updated for each pixel
-            .y = (int32) floorf(base_coord.y)
-        };
-        vec2f ratio = (vec2f) {
-            .x = -1, // updated for each pixel
-            .y = (base_coord.y - (int32) base_coord.y) * SIGN(base_coord.y),
-        };
-
-        // here all the cache is correct for the pixel i need
         for(int32 pix_x = 0; pix_x < m.w; ++pix_x) {
-            base_coord.x = ((float) (pix_x + 0.5f) /
-                            (float) cascade0.probe_size.x) - 0.5f;
-
-            bilinear_base.x = (int32) floorf(base_coord.x);
-
-            ratio.x =
-                (base_coord.x - (int32) base_coord.x) * SIGN(base_coord.x);
-
-            vec4f weights = bilinear_weights(ratio);
+            int32 bilinear_base_x = (int32) floorf(
+                    ((float) (pix_x + 0.5f) /
+                        (float) cascade0.probe_size.x) - 0.5f);
 
             vec4f average = {};
             for(int32 direction_index = 0;
                 direction_index < cascade0.angular_number;
                 ++direction_index) {
 
-                // NOTE(bilinear): get the radiance from 4 probes around
-                vec4f radiance_up = {};
-
-                // Count how many values have been used in the average
-                int32 usable_probe_up_count = 0;
+                // NOTE(bilinear): get the radiance from 4 probes around,
+                //                  border included (see cached_row)
+                vec4f row_radiance[2] = {};
 
                 for(int32 bilinear_index = 0;
                         bilinear_index < 4;
                         ++bilinear_index) {
 
-                    // NOTE(gio): offset.y represents which cache row I need
-                    //              to use currently.
                     vec2i offset = bilinear_offset(bilinear_index);
 
-                    if (0 <= bilinear_base.x + offset.x &&
-                        bilinear_base.x + offset.x < cascade0.probe_number.x &&
-                        0 <= bilinear_base.y + offset.y &&
-                        bilinear_base.y + offset.y < cascade0.probe_number.y) {
-
-                        // here the value is usable for the average
-                        usable_probe_up_count++;
-
-                        // TODO(gio): check offset.y is either 0 or 1
-                        cached_row bilinear_row = cascade0.rows[offset.y];
-                        int32 bilinear_probe_index = bilinear_base.x + offset.x;
-                        vec4f *bilinear_probe = &bilinear_row.data[
-                            bilinear_probe_index * cascade0.angular_number];
-
-                        vec4f bilinear_radiance =
-                            bilinear_probe[direction_index];
-
-                        radiance_up = vec4f_sum_vec4f(
-                                radiance_up,
-                                vec4f_divide(
-                                    vec4f_diff_vec4f(
-                                        bilinear_radiance,
-                                        radiance_up),
-                                    (float) usable_probe_up_count));
-                    }
+                    vec4f *bilinear_probe = &rows[offset.y]->data[
+                        (bilinear_base_x + offset.x) *
+                            cascade0.angular_number];
 
+                    row_radiance[offset.y] = vec4f_sum_vec4f(
+                            row_radiance[offset.y],
+                            vec4f_mult(bilinear_probe[direction_index], 0.25f));
                 }
                 average = vec4f_sum_vec4f(
                         average,
                         vec4f_divide(
-                            radiance_up,
+                            vec4f_sum_vec4f(row_radiance[0], row_radiance[1]),
                             cascade0.angular_number));
             }
             average.a = 1.f;
@@ -489,6 +398,19 @@ void calculate_cascades_and_apply_to_map(map m, int32 cascades_number) {
             m.pixels[pixel_index] = average;
         }
     }
+
+    uint64 rays_cast = 0;
+    for(int32 cascade_index = 0;
+        cascade_index < cascades_number;
+        ++cascade_index) {
+        cached_rows_radiance_cascade *cascade = &cascades[cascade_index];
+        rays_cast += cascade->rays_cast;
+        map_ray_templates_free(cascade->templates);
+        // both rows are in the allocation of the first one, with its border
+        free(cascade->rows[0].data - cascade->angular_number);
+    }
+    free(cascades);
+    return rays_cast;
 }
 
 
@@ -507,13 +429,16 @@ typedef struct cached_radiance_cascade {
     int32 angular_number;
     vec2f interval;
     vec2f probe_size;
+    map_ray_template *templates; // one for each direction
     cached_probe probe;
+    uint64 rays_cast; // by this level
 } cached_radiance_cascade;
 
 radiance_cascade
 cascade_instant_init(map m);
 
-void
+// returns the number of rays cast
+uint64
 cascade_instant_generate_and_apply(map m_read, map m, radiance_cascade cascade0, int32 cascades_number);
 
 void
@@ -558,7 +483,7 @@ radiance_cascade cascade_instant_init(map m) {
     return cascade;
 }
 
-void cascade_instant_generate_and_apply(
+uint64 cascade_instant_generate_and_apply(
         map m_read,
         map m,
         radiance_cascade cascade0,
@@ -623,26 +548,13 @@ void cascade_instant_generate_and_apply(
         };
 
         // calculate the top probe, then recurse down
-        for(int32 direction_index = 0;
-                direction_index < top_cascade->angular_number;
-                ++direction_index) {
-            float direction_angle =
-                2.f * PI *
-                (((float) direction_index + 0.5f) /
-                 (float) top_cascade->angular_number);
-
-            vec2f ray_direction = vec2f_from_angle(direction_angle);
-
-            vec4f radiance =
-                map_ray_intersect(
-                        m_read,
-                        probe_center,
-                        ray_direction,
-                        top_cascade->interval.x,
-                        top_cascade->interval.y);
-
-            top_cascade->probe.data[direction_index] = radiance;
-        }
+        map_rays_intersect_templates(
+                m_read,
+                probe_center,
+                top_cascade->templates,
+                top_cascade->angular_number,
+                top_cascade->probe.data);
+        top_cascade->rays_cast += top_cascade->angular_number;
 
         // now recursing down within the current top probe
         cascade_instant_recurse_down(
@@ -653,6 +565,15 @@ void cascade_instant_generate_and_apply(
                 cascades,
                 cached_cascades_length);
     }
+
+    uint64 rays_cast = 0;
+    for(int32 cached_cascade_index = 0;
+            cached_cascade_index < cached_cascades_length;
+            ++cached_cascade_index) {
+        rays_cast += cascades[cached_cascade_index].rays_cast;
+        map_ray_templates_free(cascades[cached_cascade_index].templates);
+    }
+    return rays_cast;
 }
 
 void cascade_instant_recurse_down(
@@ -706,17 +627,19 @@ void cascade_instant_recurse_down(
             .y = (float) cascade->probe_size.y * (cascade->probe.y + 0.5f),
         };
 
+        // calculate current cascade probe radiance, all directions at once
+        map_rays_intersect_templates(
+                m_read,
+                probe_center,
+                cascade->templates,
+                cascade->angular_number,
+                cascade->probe.data);
+        cascade->rays_cast += cascade->angular_number;
+
         for(int32 direction_index = 0;
                 direction_index < cascade->angular_number;
                 ++direction_index) {
 
-            float direction_angle =
-                2.f * PI *
-                (((float) direction_index + 0.5f) /
-                 (float) cascade->angular_number);
-
-            vec2f ray_direction = vec2f_from_angle(direction_angle);
-
             vec4f average_radiance_up = {};
             int32 direction_up_index_base =
                 direction_index * ANGULAR_SCALING;
@@ -739,14 +662,8 @@ void cascade_instant_recurse_down(
                             (float) ANGULAR_SCALING));
             }
 
-            // calculate current cascade probe radiance for this direction
             vec4f probe_direction_radiance =
-                map_ray_intersect(
-                        m_read,
-                        probe_center,
-                        ray_direction,
-                        cascade->interval.x,
-                        cascade->interval.y);
+                cascade->probe.data[direction_index];
 
             // printf("probe_direction_radiance(%f, %f, %f)\n",
             //         probe_direction_radiance.r,
@@ -884,6 +801,11 @@ void cascade_cached_from_cascade0(
         .x = (float) cascade0.probe_size.x / current_cascade_dimension_scaling,
         .y = (float) cascade0.probe_size.y / current_cascade_dimension_scaling
     };
+
+    // same directions and interval for every probe
+    cached_cascade->templates = map_ray_templates_create(
+            cached_cascade->angular_number,
+            cached_cascade->interval);
 }
 
 #endif // RADIANCE_CASCADES_CASCADES_INSTANT_IMPLEMENTATION
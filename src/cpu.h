@@ -0,0 +1,140 @@
+#ifndef _RC_CPU_H_
+#define _RC_CPU_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mathy.h"
+
+///
+/// Instruction sets of the host, to pick the SIMD kernels at runtime.
+///
+/// The kernels are compiled for each instruction set in the same binary
+/// (with target attributes, so no -m flags are needed) and `cpu_isa`
+/// picks the widest the CPU runs, asking cpuid once. The environment
+/// variable CPU_ISA_ENV forces one by name (when the CPU has it).
+///
+
+// ### CPU PARAMETERS ###
+#define CPU_ISA_SCALAR 0 // the baseline of the build, SSE2 on x86-64
+#define CPU_ISA_SSE41 1 // blends, rounding and 32 bit products on 4 lanes
+#define CPU_ISA_AVX2 2 // with F16C, for the half float storage
+#define CPU_ISA_AVX512 3 // AVX-512 F for the ray packets, AVX2 for the rest
+#define CPU_ISA_ENV "RC_ISA" // e.g. RC_ISA=avx2 or RC_ISA=scalar
+// ###########################
+
+// NOTE(gio): what each level runs
+//              - scalar: every kernel in its portable version, built for
+//                the baseline (SSE2 on x86-64, gcc vectorizes the vec4f
+//                math there), the half floats converted in software
+//              - sse41: the 4-wide ray packets (the walk needs floor,
+//                blendv and the 32 bit products of SSE4.1) and the merge 4
+//                directions at a time, the half floats still in software
+//              - avx2: the merge 8 directions at a time, the 8-wide ray
+//                packets, the gather (fluence of each probe and pixels) 2
+//                at a time and the F16C half float conversions
+//              - avx512: the 16-wide ray packets, the rest as avx2
+//              The merge and the gather have no AVX-512 kernels: their
+//              vec4f are loaded 128 bits at a time from separate probes,
+//              so the wider registers cost more inserts than they save.
+//              AVX-512 F also brings FMA to the target, so the kernels
+//              built for it turn off the contraction of the float ops
+
+// NOTE(gio): gcc and clang can build a function for an instruction set
+//              the rest of the binary doesn't assume, elsewhere only the
+//              scalar kernels are there
+#if (defined(__GNUC__) || defined(__clang__)) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define CPU_DISPATCH 1
+#define CPU_TARGET_SSE41 __attribute__((target("sse4.1")))
+#define CPU_TARGET_AVX2 __attribute__((target("avx2,f16c")))
+#define CPU_TARGET_AVX512 __attribute__((target("avx512f,f16c")))
+#include <immintrin.h>
+#else
+#define CPU_DISPATCH 0
+#define CPU_TARGET_SSE41
+#define CPU_TARGET_AVX2
+#define CPU_TARGET_AVX512
+#endif
+
+int32
+cpu_isa(void);
+
+int32
+cpu_isa_pick(void);
+
+int32
+cpu_isa_detect(void);
+
+const char *
+cpu_isa_name(int32 isa);
+
+#ifdef RADIANCE_CASCADES_CPU_IMPLEMENTATION
+
+// -1 until picked
+static int32 cpu_isa_picked = -1;
+
+// NOTE(gio): the first call picks it, make it before starting any thread.
+//              Kept this small so it inlines into the per texel callers
+int32 cpu_isa(void) {
+    if (cpu_isa_picked >= 0) return cpu_isa_picked;
+    return cpu_isa_pick();
+}
+
+int32 cpu_isa_pick(void) {
+    int32 detected = cpu_isa_detect();
+    int32 isa = detected;
+
+    const char *env = getenv(CPU_ISA_ENV);
+    if (env) {
+        int32 forced = -1;
+        for(int32 candidate = CPU_ISA_SCALAR;
+            candidate <= CPU_ISA_AVX512;
+            ++candidate) {
+            if (strcmp(env, cpu_isa_name(candidate)) == 0) forced = candidate;
+        }
+        if (forced < 0) {
+            fprintf(stderr, "[ERROR] Unknown %s: %s\n", CPU_ISA_ENV, env);
+        } else if (forced > detected) {
+            fprintf(stderr, "[ERROR] %s=%s but the cpu only has %s\n",
+                    CPU_ISA_ENV, env, cpu_isa_name(detected));
+        } else {
+            isa = forced;
+        }
+    }
+
+    cpu_isa_picked = isa;
+    printf("cpu isa(%s) detected(%s)%s\n",
+            cpu_isa_name(isa),
+            cpu_isa_name(detected),
+            (isa != detected) ? " forced by " CPU_ISA_ENV : "");
+    return cpu_isa_picked;
+}
+
+// the widest instruction set of the host with kernels in the binary
+int32 cpu_isa_detect(void) {
+#if CPU_DISPATCH
+    // NOTE(gio): cpuid, and xgetbv to know the OS saves the wide registers
+    __builtin_cpu_init();
+    if (!__builtin_cpu_supports("avx2") ||
+        !__builtin_cpu_supports("f16c")) {
+        if (__builtin_cpu_supports("sse4.1")) return CPU_ISA_SSE41;
+        return CPU_ISA_SCALAR;
+    }
+    if (__builtin_cpu_supports("avx512f")) return CPU_ISA_AVX512;
+    return CPU_ISA_AVX2;
+#endif
+    return CPU_ISA_SCALAR;
+}
+
+const char *cpu_isa_name(int32 isa) {
+    if (isa == CPU_ISA_AVX512) return "avx512";
+    if (isa == CPU_ISA_AVX2) return "avx2";
+    if (isa == CPU_ISA_SSE41) return "sse41";
+    return "scalar";
+}
+
+#endif // RADIANCE_CASCADES_CPU_IMPLEMENTATION
+
+#endif // _RC_CPU_H_
@@ -13,6 +13,12 @@
 #define RADIANCE_CASCADES_SHAPES_IMPLEMENTATION
 #include "shapes.h"
 
+#define RADIANCE_CASCADES_THREADS_IMPLEMENTATION
+#include "threads.h"
+
+#define RADIANCE_CASCADES_CPU_IMPLEMENTATION
+#include "cpu.h"
+
 #define RADIANCE_CASCADES_MAP_IMPLEMENTATION
 #include "map.h"
 
@@ -29,8 +35,19 @@ int main(void) {
     // variables
     map m = map_create(WIDTH, HEIGHT);
 
-    radiance_cascade *cascades =
-        calloc(CASCADE_NUMBER, sizeof(radiance_cascade));
+    // every level sized up front, in one allocation
+#if CASCADE_GENERATE_AND_MERGE != 0
+    cascade_arena arena = cascade_arena_create_pipelined(m, CASCADE_NUMBER);
+#else
+    cascade_arena arena = cascade_arena_create(m, CASCADE_NUMBER);
+#endif
+    radiance_cascade *cascades = arena.cascades;
+
+    // the SIMD kernels, picked before any thread can ask
+    cpu_isa();
+
+    thread_pool *pool = thread_pool_create(CASCADE_THREAD_NUMBER);
+    cascades_set_thread_pool(pool);
 
     GLFWwindow *glfw_win;
     float delta_time = 0;
@@ -67,7 +84,24 @@ int main(void) {
     glEnable(GL_FRAMEBUFFER_SRGB);
 
     INIT_MAP(m);
+#if USE_DISTANCE_FIELD != 0
+    map_build_distance_field(&m, pool);
+#endif
+#if USE_OCCUPANCY != 0
+    map_build_occupancy(&m, pool);
+#endif
+#if USE_PYRAMID != 0
+    map_build_pyramid(&m, pool);
+#endif
+#if USE_MIP != 0
+    map_build_mip(&m, pool);
+#endif
     // ### test ###
+#if CASCADE_GENERATE_AND_MERGE != 0
+    // NOTE(gio): only cascade0 and cascade1 survive
+    printf("generating and merging...\n");
+    cascades_generate_and_merge(m, cascades, CASCADE_NUMBER);
+#else
     for(int32 cascade_index = 0;
         cascade_index < CASCADE_NUMBER;
         ++cascade_index) {
@@ -77,14 +111,18 @@ int main(void) {
     }
 #if APPLY_SKYBOX != 0
     printf("Applying skybox...\n");
-    cascade_apply_skybox(cascades[CASCADE_NUMBER - 1], SKYBOX);
+    cascade_apply_skybox(&cascades[CASCADE_NUMBER - 1], SKYBOX);
 #endif
 #if MERGE_CASCADES != 0
     printf("merging...\n");
     cascades_merge(cascades, CASCADE_NUMBER);
 #endif
+#endif
 #if APPLY_CASCADE_TO_MAP != 0
-    cascade_to_map(m, cascades[CASCADE_TO_APPLY_TO_MAP]);
+    cascades_to_map(
+            m,
+            &cascades[CASCADE_TO_APPLY_TO_MAP],
+            CASCADE_NUMBER - CASCADE_TO_APPLY_TO_MAP);
 #endif
 
     texture map_texture = map_generate_texture(m);
@@ -133,9 +171,9 @@ int main(void) {
     }
 
     // free cascades
-    for(int32 cascade_index = 0;
-        cascade_index < CASCADE_NUMBER;
-        ++cascade_index) {
-        cascade_free(&cascades[cascade_index]);
-    }
+    cascade_arena_free(&arena);
+
+    cascades_set_thread_pool(NULL);
+    thread_pool_destroy(pool);
+    map_free(&m);
 }
@@ -14,6 +14,12 @@
 #define RADIANCE_CASCADES_SHAPES_IMPLEMENTATION
 #include "shapes.h"
 
+#define RADIANCE_CASCADES_THREADS_IMPLEMENTATION
+#include "threads.h"
+
+#define RADIANCE_CASCADES_CPU_IMPLEMENTATION
+#include "cpu.h"
+
 #define RADIANCE_CASCADES_MAP_IMPLEMENTATION
 #include "map.h"
 
@@ -65,16 +71,33 @@ int main(void) {
     // Automatically apply sRGB convertion when rendering
     glEnable(GL_FRAMEBUFFER_SRGB);
 
+    // the SIMD kernels, picked before any thread can ask
+    cpu_isa();
+
+    thread_pool *pool = thread_pool_create(CASCADE_THREAD_NUMBER);
+    cascades_set_thread_pool(pool);
+
     map m_read = map_create(WIDTH, HEIGHT);
     INIT_MAP(m_read);
 
     map m = map_copy(m_read);
 
+#if USE_DISTANCE_FIELD != 0
+    // only m_read is used for tracing
+    map_build_distance_field(&m_read, pool);
+#endif
+#if USE_OCCUPANCY != 0
+    map_build_occupancy(&m_read, pool);
+#endif
+#if USE_PYRAMID != 0
+    map_build_pyramid(&m_read, pool);
+#endif
+
 #if BILINEAR_FIX_INSTANT_CASCADES != 0
 
     printf("bilinear fix on instant cascades\n");
 
-    calculate_cascades_and_apply_to_map(m, CASCADE_NUMBER);
+    calculate_cascades_and_apply_to_map(m_read, m, CASCADE_NUMBER);
 
 #else
 
@@ -129,4 +152,9 @@ int main(void) {
 
     // free cascades
     // cascade_free(&cascade);
+
+    cascades_set_thread_pool(NULL);
+    thread_pool_destroy(pool);
+    map_free(&m_read);
+    map_free(&m);
 }
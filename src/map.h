@@ -6,9 +6,46 @@
 #include "render.h"
 #include "mathy.h"
 #include "shapes.h"
+#include "threads.h"
+#include "cpu.h"
 
 #define SHOW_RAYS_ON_MAP 0
 
+// build a distance field for the map, so rays can skip the empty space
+#define USE_DISTANCE_FIELD 1
+// trace against the packed occupancy bits and material indices
+#define USE_OCCUPANCY 1
+// build the occupancy pyramid, used to skip empty blocks when there is
+// no distance field
+#define USE_PYRAMID 0
+// build the prefiltered mip chain, traced by the upper cascades depending
+// on CASCADE_MIP_POLICY
+#define USE_MIP 0
+
+// how map_ray_intersect walks the pixels, see map_set_ray_traversal
+#define MAP_RAY_LEGACY 0 // slope stepper, the pixels of the original tracer
+#define MAP_RAY_DDA 1 // clipped to the map, each crossed pixel exactly once
+#define MAP_RAY_PACKET 2 // the same pixels as DDA, rays of a probe 8 at a
+                         // time with AVX2 (16 with AVX-512, 4 with SSE4.1)
+                         // and the occupancy
+#define MAP_RAY_TRAVERSAL MAP_RAY_LEGACY
+
+// NOTE(gio): without SSE4.1 (see cpu_isa) or the occupancy the packets are
+//              traced one ray at a time, with the same results
+#if CPU_DISPATCH && SHOW_RAYS_ON_MAP == 0
+#define MAP_RAY_PACKET_SIMD 1
+#else
+#define MAP_RAY_PACKET_SIMD 0
+#endif
+
+#define MAP_PALETTE_SIZE 256 // material index 0 is always VOID
+#define MAP_PALETTE_LOOKUP_SIZE 512 // power of 2, twice the palette at least
+#define MAP_OCCUPANCY_JOB_WORDS 64 // 64 bit words packed by each job
+#define MAP_PYRAMID_MAX_LEVELS 16
+#define MAP_MIP_MAX_LEVELS 8
+// a mip ray stops when less than this fraction of the light gets through
+#define MAP_MIP_TRANSPARENCY_MIN 0.001f
+
 #define VOID (vec4f){ .r = 0.f, .g = 0, .b = 0, .a = 0.f }
 #define OBSTACLE (vec4f){ .r = 0.f, .g = 0, .b = 0, .a = 1.f }
 #define RED_LIGHT (vec4f){ .r = 1.0f, .g = 0, .b = 0, .a = 1.f }
@@ -20,23 +57,199 @@
 
 #define SKYBOX (vec3f){ .r = 0.015f, .g = 0.02f, .b = 0.045f }
 
+// NOTE(gio): compact copy of the pixels for ray traversal: tracing only needs
+//              to know if a pixel is VOID and, on a hit, its color
+typedef struct map_occupancy {
+    uint64 *bits; // 1 bit per pixel, set if not VOID, same indexing as pixels
+    uint8 *material; // palette index of each pixel
+    vec4f palette[MAP_PALETTE_SIZE];
+    int32 palette_length;
+    // palette index of a color by its rgb (the first one with that rgb),
+    // open addressing with 0 as the empty slot, see map_palette_find
+    uint8 palette_lookup[MAP_PALETTE_LOOKUP_SIZE];
+} map_occupancy;
+
+// NOTE(gio): levels[k] has a cell for every 2^k x 2^k block of pixels, set
+//              if any pixel of the block is not VOID (each level ORs 2x2
+//              cells of the one below). Level 0 is the pixels themselves.
+typedef struct map_pyramid {
+    uint8 *levels[MAP_PYRAMID_MAX_LEVELS];
+    vec2i level_size[MAP_PYRAMID_MAX_LEVELS];
+    int32 level_number;
+} map_pyramid;
+
+// NOTE(gio): prefiltered copies of the map, levels[k] has a texel for every
+//              2^k x 2^k block of pixels with the emission averaged over the
+//              block (VOID counting as black) and, as alpha, the fraction of
+//              the block that is not VOID. Level 0 is the map itself and is
+//              not stored.
+typedef struct map_mip {
+    vec4f *levels[MAP_MIP_MAX_LEVELS];
+    vec2i level_size[MAP_MIP_MAX_LEVELS];
+    int32 level_number;
+} map_mip;
+
+// inclusive box of pixels
+typedef struct map_box {
+    int32 x0, y0;
+    int32 x1, y1;
+} map_box;
+
 typedef struct map {
     vec4f *pixels;
     int32 w;
     int32 h;
+    // optional, chessboard distance to the nearest non-VOID pixel
+    // (0 on non-VOID pixels), see map_build_distance_field
+    uint16 *distance;
+    // optional, see map_build_occupancy
+    map_occupancy *occupancy;
+    // optional, see map_build_pyramid
+    map_pyramid *pyramid;
+    // optional, see map_build_mip
+    map_mip *mip;
 } map;
 
+// NOTE(gio): everything a ray needs that only depends on its direction and
+//              interval, shared by all the probes of a cascade. Relative to
+//              the rounded start pixel, the column walk of the legacy
+//              stepper only depends on the per-column y offsets, so they
+//              are computed once with the same float math.
+typedef struct map_ray_template {
+    vec2f direction;
+    float slope;
+    int32 direction_x;
+    vec2f interval;
+    int32 column_number;
+    float *column_offset; // slope * (k * direction_x), k in [0, column_number)
+} map_ray_template;
+
+typedef struct map_pyramid_job {
+    map m;
+    int32 level;
+    map_box region; // in cells of the level
+} map_pyramid_job;
+
+typedef struct map_mip_job {
+    map m;
+    int32 level;
+} map_mip_job;
+
+typedef struct map_distance_job {
+    map m;
+    int32 *row_distance;
+    int32 *envelope; // 2 * m.h for each thread, see map_distance_field_column
+} map_distance_job;
+
 map
 map_create(int32 width, int32 height);
 
 map
 map_copy(map m);
 
+void
+map_free(map *m);
+
+void
+map_build_distance_field(map *m, thread_pool *pool);
+
+void
+map_distance_field_row(void *data, int32 y);
+
+void
+map_distance_field_column(void *data, int32 x);
+
+int32
+map_distance_envelope(int32 *g, int32 stride, int32 y, int32 i);
+
+void
+map_free_distance_field(map *m);
+
+void
+map_build_occupancy(map *m, thread_pool *pool);
+
+uint32
+map_palette_hash(vec4f color);
+
+int32
+map_palette_find(vec4f *palette, uint8 *palette_lookup, vec4f color);
+
+void
+map_occupancy_pack(void *data, int32 job_index);
+
+void
+map_free_occupancy(map *m);
+
+void
+map_build_pyramid(map *m, thread_pool *pool);
+
+void
+map_update_pyramid(map *m, map_box region);
+
+void
+map_pyramid_row(void *data, int32 row);
+
+void
+map_free_pyramid(map *m);
+
+void
+map_build_mip(map *m, thread_pool *pool);
+
+void
+map_mip_row(void *data, int32 row);
+
+void
+map_free_mip(map *m);
+
+map_box
+map_empty_box(map *m, int32 x, int32 y);
+
+int32
+map_is_void(map *m, int32 index);
+
+vec4f
+map_pixel(map *m, int32 index);
+
+void
+map_set_ray_traversal(int32 traversal);
+
 vec4f
 map_ray_intersect(map m, vec2f origin, vec2f direction, float t0, float t1);
 
-texture
-map_generate_texture(map m);
+vec4f
+map_ray_intersect_legacy(map m, vec2f origin, vec2f direction, float t0, float t1);
+
+vec4f
+map_ray_intersect_skip(map m, vec2f origin, vec2f direction, float t0, float t1);
+
+vec4f
+map_ray_intersect_dda(map m, vec2f origin, vec2f direction, float t0, float t1);
+
+void
+map_rays_intersect_templates(map m, vec2f origin, map_ray_template *rays, int32 ray_number, vec4f *results);
+
+#if MAP_RAY_PACKET_SIMD
+CPU_TARGET_SSE41 void
+map_ray_intersect_packet4(map m, vec2f origin, map_ray_template *rays, vec4f *results);
+
+CPU_TARGET_AVX2 void
+map_ray_intersect_packet(map m, vec2f origin, map_ray_template *rays, vec4f *results);
+
+CPU_TARGET_AVX512 void
+map_ray_intersect_packet16(map m, vec2f origin, map_ray_template *rays, vec4f *results);
+#endif
+
+vec4f
+map_ray_intersect_mip(map m, int32 level, vec2f origin, vec2f direction, float t0, float t1);
+
+map_ray_template *
+map_ray_templates_create(int32 angular_number, vec2f interval);
+
+void
+map_ray_templates_free(map_ray_template *templates);
+
+vec4f
+map_ray_intersect_template(map m, vec2f origin, map_ray_template *ray);
 
 void
 map_draw_circle(map m, circle c);
@@ -44,19 +257,30 @@ map_draw_circle(map m, circle c);
 void
 map_draw_rectangle(map m, rectangle r);
 
+#ifndef RADIANCE_CASCADES_HEADLESS
+
+texture
+map_generate_texture(map m);
+
 void
 map_setup_renderer(GLuint *vao, GLuint *vbo, GLuint *ebo);
 
 void
 map_render(GLuint vao, texture map_texture, shader_program map_shader, map m);
 
+#endif // RADIANCE_CASCADES_HEADLESS
+
 #ifdef RADIANCE_CASCADES_MAP_IMPLEMENTATION
 
 map map_create(int32 width, int32 height) {
     map m = {
         .pixels = NULL,
         .w = width,
-        .h = height
+        .h = height,
+        .distance = NULL,
+        .occupancy = NULL,
+        .pyramid = NULL,
+        .mip = NULL
     };
     m.pixels = calloc(m.w * m.h, sizeof(vec4f));
 
@@ -70,7 +294,520 @@ map map_copy(map m) {
     return result;
 }
 
+void map_free(map *m) {
+    if (m == NULL) return;
+    map_free_distance_field(m);
+    map_free_occupancy(m);
+    map_free_pyramid(m);
+    map_free_mip(m);
+    if (m->pixels) {
+        free(m->pixels);
+        m->pixels = NULL;
+    }
+}
+
+// NOTE(gio): the distance field describes the pixels at the moment it's
+//              built, it has to be rebuilt if the map changes
+void map_build_distance_field(map *m, thread_pool *pool) {
+    if (m == NULL) return;
+    if (m->distance == NULL) {
+        // one more, never written, for the 32 bit reads of the packets
+        m->distance = calloc(m->w * m->h + 1, sizeof(uint16));
+    }
+
+    // horizontal distance inside each row first, then each column
+    // combines the rows around it (exact for the chessboard distance),
+    // both linear in the pixels
+    int32 thread_number = pool ? pool->thread_number : 1;
+    map_distance_job job = {
+        .m = *m,
+        .row_distance = calloc(m->w * m->h, sizeof(int32)),
+        .envelope = malloc(thread_number * 2 * m->h * sizeof(int32))
+    };
+    thread_pool_run(pool, map_distance_field_row, &job, m->h);
+    thread_pool_run(pool, map_distance_field_column, &job, m->w);
+
+    free(job.envelope);
+    free(job.row_distance);
+}
+
+void map_distance_field_row(void *data, int32 y) {
+    map_distance_job *job = (map_distance_job *) data;
+    map m = job->m;
+    int32 *row = &job->row_distance[y * m.w];
+
+    int32 far = m.w + m.h; // farther than anything in the map
+
+    int32 last = -far;
+    for(int32 x = 0; x < m.w; ++x) {
+        if (!vec4f_equals(m.pixels[y * m.w + x], VOID)) last = x;
+        row[x] = x - last;
+    }
+    last = m.w + far;
+    for(int32 x = m.w - 1; x >= 0; --x) {
+        if (row[x] == 0) last = x;
+        row[x] = MIN(row[x], last - x);
+    }
+}
+
+// NOTE(gio): the distance at (x, y) is the min over the rows i of
+//              max(|y - i|, row distance at (x, i)), a lower envelope of
+//              one function for each row, found in a single pass with the
+//              chessboard separator of Meijster et al. (2000): the row
+//              function with the smaller row distance wins from the
+//              separator on. The chessboard metric (not the euclidean one)
+//              because the rays jump by the square boxes it keeps empty.
+void map_distance_field_column(void *data, int32 x) {
+    map_distance_job *job = (map_distance_job *) data;
+    map m = job->m;
+    // row distances down the column
+    int32 *g = &job->row_distance[x];
+    int32 stride = m.w;
+
+    // rows of the envelope and the first y where each one wins
+    int32 *envelope_row =
+        &job->envelope[thread_pool_thread_index() * 2 * m.h];
+    int32 *envelope_start = envelope_row + m.h;
+
+    int32 q = 0;
+    envelope_row[0] = 0;
+    envelope_start[0] = 0;
+    for(int32 u = 1; u < m.h; ++u) {
+        while (q >= 0 &&
+               map_distance_envelope(
+                   g, stride, envelope_start[q], envelope_row[q]) >
+               map_distance_envelope(g, stride, envelope_start[q], u)) {
+            --q;
+        }
+        if (q < 0) {
+            q = 0;
+            envelope_row[0] = u;
+        } else {
+            int32 i = envelope_row[q];
+            int32 separator = (g[i * stride] <= g[u * stride]) ?
+                MAX(i + g[u * stride], (i + u) / 2) :
+                MIN(u - g[i * stride], (i + u) / 2);
+            if (separator + 1 < m.h) {
+                ++q;
+                envelope_row[q] = u;
+                envelope_start[q] = separator + 1;
+            }
+        }
+    }
+    for(int32 y = m.h - 1; y >= 0; --y) {
+        int32 best = map_distance_envelope(g, stride, y, envelope_row[q]);
+        m.distance[y * m.w + x] = (uint16) MIN(best, UINT16_MAX);
+        if (y == envelope_start[q]) --q;
+    }
+}
+
+// chessboard distance from row y to the nearest pixel of row i
+int32 map_distance_envelope(int32 *g, int32 stride, int32 y, int32 i) {
+    return MAX(abs(y - i), g[i * stride]);
+}
+
+void map_free_distance_field(map *m) {
+    if (m == NULL) return;
+    if (m->distance) {
+        free(m->distance);
+        m->distance = NULL;
+    }
+}
+
+// NOTE(gio): like the distance field, it describes the pixels at the moment
+//              it's built. Fails (leaving the map without it) if the map
+//              has more colors than MAP_PALETTE_SIZE.
+void map_build_occupancy(map *m, thread_pool *pool) {
+    if (m == NULL) return;
+    map_free_occupancy(m);
+
+    map_occupancy *occupancy = calloc(1, sizeof(map_occupancy));
+    occupancy->material = calloc(m->w * m->h, sizeof(uint8));
+    occupancy->palette[0] = VOID;
+    occupancy->palette_length = 1;
+
+    // palette first, serially, so indices are always the same
+    uint8 last_material = 0;
+    for(int32 index = 0; index < m->w * m->h; ++index) {
+        vec4f pixel = m->pixels[index];
+        if (!vec4f_equals(pixel, occupancy->palette[last_material])) {
+            int32 material = 0;
+            while (material < occupancy->palette_length &&
+                   !vec4f_equals(pixel, occupancy->palette[material])) {
+                material++;
+            }
+            if (material == occupancy->palette_length) {
+                if (occupancy->palette_length == MAP_PALETTE_SIZE) {
+                    fprintf(stderr, "[ERROR] Map has more than %d colors, "
+                            "not building the occupancy\n",
+                            MAP_PALETTE_SIZE);
+                    free(occupancy->material);
+                    free(occupancy);
+                    return;
+                }
+                occupancy->palette[occupancy->palette_length++] = pixel;
+            }
+            last_material = (uint8) material;
+        }
+        occupancy->material[index] = last_material;
+    }
+
+    // in index order, so a color shared by two entries finds the first one
+    for(int32 material = 1;
+        material < occupancy->palette_length;
+        ++material) {
+        vec4f color = occupancy->palette[material];
+        if (map_palette_find(
+                    occupancy->palette,
+                    occupancy->palette_lookup,
+                    color) != 0) {
+            continue;
+        }
+        uint32 slot = map_palette_hash(color);
+        while (occupancy->palette_lookup[slot] != 0) {
+            slot = (slot + 1) & (MAP_PALETTE_LOOKUP_SIZE - 1);
+        }
+        occupancy->palette_lookup[slot] = (uint8) material;
+    }
+
+    occupancy->bits = calloc((m->w * m->h + 63) / 64, sizeof(uint64));
+    m->occupancy = occupancy;
+
+    // NOTE(gio): rows can share a 64 bit word, so each job packs whole words
+    int32 word_number = (m->w * m->h + 63) / 64;
+    thread_pool_run(
+            pool,
+            map_occupancy_pack,
+            m,
+            (word_number + MAP_OCCUPANCY_JOB_WORDS - 1) /
+                MAP_OCCUPANCY_JOB_WORDS);
+
+    printf("map occupancy palette(%d) bytes(%d)\n",
+            occupancy->palette_length,
+            (int32) (((m->w * m->h + 63) / 64) * sizeof(uint64) +
+                m->w * m->h * sizeof(uint8)));
+}
+
+void map_occupancy_pack(void *data, int32 job_index) {
+    map *m = (map *) data;
+    map_occupancy *occupancy = m->occupancy;
+
+    int32 word_number = (m->w * m->h + 63) / 64;
+    int32 word_start = job_index * MAP_OCCUPANCY_JOB_WORDS;
+    int32 word_end = MIN(word_start + MAP_OCCUPANCY_JOB_WORDS, word_number);
+
+    for(int32 word_index = word_start; word_index < word_end; ++word_index) {
+        uint64 word = 0;
+        for(int32 bit = 0; bit < 64; ++bit) {
+            int32 index = word_index * 64 + bit;
+            if (index >= m->w * m->h) break;
+            if (occupancy->material[index] != 0) {
+                word |= (uint64) 1 << bit;
+            }
+        }
+        occupancy->bits[word_index] = word;
+    }
+}
+
+void map_free_occupancy(map *m) {
+    if (m == NULL) return;
+    if (m->occupancy) {
+        free(m->occupancy->bits);
+        free(m->occupancy->material);
+        free(m->occupancy);
+        m->occupancy = NULL;
+    }
+}
+
+void map_build_pyramid(map *m, thread_pool *pool) {
+    if (m == NULL) return;
+    map_free_pyramid(m);
+
+    map_pyramid *pyramid = calloc(1, sizeof(map_pyramid));
+    vec2i size = { .x = m->w, .y = m->h };
+    for(;;) {
+        int32 level = pyramid->level_number++;
+        pyramid->level_size[level] = size;
+        pyramid->levels[level] = calloc(size.x * size.y, sizeof(uint8));
+        if ((size.x == 1 && size.y == 1) ||
+            pyramid->level_number == MAP_PYRAMID_MAX_LEVELS) break;
+        size.x = (size.x + 1) / 2;
+        size.y = (size.y + 1) / 2;
+    }
+    m->pyramid = pyramid;
+
+    // every level depends on the one below, rows of a level are independent
+    for(int32 level = 0; level < pyramid->level_number; ++level) {
+        map_pyramid_job job = {
+            .m = *m,
+            .level = level,
+            .region = (map_box) {
+                .x0 = 0, .y0 = 0,
+                .x1 = pyramid->level_size[level].x - 1,
+                .y1 = pyramid->level_size[level].y - 1
+            }
+        };
+        thread_pool_run(pool, map_pyramid_row, &job,
+                pyramid->level_size[level].y);
+    }
+
+    printf("map pyramid levels(%d)\n", pyramid->level_number);
+}
+
+// NOTE(gio): only rebuilds the cells covering `region` (in pixels), on
+//              every level, for when only part of the map changed
+void map_update_pyramid(map *m, map_box region) {
+    if (m == NULL || m->pyramid == NULL) return;
+    map_pyramid *pyramid = m->pyramid;
+
+    region.x0 = CLAMP(region.x0, 0, m->w - 1);
+    region.y0 = CLAMP(region.y0, 0, m->h - 1);
+    region.x1 = CLAMP(region.x1, 0, m->w - 1);
+    region.y1 = CLAMP(region.y1, 0, m->h - 1);
+    if (region.x0 > region.x1 || region.y0 > region.y1) return;
+
+    for(int32 level = 0; level < pyramid->level_number; ++level) {
+        map_pyramid_job job = {
+            .m = *m,
+            .level = level,
+            .region = (map_box) {
+                .x0 = region.x0 >> level, .y0 = region.y0 >> level,
+                .x1 = region.x1 >> level, .y1 = region.y1 >> level
+            }
+        };
+        for(int32 row = 0; row <= job.region.y1 - job.region.y0; ++row) {
+            map_pyramid_row(&job, row);
+        }
+    }
+}
+
+void map_pyramid_row(void *data, int32 row) {
+    map_pyramid_job *job = (map_pyramid_job *) data;
+    map m = job->m;
+    map_pyramid *pyramid = m.pyramid;
+    int32 level = job->level;
+    vec2i size = pyramid->level_size[level];
+    uint8 *cells = pyramid->levels[level];
+
+    int32 y = job->region.y0 + row;
+    for(int32 x = job->region.x0; x <= job->region.x1; ++x) {
+        uint8 occupied = 0;
+        if (level == 0) {
+            occupied = !vec4f_equals(m.pixels[y * m.w + x], VOID);
+        } else {
+            vec2i size_down = pyramid->level_size[level - 1];
+            uint8 *cells_down = pyramid->levels[level - 1];
+            for(int32 bilinear_index = 0;
+                bilinear_index < 4;
+                ++bilinear_index) {
+                int32 x_down = x * 2 + (bilinear_index & 1);
+                int32 y_down = y * 2 + (bilinear_index >> 1);
+                if (x_down < size_down.x && y_down < size_down.y) {
+                    occupied |= cells_down[y_down * size_down.x + x_down];
+                }
+            }
+        }
+        cells[y * size.x + x] = occupied;
+    }
+}
+
+void map_free_pyramid(map *m) {
+    if (m == NULL) return;
+    if (m->pyramid) {
+        for(int32 level = 0; level < m->pyramid->level_number; ++level) {
+            free(m->pyramid->levels[level]);
+        }
+        free(m->pyramid);
+        m->pyramid = NULL;
+    }
+}
+
+// NOTE(gio): like the distance field, the mip chain describes the pixels at
+//              the moment it's built
+void map_build_mip(map *m, thread_pool *pool) {
+    if (m == NULL) return;
+    map_free_mip(m);
+
+    map_mip *mip = calloc(1, sizeof(map_mip));
+    vec2i size = { .x = m->w, .y = m->h };
+    mip->level_size[0] = size;
+    mip->level_number = 1;
+    while ((size.x > 1 || size.y > 1) &&
+           mip->level_number < MAP_MIP_MAX_LEVELS) {
+        size.x = (size.x + 1) / 2;
+        size.y = (size.y + 1) / 2;
+        int32 level = mip->level_number++;
+        mip->level_size[level] = size;
+        mip->levels[level] = calloc(size.x * size.y, sizeof(vec4f));
+    }
+    m->mip = mip;
+
+    // every level depends on the one below, rows of a level are independent
+    for(int32 level = 1; level < mip->level_number; ++level) {
+        map_mip_job job = {
+            .m = *m,
+            .level = level
+        };
+        thread_pool_run(pool, map_mip_row, &job, mip->level_size[level].y);
+    }
+
+    printf("map mip levels(%d)\n", mip->level_number);
+}
+
+void map_mip_row(void *data, int32 row) {
+    map_mip_job *job = (map_mip_job *) data;
+    map m = job->m;
+    map_mip *mip = m.mip;
+    int32 level = job->level;
+    vec2i size = mip->level_size[level];
+    vec2i size_down = mip->level_size[level - 1];
+    vec4f *texels = mip->levels[level];
+    vec4f *texels_down = mip->levels[level - 1]; // NULL on level 1
+
+    int32 y = row;
+    for(int32 x = 0; x < size.x; ++x) {
+        // weighted by the pixels each texel below covers inside the map,
+        // they differ only on the last row and column of odd sizes
+        vec4f sum = {};
+        float area = 0.f;
+        for(int32 bilinear_index = 0;
+            bilinear_index < 4;
+            ++bilinear_index) {
+            int32 x_down = x * 2 + (bilinear_index & 1);
+            int32 y_down = y * 2 + (bilinear_index >> 1);
+            if (x_down >= size_down.x || y_down >= size_down.y) continue;
+
+            if (level == 1) {
+                vec4f pixel = m.pixels[y_down * m.w + x_down];
+                float coverage = vec4f_equals(pixel, VOID) ? 0.f : 1.f;
+                sum.r += pixel.r * coverage;
+                sum.g += pixel.g * coverage;
+                sum.b += pixel.b * coverage;
+                sum.a += coverage;
+                area += 1.f;
+            } else {
+                int32 side = 1 << (level - 1);
+                float texel_area = (float)
+                    ((MIN((x_down + 1) * side, m.w) - x_down * side) *
+                     (MIN((y_down + 1) * side, m.h) - y_down * side));
+                vec4f texel = texels_down[y_down * size_down.x + x_down];
+                sum.r += texel.r * texel_area;
+                sum.g += texel.g * texel_area;
+                sum.b += texel.b * texel_area;
+                sum.a += texel.a * texel_area;
+                area += texel_area;
+            }
+        }
+        texels[y * size.x + x] = (vec4f) {
+            .r = sum.r / area,
+            .g = sum.g / area,
+            .b = sum.b / area,
+            .a = sum.a / area
+        };
+    }
+}
+
+void map_free_mip(map *m) {
+    if (m == NULL) return;
+    if (m->mip) {
+        for(int32 level = 1; level < m->mip->level_number; ++level) {
+            free(m->mip->levels[level]);
+        }
+        free(m->mip);
+        m->mip = NULL;
+    }
+}
+
+// NOTE(gio): box around the VOID pixel (x, y) where every pixel is VOID,
+//              from the distance field if there is one, otherwise from the
+//              biggest empty pyramid cell containing the pixel
+map_box map_empty_box(map *m, int32 x, int32 y) {
+    map_box box = { .x0 = x, .y0 = y, .x1 = x, .y1 = y };
+
+    if (m->distance) {
+        int32 radius = (int32) m->distance[y * m->w + x] - 1;
+        box.x0 = x - radius;
+        box.x1 = x + radius;
+        box.y0 = y - radius;
+        box.y1 = y + radius;
+    } else if (m->pyramid) {
+        map_pyramid *pyramid = m->pyramid;
+        int32 level = 1;
+        while (level < pyramid->level_number &&
+               !pyramid->levels[level][(y >> level) *
+                    pyramid->level_size[level].x + (x >> level)]) {
+            level++;
+        }
+        level--; // last empty level
+        box.x0 = (x >> level) << level;
+        box.y0 = (y >> level) << level;
+        box.x1 = box.x0 + (1 << level) - 1;
+        box.y1 = box.y0 + (1 << level) - 1;
+    }
+
+    return box;
+}
+
+// slot of the rgb of a color in palette_lookup
+uint32 map_palette_hash(vec4f color) {
+    uint32 bits[3];
+    memcpy(bits, color.e, sizeof(bits));
+    uint32 hash =
+        bits[0] * 0x9e3779b1 ^
+        bits[1] * 0x85ebca77 ^
+        bits[2] * 0xc2b2ae3d;
+    return (hash >> 16) & (MAP_PALETTE_LOOKUP_SIZE - 1);
+}
+
+// palette index with the rgb of color, 0 if there is none
+int32 map_palette_find(vec4f *palette, uint8 *palette_lookup, vec4f color) {
+    uint32 slot = map_palette_hash(color);
+    while (palette_lookup[slot] != 0) {
+        vec4f entry = palette[palette_lookup[slot]];
+        if (entry.r == color.r && entry.g == color.g && entry.b == color.b) {
+            return palette_lookup[slot];
+        }
+        slot = (slot + 1) & (MAP_PALETTE_LOOKUP_SIZE - 1);
+    }
+    return 0;
+}
+
+int32 map_is_void(map *m, int32 index) {
+    if (m->occupancy) {
+        return !((m->occupancy->bits[index >> 6] >> (index & 63)) & 1);
+    }
+    return vec4f_equals(m->pixels[index], VOID);
+}
+
+vec4f map_pixel(map *m, int32 index) {
+    if (m->occupancy) {
+        return m->occupancy->palette[m->occupancy->material[index]];
+    }
+    return m->pixels[index];
+}
+
+// MAP_RAY_LEGACY, MAP_RAY_DDA or MAP_RAY_PACKET (a single ray is traced as
+// DDA), the debug ray view is always legacy
+static int32 map_ray_traversal = MAP_RAY_TRAVERSAL;
+
+void map_set_ray_traversal(int32 traversal) {
+    map_ray_traversal = traversal;
+}
+
 vec4f map_ray_intersect(map m, vec2f origin, vec2f direction, float t0, float t1) {
+#if SHOW_RAYS_ON_MAP == 0
+    if (map_ray_traversal == MAP_RAY_DDA ||
+        map_ray_traversal == MAP_RAY_PACKET) {
+        return map_ray_intersect_dda(m, origin, direction, t0, t1);
+    }
+    if (m.distance || m.pyramid) {
+        return map_ray_intersect_skip(m, origin, direction, t0, t1);
+    }
+#endif
+    return map_ray_intersect_legacy(m, origin, direction, t0, t1);
+}
+
+vec4f map_ray_intersect_legacy(map m, vec2f origin, vec2f direction, float t0, float t1) {
     vec4f result = {};
     vec2i start = {
         .x = (int32) ((origin.x + direction.x * t0) + 0.5f),
@@ -120,11 +857,12 @@ vec4f map_ray_intersect(map m, vec2f origin, vec2f direction, float t0, float t1
 
                 int32 index = y * m.w + x;
 #if SHOW_RAYS_ON_MAP == 0
-                if (!vec4f_equals(m.pixels[index], VOID)) {
+                if (!map_is_void(&m, index)) {
+                    vec4f pixel = map_pixel(&m, index);
                     result = (vec4f) {
-                        .r = m.pixels[index].r,
-                        .g = m.pixels[index].g,
-                        .b = m.pixels[index].b,
+                        .r = pixel.r,
+                        .g = pixel.g,
+                        .b = pixel.b,
                         .a = 0.f // alpha 0 means it hit something
                     };
                     return result;
@@ -154,11 +892,12 @@ vec4f map_ray_intersect(map m, vec2f origin, vec2f direction, float t0, float t1
             int32 index = (int32) (y * m.w + start.x);
 
 #if SHOW_RAYS_ON_MAP != 1
-            if (!vec4f_equals(m.pixels[index], VOID)) {
+            if (!map_is_void(&m, index)) {
+                vec4f pixel = map_pixel(&m, index);
                 result = (vec4f) {
-                    .r = m.pixels[index].r,
-                    .g = m.pixels[index].g,
-                    .b = m.pixels[index].b,
+                    .r = pixel.r,
+                    .g = pixel.g,
+                    .b = pixel.b,
                     .a = 0.f // alpha 0 means it hit something
                 };
                 return result;
@@ -190,6 +929,1291 @@ vec4f map_ray_intersect(map m, vec2f origin, vec2f direction, float t0, float t1
     return result;
 }
 
+// NOTE(gio): visits the same pixels in the same order as
+//              map_ray_intersect_legacy, but every void pixel gives a box
+//              around it that is known to be empty (see map_empty_box), and
+//              the pixels inside it are skipped without reading them.
+//              The first hit is the same as the legacy one.
+vec4f map_ray_intersect_skip(map m, vec2f origin, vec2f direction, float t0, float t1) {
+    vec4f result = {};
+    vec2i start = {
+        .x = (int32) ((origin.x + direction.x * t0) + 0.5f),
+        .y = (int32) ((origin.y + direction.y * t0) + 0.5f)
+    };
+    vec2i end = {
+        .x = (int32) ((origin.x + direction.x * t1) + 0.5f),
+        .y = (int32) ((origin.y + direction.y * t1) + 0.5f)
+    };
+
+    // known empty box, starts empty
+    map_box box = { .x0 = 1, .y0 = 1, .x1 = 0, .y1 = 0 };
+
+    if (start.x != end.x) {
+        float slope = direction.y / direction.x;
+
+        int32 direction_x = DIRECTION(end.x - start.x);
+
+        int32 x = start.x;
+        while (x * direction_x < end.x * direction_x) {
+            // out of map columns are skipped by the legacy stepper too
+            if (!(0 <= x && x < m.w)) {
+                if ((direction_x > 0 && x >= m.w) ||
+                    (direction_x < 0 && x < 0)) break;
+                x = (direction_x > 0) ? 0 : m.w - 1;
+                continue;
+            }
+
+            // same math as the legacy stepper
+            int32 y1 = (int32) ((float) start.y +
+                    slope * ((float) x - (float) start.x));
+            int32 y2 = (int32) ((float) start.y +
+                    slope * ((float) x - (float) start.x + (float) direction_x));
+
+            if (box.x0 <= x && x <= box.x1 &&
+                box.y0 <= MIN(y1, y2) && MAX(y1, y2) <= box.y1) {
+                // NOTE(gio): y1 and y2 are monotone in x, so if the last
+                //              column is inside the box every column in
+                //              between is too
+                int32 skip = (direction_x > 0) ? box.x1 - x : x - box.x0;
+                skip = MIN(skip, (end.x - x) * direction_x - 1);
+                while (skip > 0) {
+                    int32 skip_x = x + skip * direction_x;
+                    int32 skip_y1 = (int32) ((float) start.y +
+                            slope * ((float) skip_x - (float) start.x));
+                    int32 skip_y2 = (int32) ((float) start.y +
+                            slope * ((float) skip_x - (float) start.x +
+                                (float) direction_x));
+                    if (box.y0 <= MIN(skip_y1, skip_y2) &&
+                        MAX(skip_y1, skip_y2) <= box.y1) break;
+                    skip /= 2;
+                }
+                x += (skip + 1) * direction_x;
+                continue;
+            }
+
+            int32 direction_y = DIRECTION(y2 - y1);
+            int32 y = y1;
+            while (y * direction_y <= y2 * direction_y) {
+                if (!(0 <= y && y < m.h)) { // out of map
+                    if ((direction_y > 0 && y >= m.h) ||
+                        (direction_y < 0 && y < 0)) break;
+                    y = (direction_y > 0) ? 0 : m.h - 1;
+                    continue;
+                }
+
+                if (box.x0 <= x && x <= box.x1 &&
+                    box.y0 <= y && y <= box.y1) {
+                    y = (direction_y > 0) ? box.y1 + 1 : box.y0 - 1;
+                    continue;
+                }
+
+                int32 index = y * m.w + x;
+                if (!map_is_void(&m, index)) {
+                    vec4f pixel = map_pixel(&m, index);
+                    result = (vec4f) {
+                        .r = pixel.r,
+                        .g = pixel.g,
+                        .b = pixel.b,
+                        .a = 0.f // alpha 0 means it hit something
+                    };
+                    return result;
+                }
+
+                box = map_empty_box(&m, x, y);
+
+                y += direction_y;
+            }
+
+            x += direction_x;
+        }
+    } else {
+        // NOTE(gio): the legacy stepper does not check x here, keep its
+        //              exact behaviour when the column is out of the map
+        if (!(0 <= start.x && start.x < m.w)) {
+            return map_ray_intersect_legacy(m, origin, direction, t0, t1);
+        }
+
+        int32 x = start.x;
+        int32 direction_y = DIRECTION(end.y - start.y);
+        int32 y = start.y;
+        while (y * direction_y <= end.y * direction_y) {
+            if (!(0 <= y && y < m.h)) { // out of map
+                if ((direction_y > 0 && y >= m.h) ||
+                    (direction_y < 0 && y < 0)) break;
+                y = (direction_y > 0) ? 0 : m.h - 1;
+                continue;
+            }
+
+            int32 index = y * m.w + x;
+            if (!map_is_void(&m, index)) {
+                vec4f pixel = map_pixel(&m, index);
+                result = (vec4f) {
+                    .r = pixel.r,
+                    .g = pixel.g,
+                    .b = pixel.b,
+                    .a = 0.f // alpha 0 means it hit something
+                };
+                return result;
+            }
+
+            // the column is fixed, only the vertical extent matters
+            map_box box = map_empty_box(&m, x, y);
+            y = (direction_y > 0) ? box.y1 + 1 : box.y0 - 1;
+        }
+    }
+
+    // alpha 1 means it hit nothing
+    result = (vec4f) {
+        .r = 0.f,
+        .g = 0.f,
+        .b = 0.f,
+        .a = 1.f
+    };
+    return result;
+}
+
+// NOTE(gio): Amanatides-Woo traversal. The segment is clipped to the map
+//              rectangle first, then every pixel it crosses is visited once
+//              and in order, unlike the legacy stepper where consecutive
+//              columns share their end pixels. Pixel x covers
+//              [x - 0.5, x + 0.5), as with the legacy rounding.
+//              With a distance field or a pyramid the walk jumps to the
+//              first pixel out of the empty box around each VOID pixel.
+vec4f map_ray_intersect_dda(map m, vec2f origin, vec2f direction, float t0, float t1) {
+    vec4f miss = {
+        .r = 0.f,
+        .g = 0.f,
+        .b = 0.f,
+        .a = 1.f // alpha 1 means it hit nothing
+    };
+
+    // pixel x covers [x, x + 1) from here on
+    vec2f o = { .x = origin.x + 0.5f, .y = origin.y + 0.5f };
+
+    // clip [t0, t1] to the map (Liang-Barsky)
+    float t_enter = t0;
+    float t_exit = t1;
+    if (direction.x != 0.f) {
+        float ta = (0.f - o.x) / direction.x;
+        float tb = ((float) m.w - o.x) / direction.x;
+        t_enter = MAX(t_enter, MIN(ta, tb));
+        t_exit = MIN(t_exit, MAX(ta, tb));
+    } else if (!(0.f <= o.x && o.x < (float) m.w)) {
+        return miss;
+    }
+    if (direction.y != 0.f) {
+        float ta = (0.f - o.y) / direction.y;
+        float tb = ((float) m.h - o.y) / direction.y;
+        t_enter = MAX(t_enter, MIN(ta, tb));
+        t_exit = MIN(t_exit, MAX(ta, tb));
+    } else if (!(0.f <= o.y && o.y < (float) m.h)) {
+        return miss;
+    }
+    if (t_enter >= t_exit) return miss;
+
+    int32 x = CLAMP((int32) floorf(o.x + direction.x * t_enter), 0, m.w - 1);
+    int32 y = CLAMP((int32) floorf(o.y + direction.y * t_enter), 0, m.h - 1);
+
+    int32 step_x = (direction.x > 0.f) ? 1 : -1;
+    int32 step_y = (direction.y > 0.f) ? 1 : -1;
+
+    // ray parameter of the next vertical and horizontal pixel border
+    float t_delta_x = INFINITY;
+    float t_delta_y = INFINITY;
+    float t_max_x = INFINITY;
+    float t_max_y = INFINITY;
+    if (direction.x != 0.f) {
+        t_delta_x = fabsf(1.f / direction.x);
+        t_max_x = ((float) (x + (step_x > 0)) - o.x) / direction.x;
+    }
+    if (direction.y != 0.f) {
+        t_delta_y = fabsf(1.f / direction.y);
+        t_max_y = ((float) (y + (step_y > 0)) - o.y) / direction.y;
+    }
+
+    int32 has_boxes = m.distance != NULL || m.pyramid != NULL;
+
+    for(;;) {
+        int32 index = y * m.w + x;
+        if (!map_is_void(&m, index)) {
+            vec4f pixel = map_pixel(&m, index);
+            return (vec4f) {
+                .r = pixel.r,
+                .g = pixel.g,
+                .b = pixel.b,
+                .a = 0.f // alpha 0 means it hit something
+            };
+        }
+
+        map_box box = { .x0 = x, .y0 = y, .x1 = x, .y1 = y };
+        if (has_boxes) box = map_empty_box(&m, x, y);
+
+        if (box.x0 < box.x1) {
+            // leave the box from the first of its borders the ray crosses
+            float box_t_x = INFINITY;
+            float box_t_y = INFINITY;
+            if (direction.x != 0.f) {
+                float border = (float) ((step_x > 0) ? box.x1 + 1 : box.x0);
+                box_t_x = (border - o.x) / direction.x;
+            }
+            if (direction.y != 0.f) {
+                float border = (float) ((step_y > 0) ? box.y1 + 1 : box.y0);
+                box_t_y = (border - o.y) / direction.y;
+            }
+            float box_t = MIN(box_t_x, box_t_y);
+            if (box_t >= t_exit) break;
+
+            if (box_t_x <= box_t_y) {
+                x = (step_x > 0) ? box.x1 + 1 : box.x0 - 1;
+            } else {
+                x = CLAMP((int32) floorf(o.x + direction.x * box_t),
+                        box.x0, box.x1);
+            }
+            if (box_t_y <= box_t_x) {
+                y = (step_y > 0) ? box.y1 + 1 : box.y0 - 1;
+            } else {
+                y = CLAMP((int32) floorf(o.y + direction.y * box_t),
+                        box.y0, box.y1);
+            }
+            if (direction.x != 0.f) {
+                t_max_x = ((float) (x + (step_x > 0)) - o.x) / direction.x;
+            }
+            if (direction.y != 0.f) {
+                t_max_y = ((float) (y + (step_y > 0)) - o.y) / direction.y;
+            }
+        } else if (t_max_x < t_max_y) {
+            if (t_max_x >= t_exit) break;
+            x += step_x;
+            t_max_x += t_delta_x;
+        } else {
+            if (t_max_y >= t_exit) break;
+            y += step_y;
+            t_max_y += t_delta_y;
+        }
+
+        // only rounding can bring the walk out of the clipped segment
+        if (!(0 <= x && x < m.w && 0 <= y && y < m.h)) break;
+    }
+
+    return miss;
+}
+
+// NOTE(gio): traces the texels of a mip level with the clipped DDA walk.
+//              Texels are partially covered, so instead of stopping at the
+//              first hit the ray composites them front to back, like
+//              cascade_merge_intervals does for intervals: the alpha of the
+//              result is the fraction of light that gets through.
+vec4f map_ray_intersect_mip(map m, int32 level, vec2f origin, vec2f direction, float t0, float t1) {
+    map_mip *mip = m.mip;
+    vec2i size = mip->level_size[level];
+    vec4f *texels = mip->levels[level];
+    float scale = 1.f / (float) (1 << level);
+
+    vec4f result = { .r = 0.f, .g = 0.f, .b = 0.f, .a = 1.f };
+
+    // texel x covers [x, x + 1) from here on, the ray parameter is unchanged
+    vec2f o = {
+        .x = (origin.x + 0.5f) * scale,
+        .y = (origin.y + 0.5f) * scale
+    };
+    vec2f d = { .x = direction.x * scale, .y = direction.y * scale };
+
+    // clip [t0, t1] to the level (Liang-Barsky)
+    float t_enter = t0;
+    float t_exit = t1;
+    if (d.x != 0.f) {
+        float ta = (0.f - o.x) / d.x;
+        float tb = ((float) size.x - o.x) / d.x;
+        t_enter = MAX(t_enter, MIN(ta, tb));
+        t_exit = MIN(t_exit, MAX(ta, tb));
+    } else if (!(0.f <= o.x && o.x < (float) size.x)) {
+        return result;
+    }
+    if (d.y != 0.f) {
+        float ta = (0.f - o.y) / d.y;
+        float tb = ((float) size.y - o.y) / d.y;
+        t_enter = MAX(t_enter, MIN(ta, tb));
+        t_exit = MIN(t_exit, MAX(ta, tb));
+    } else if (!(0.f <= o.y && o.y < (float) size.y)) {
+        return result;
+    }
+    if (t_enter >= t_exit) return result;
+
+    int32 x = CLAMP((int32) floorf(o.x + d.x * t_enter), 0, size.x - 1);
+    int32 y = CLAMP((int32) floorf(o.y + d.y * t_enter), 0, size.y - 1);
+
+    int32 step_x = (d.x > 0.f) ? 1 : -1;
+    int32 step_y = (d.y > 0.f) ? 1 : -1;
+
+    float t_delta_x = INFINITY;
+    float t_delta_y = INFINITY;
+    float t_max_x = INFINITY;
+    float t_max_y = INFINITY;
+    if (d.x != 0.f) {
+        t_delta_x = fabsf(1.f / d.x);
+        t_max_x = ((float) (x + (step_x > 0)) - o.x) / d.x;
+    }
+    if (d.y != 0.f) {
+        t_delta_y = fabsf(1.f / d.y);
+        t_max_y = ((float) (y + (step_y > 0)) - o.y) / d.y;
+    }
+
+    for(;;) {
+        vec4f texel = texels[y * size.x + x];
+        if (texel.a > 0.f) {
+            result.r += result.a * texel.r;
+            result.g += result.a * texel.g;
+            result.b += result.a * texel.b;
+            result.a *= 1.f - texel.a;
+            if (result.a < MAP_MIP_TRANSPARENCY_MIN) {
+                result.a = 0.f;
+                break;
+            }
+        }
+
+        if (t_max_x < t_max_y) {
+            if (t_max_x >= t_exit) break;
+            x += step_x;
+            t_max_x += t_delta_x;
+        } else {
+            if (t_max_y >= t_exit) break;
+            y += step_y;
+            t_max_y += t_delta_y;
+        }
+
+        if (!(0 <= x && x < size.x && 0 <= y && y < size.y)) break;
+    }
+
+    return result;
+}
+
+// NOTE(gio): one template for each of the `angular_number` directions used
+//              by the cascades, all the column offsets in one allocation
+map_ray_template *map_ray_templates_create(int32 angular_number, vec2f interval) {
+    map_ray_template *templates =
+        calloc(angular_number, sizeof(map_ray_template));
+
+    int32 total_column_number = 0;
+    for(int32 direction_index = 0;
+        direction_index < angular_number;
+        ++direction_index) {
+        map_ray_template *ray = &templates[direction_index];
+
+        // same as the cascades direction
+        float direction_angle =
+            2.f * PI *
+            (((float) direction_index + 0.5f) /
+             (float) angular_number);
+        ray->direction = vec2f_from_angle(direction_angle);
+        ray->slope = ray->direction.y / ray->direction.x;
+        ray->direction_x = DIRECTION(ray->direction.x);
+        ray->interval = interval;
+        // both ends are rounded, so there can be one more column
+        ray->column_number = (int32) ceilf(
+                fabsf(ray->direction.x) * (interval.y - interval.x)) + 2;
+        total_column_number += ray->column_number;
+    }
+
+    float *column_offset = calloc(total_column_number, sizeof(float));
+    for(int32 direction_index = 0;
+        direction_index < angular_number;
+        ++direction_index) {
+        map_ray_template *ray = &templates[direction_index];
+        ray->column_offset = column_offset;
+        for(int32 k = 0; k < ray->column_number; ++k) {
+            ray->column_offset[k] =
+                ray->slope * (float) (k * ray->direction_x);
+        }
+        column_offset += ray->column_number;
+    }
+
+    return templates;
+}
+
+void map_ray_templates_free(map_ray_template *templates) {
+    if (templates == NULL) return;
+    free(templates[0].column_offset);
+    free(templates);
+}
+
+// NOTE(gio): same walk (and same first hit) as map_ray_intersect_skip, but the
+//              direction, slope and column offsets come from the template
+vec4f map_ray_intersect_template(map m, vec2f origin, map_ray_template *ray) {
+    vec2f direction = ray->direction;
+    float t0 = ray->interval.x;
+    float t1 = ray->interval.y;
+
+#if SHOW_RAYS_ON_MAP == 0
+    if (map_ray_traversal == MAP_RAY_DDA ||
+        map_ray_traversal == MAP_RAY_PACKET) {
+        return map_ray_intersect_dda(m, origin, direction, t0, t1);
+    }
+#endif
+
+    vec2i start = {
+        .x = (int32) ((origin.x + direction.x * t0) + 0.5f),
+        .y = (int32) ((origin.y + direction.y * t0) + 0.5f)
+    };
+    vec2i end = {
+        .x = (int32) ((origin.x + direction.x * t1) + 0.5f),
+        .y = (int32) ((origin.y + direction.y * t1) + 0.5f)
+    };
+
+    int32 column_end = (end.x - start.x) * ray->direction_x;
+
+#if SHOW_RAYS_ON_MAP == 0
+    if (start.x != end.x &&
+        0 < column_end && column_end < ray->column_number) {
+#else
+    if (0) {
+#endif
+        int32 direction_x = ray->direction_x;
+        float start_y = (float) start.y;
+        float *column_offset = ray->column_offset;
+        // without a distance field or a pyramid every box is a single pixel
+        int32 has_boxes = m.distance != NULL || m.pyramid != NULL;
+
+        // known empty box, starts empty
+        map_box box = { .x0 = 1, .y0 = 1, .x1 = 0, .y1 = 0 };
+
+        int32 k = 0;
+        if (!(0 <= start.x && start.x < m.w)) {
+            // out of map columns are skipped by the legacy stepper too
+            if ((direction_x > 0 && start.x >= m.w) ||
+                (direction_x < 0 && start.x < 0)) {
+                k = column_end;
+            } else {
+                k = ((direction_x > 0) ? 0 : m.w - 1) - start.x;
+                k *= direction_x;
+            }
+        }
+
+        int32 y1 = (int32) (start_y + column_offset[MIN(k, column_end)]);
+        while (k < column_end) {
+            int32 x = start.x + k * direction_x;
+            if (!(0 <= x && x < m.w)) break; // left the map for good
+
+            int32 y2 = (int32) (start_y + column_offset[k + 1]);
+
+            if (box.x0 <= x && x <= box.x1 &&
+                box.y0 <= MIN(y1, y2) && MAX(y1, y2) <= box.y1) {
+                // monotone columns, see map_ray_intersect_skip
+                int32 skip = (direction_x > 0) ? box.x1 - x : x - box.x0;
+                skip = MIN(skip, column_end - k - 1);
+                while (skip > 0) {
+                    int32 skip_y1 =
+                        (int32) (start_y + column_offset[k + skip]);
+                    int32 skip_y2 =
+                        (int32) (start_y + column_offset[k + skip + 1]);
+                    if (box.y0 <= MIN(skip_y1, skip_y2) &&
+                        MAX(skip_y1, skip_y2) <= box.y1) break;
+                    skip /= 2;
+                }
+                k += skip + 1;
+                if (k < column_end) {
+                    y1 = (int32) (start_y + column_offset[k]);
+                }
+                continue;
+            }
+
+            int32 direction_y = DIRECTION(y2 - y1);
+            int32 y = y1;
+            while (y * direction_y <= y2 * direction_y) {
+                if (!(0 <= y && y < m.h)) { // out of map
+                    if ((direction_y > 0 && y >= m.h) ||
+                        (direction_y < 0 && y < 0)) break;
+                    y = (direction_y > 0) ? 0 : m.h - 1;
+                    continue;
+                }
+
+                if (box.x0 <= x && x <= box.x1 &&
+                    box.y0 <= y && y <= box.y1) {
+                    y = (direction_y > 0) ? box.y1 + 1 : box.y0 - 1;
+                    continue;
+                }
+
+                int32 index = y * m.w + x;
+                if (!map_is_void(&m, index)) {
+                    vec4f pixel = map_pixel(&m, index);
+                    return (vec4f) {
+                        .r = pixel.r,
+                        .g = pixel.g,
+                        .b = pixel.b,
+                        .a = 0.f // alpha 0 means it hit something
+                    };
+                }
+
+                if (has_boxes) box = map_empty_box(&m, x, y);
+
+                y += direction_y;
+            }
+
+            y1 = y2;
+            ++k;
+        }
+
+        // alpha 1 means it hit nothing
+        return (vec4f) {
+            .r = 0.f,
+            .g = 0.f,
+            .b = 0.f,
+            .a = 1.f
+        };
+    }
+
+    // vertical rays (and the debug view) use the generic path
+    return map_ray_intersect(m, origin, direction, t0, t1);
+}
+
+// the rays of `ray_number` templates from the same origin, 16, 8 or 4 at a
+// time with MAP_RAY_PACKET when it can, the rest one at a time
+void map_rays_intersect_templates(map m, vec2f origin, map_ray_template *rays, int32 ray_number, vec4f *results) {
+    int32 ray_index = 0;
+#if MAP_RAY_PACKET_SIMD
+    // NOTE(gio): the empty boxes of the pyramid are not vectorized, with
+    //              both the distance field is the one used anyway
+    if (map_ray_traversal == MAP_RAY_PACKET &&
+        m.occupancy != NULL &&
+        (m.distance != NULL || m.pyramid == NULL) &&
+        cpu_isa() >= CPU_ISA_SSE41) {
+        if (cpu_isa() >= CPU_ISA_AVX512) {
+            for(; ray_index + 16 <= ray_number; ray_index += 16) {
+                map_ray_intersect_packet16(
+                        m, origin, &rays[ray_index], &results[ray_index]);
+            }
+        }
+        if (cpu_isa() >= CPU_ISA_AVX2) {
+            for(; ray_index + 8 <= ray_number; ray_index += 8) {
+                map_ray_intersect_packet(
+                        m, origin, &rays[ray_index], &results[ray_index]);
+            }
+        }
+        for(; ray_index + 4 <= ray_number; ray_index += 4) {
+            map_ray_intersect_packet4(
+                    m, origin, &rays[ray_index], &results[ray_index]);
+        }
+    }
+#endif
+    for(; ray_index < ray_number; ++ray_index) {
+        results[ray_index] =
+            map_ray_intersect_template(m, origin, &rays[ray_index]);
+    }
+}
+
+#if MAP_RAY_PACKET_SIMD
+// NOTE(gio): map_ray_intersect_dda for 8 rays of the same origin, one in
+//              each lane, every lane taking its next step at the same
+//              time: VOID is read from the occupancy bits and the empty
+//              boxes from the distance field with gathers, and a lane is
+//              masked off when its ray hits or leaves its segment. Same
+//              float operations in the same order as the scalar walk, so
+//              the same pixels and the same hits. The packet takes as long
+//              as its longest ray, which is fine for the short intervals
+//              of the lower cascades and less so as they grow.
+CPU_TARGET_AVX2 void map_ray_intersect_packet(map m, vec2f origin, map_ray_template *rays, vec4f *results) {
+    __m256 zero_ps = _mm256_setzero_ps();
+    __m256 infinity = _mm256_set1_ps(INFINITY);
+    __m256i zero = _mm256_setzero_si256();
+    __m256i one = _mm256_set1_epi32(1);
+    __m256i width = _mm256_set1_epi32(m.w);
+    __m256i height = _mm256_set1_epi32(m.h);
+
+    __m256 direction_x = _mm256_setr_ps(
+            rays[0].direction.x, rays[1].direction.x,
+            rays[2].direction.x, rays[3].direction.x,
+            rays[4].direction.x, rays[5].direction.x,
+            rays[6].direction.x, rays[7].direction.x);
+    __m256 direction_y = _mm256_setr_ps(
+            rays[0].direction.y, rays[1].direction.y,
+            rays[2].direction.y, rays[3].direction.y,
+            rays[4].direction.y, rays[5].direction.y,
+            rays[6].direction.y, rays[7].direction.y);
+    __m256 t_enter = _mm256_setr_ps(
+            rays[0].interval.x, rays[1].interval.x,
+            rays[2].interval.x, rays[3].interval.x,
+            rays[4].interval.x, rays[5].interval.x,
+            rays[6].interval.x, rays[7].interval.x);
+    __m256 t_exit = _mm256_setr_ps(
+            rays[0].interval.y, rays[1].interval.y,
+            rays[2].interval.y, rays[3].interval.y,
+            rays[4].interval.y, rays[5].interval.y,
+            rays[6].interval.y, rays[7].interval.y);
+
+    // pixel x covers [x, x + 1) from here on
+    __m256 o_x = _mm256_set1_ps(origin.x + 0.5f);
+    __m256 o_y = _mm256_set1_ps(origin.y + 0.5f);
+
+    // the axes a ray moves along, the others keep their INFINITY
+    __m256 moves_x = _mm256_cmp_ps(direction_x, zero_ps, _CMP_NEQ_OQ);
+    __m256 moves_y = _mm256_cmp_ps(direction_y, zero_ps, _CMP_NEQ_OQ);
+
+    // ### clip [t0, t1] to the map (Liang-Barsky), as map_ray_intersect_dda
+    __m256i active = _mm256_set1_epi32(-1);
+    {
+        __m256 ta = _mm256_div_ps(_mm256_sub_ps(zero_ps, o_x), direction_x);
+        __m256 tb = _mm256_div_ps(
+                _mm256_sub_ps(_mm256_set1_ps((float) m.w), o_x), direction_x);
+        t_enter = _mm256_blendv_ps(t_enter,
+                _mm256_max_ps(t_enter, _mm256_min_ps(ta, tb)), moves_x);
+        t_exit = _mm256_blendv_ps(t_exit,
+                _mm256_min_ps(t_exit, _mm256_max_ps(ta, tb)), moves_x);
+        // a ray that doesn't move along x needs the origin in the map
+        int32 inside_x = 0.f <= origin.x + 0.5f && origin.x + 0.5f < (float) m.w;
+        if (!inside_x) {
+            active = _mm256_and_si256(active, _mm256_castps_si256(moves_x));
+        }
+
+        ta = _mm256_div_ps(_mm256_sub_ps(zero_ps, o_y), direction_y);
+        tb = _mm256_div_ps(
+                _mm256_sub_ps(_mm256_set1_ps((float) m.h), o_y), direction_y);
+        t_enter = _mm256_blendv_ps(t_enter,
+                _mm256_max_ps(t_enter, _mm256_min_ps(ta, tb)), moves_y);
+        t_exit = _mm256_blendv_ps(t_exit,
+                _mm256_min_ps(t_exit, _mm256_max_ps(ta, tb)), moves_y);
+        int32 inside_y = 0.f <= origin.y + 0.5f && origin.y + 0.5f < (float) m.h;
+        if (!inside_y) {
+            active = _mm256_and_si256(active, _mm256_castps_si256(moves_y));
+        }
+
+        active = _mm256_andnot_si256(_mm256_castps_si256(
+                    _mm256_cmp_ps(t_enter, t_exit, _CMP_GE_OQ)), active);
+    }
+
+    __m256i x = _mm256_min_epi32(_mm256_max_epi32(
+                _mm256_cvttps_epi32(_mm256_floor_ps(_mm256_add_ps(
+                            o_x, _mm256_mul_ps(direction_x, t_enter)))),
+                zero), _mm256_sub_epi32(width, one));
+    __m256i y = _mm256_min_epi32(_mm256_max_epi32(
+                _mm256_cvttps_epi32(_mm256_floor_ps(_mm256_add_ps(
+                            o_y, _mm256_mul_ps(direction_y, t_enter)))),
+                zero), _mm256_sub_epi32(height, one));
+
+    // -1 where the step is 1, 0 where it is -1
+    __m256i forward_x = _mm256_castps_si256(
+            _mm256_cmp_ps(direction_x, zero_ps, _CMP_GT_OQ));
+    __m256i forward_y = _mm256_castps_si256(
+            _mm256_cmp_ps(direction_y, zero_ps, _CMP_GT_OQ));
+    __m256i step_x = _mm256_blendv_epi8(_mm256_set1_epi32(-1), one, forward_x);
+    __m256i step_y = _mm256_blendv_epi8(_mm256_set1_epi32(-1), one, forward_y);
+
+    // ray parameter of the next vertical and horizontal pixel border
+    __m256 sign = _mm256_set1_ps(-0.f);
+    __m256 t_delta_x = _mm256_blendv_ps(infinity, _mm256_andnot_ps(sign,
+                _mm256_div_ps(_mm256_set1_ps(1.f), direction_x)), moves_x);
+    __m256 t_delta_y = _mm256_blendv_ps(infinity, _mm256_andnot_ps(sign,
+                _mm256_div_ps(_mm256_set1_ps(1.f), direction_y)), moves_y);
+    __m256 t_max_x = _mm256_blendv_ps(infinity, _mm256_div_ps(
+                _mm256_sub_ps(_mm256_cvtepi32_ps(
+                        _mm256_sub_epi32(x, forward_x)), o_x),
+                direction_x), moves_x);
+    __m256 t_max_y = _mm256_blendv_ps(infinity, _mm256_div_ps(
+                _mm256_sub_ps(_mm256_cvtepi32_ps(
+                        _mm256_sub_epi32(y, forward_y)), o_y),
+                direction_y), moves_y);
+
+    __m256i hit = _mm256_setzero_si256();
+
+    const int *bits = (const int *) m.occupancy->bits;
+    const int *distance = (const int *) m.distance;
+
+    while (!_mm256_testz_si256(active, active)) {
+        // a bit for each pixel, 32 in each gathered word
+        __m256i index = _mm256_add_epi32(_mm256_mullo_epi32(y, width), x);
+        __m256i word = _mm256_mask_i32gather_epi32(
+                zero, bits, _mm256_srli_epi32(index, 5), active, 4);
+        __m256i bit = _mm256_and_si256(
+                _mm256_srlv_epi32(word, _mm256_and_si256(index, _mm256_set1_epi32(31))),
+                one);
+        __m256i new_hit = _mm256_and_si256(active, _mm256_cmpeq_epi32(bit, one));
+        hit = _mm256_or_si256(hit, new_hit);
+        active = _mm256_andnot_si256(new_hit, active);
+
+        // box of half side radius around the pixel, see map_empty_box
+        __m256i radius = zero;
+        if (distance) {
+            // NOTE(gio): 32 bits read at each uint16, the distance field
+            //              has one more to keep the last one in bounds
+            __m256i pixel_distance = _mm256_mask_i32gather_epi32(
+                    zero, distance, index, active, 2);
+            radius = _mm256_sub_epi32(
+                    _mm256_and_si256(pixel_distance, _mm256_set1_epi32(0xffff)),
+                    one);
+        }
+        __m256i boxed = _mm256_and_si256(active, _mm256_cmpgt_epi32(radius, zero));
+        __m256i stepped = _mm256_andnot_si256(boxed, active);
+
+        // ### leave the box from the first of its borders the ray crosses
+        __m256i box_x0 = _mm256_sub_epi32(x, radius);
+        __m256i box_x1 = _mm256_add_epi32(x, radius);
+        __m256i box_y0 = _mm256_sub_epi32(y, radius);
+        __m256i box_y1 = _mm256_add_epi32(y, radius);
+        __m256 box_t_x = _mm256_blendv_ps(infinity, _mm256_div_ps(
+                    _mm256_sub_ps(_mm256_cvtepi32_ps(_mm256_blendv_epi8(
+                                box_x0, _mm256_add_epi32(box_x1, one), forward_x)),
+                        o_x),
+                    direction_x), moves_x);
+        __m256 box_t_y = _mm256_blendv_ps(infinity, _mm256_div_ps(
+                    _mm256_sub_ps(_mm256_cvtepi32_ps(_mm256_blendv_epi8(
+                                box_y0, _mm256_add_epi32(box_y1, one), forward_y)),
+                        o_y),
+                    direction_y), moves_y);
+        __m256 box_t = _mm256_min_ps(box_t_x, box_t_y);
+        __m256i box_out = _mm256_and_si256(boxed, _mm256_castps_si256(
+                    _mm256_cmp_ps(box_t, t_exit, _CMP_GE_OQ)));
+        boxed = _mm256_andnot_si256(box_out, boxed);
+
+        __m256i box_next_x = _mm256_blendv_epi8(
+                _mm256_sub_epi32(box_x0, one),
+                _mm256_add_epi32(box_x1, one),
+                forward_x);
+        __m256i box_inside_x = _mm256_min_epi32(_mm256_max_epi32(
+                    _mm256_cvttps_epi32(_mm256_floor_ps(_mm256_add_ps(
+                                o_x, _mm256_mul_ps(direction_x, box_t)))),
+                    box_x0), box_x1);
+        __m256i box_new_x = _mm256_blendv_epi8(box_inside_x, box_next_x,
+                _mm256_castps_si256(_mm256_cmp_ps(box_t_x, box_t_y, _CMP_LE_OQ)));
+        __m256i box_next_y = _mm256_blendv_epi8(
+                _mm256_sub_epi32(box_y0, one),
+                _mm256_add_epi32(box_y1, one),
+                forward_y);
+        __m256i box_inside_y = _mm256_min_epi32(_mm256_max_epi32(
+                    _mm256_cvttps_epi32(_mm256_floor_ps(_mm256_add_ps(
+                                o_y, _mm256_mul_ps(direction_y, box_t)))),
+                    box_y0), box_y1);
+        __m256i box_new_y = _mm256_blendv_epi8(box_inside_y, box_next_y,
+                _mm256_castps_si256(_mm256_cmp_ps(box_t_y, box_t_x, _CMP_LE_OQ)));
+        __m256 box_t_max_x = _mm256_blendv_ps(t_max_x, _mm256_div_ps(
+                    _mm256_sub_ps(_mm256_cvtepi32_ps(_mm256_sub_epi32(
+                                box_new_x, forward_x)), o_x),
+                    direction_x), moves_x);
+        __m256 box_t_max_y = _mm256_blendv_ps(t_max_y, _mm256_div_ps(
+                    _mm256_sub_ps(_mm256_cvtepi32_ps(_mm256_sub_epi32(
+                                box_new_y, forward_y)), o_y),
+                    direction_y), moves_y);
+
+        // ### or one pixel along the axis of the nearest border
+        __m256i along_x = _mm256_and_si256(stepped, _mm256_castps_si256(
+                    _mm256_cmp_ps(t_max_x, t_max_y, _CMP_LT_OQ)));
+        __m256i along_y = _mm256_andnot_si256(along_x, stepped);
+        __m256i step_out = _mm256_or_si256(
+                _mm256_and_si256(along_x, _mm256_castps_si256(
+                        _mm256_cmp_ps(t_max_x, t_exit, _CMP_GE_OQ))),
+                _mm256_and_si256(along_y, _mm256_castps_si256(
+                        _mm256_cmp_ps(t_max_y, t_exit, _CMP_GE_OQ))));
+        along_x = _mm256_andnot_si256(step_out, along_x);
+        along_y = _mm256_andnot_si256(step_out, along_y);
+
+        x = _mm256_blendv_epi8(x, box_new_x, boxed);
+        y = _mm256_blendv_epi8(y, box_new_y, boxed);
+        t_max_x = _mm256_blendv_ps(t_max_x, box_t_max_x, _mm256_castsi256_ps(boxed));
+        t_max_y = _mm256_blendv_ps(t_max_y, box_t_max_y, _mm256_castsi256_ps(boxed));
+        x = _mm256_add_epi32(x, _mm256_and_si256(along_x, step_x));
+        y = _mm256_add_epi32(y, _mm256_and_si256(along_y, step_y));
+        t_max_x = _mm256_add_ps(t_max_x, _mm256_and_ps(
+                    _mm256_castsi256_ps(along_x), t_delta_x));
+        t_max_y = _mm256_add_ps(t_max_y, _mm256_and_ps(
+                    _mm256_castsi256_ps(along_y), t_delta_y));
+
+        // only rounding can bring the walk out of the clipped segment
+        __m256i inside = _mm256_and_si256(
+                _mm256_and_si256(
+                    _mm256_cmpgt_epi32(x, _mm256_set1_epi32(-1)),
+                    _mm256_cmpgt_epi32(width, x)),
+                _mm256_and_si256(
+                    _mm256_cmpgt_epi32(y, _mm256_set1_epi32(-1)),
+                    _mm256_cmpgt_epi32(height, y)));
+        active = _mm256_and_si256(
+                _mm256_andnot_si256(_mm256_or_si256(box_out, step_out), active),
+                inside);
+    }
+
+    int32 lane_hit[8];
+    int32 lane_x[8];
+    int32 lane_y[8];
+    _mm256_storeu_si256((__m256i *) lane_hit, hit);
+    _mm256_storeu_si256((__m256i *) lane_x, x);
+    _mm256_storeu_si256((__m256i *) lane_y, y);
+    for(int32 lane = 0; lane < 8; ++lane) {
+        if (!lane_hit[lane]) {
+            // alpha 1 means it hit nothing
+            results[lane] = (vec4f) { .r = 0.f, .g = 0.f, .b = 0.f, .a = 1.f };
+            continue;
+        }
+        vec4f pixel = map_pixel(&m, lane_y[lane] * m.w + lane_x[lane]);
+        results[lane] = (vec4f) {
+            .r = pixel.r,
+            .g = pixel.g,
+            .b = pixel.b,
+            .a = 0.f // alpha 0 means it hit something
+        };
+    }
+}
+
+// NOTE(gio): map_ray_intersect_packet with 16 lanes, the finished lanes
+//              are in AVX-512 masks instead of vectors. The AVX-512 target
+//              has FMA, and gcc would fuse the products and sums of the
+//              positions into it (rounding once instead of twice), so it is
+//              built without contraction to give the same pixels
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC push_options
+#pragma GCC optimize("fp-contract=off")
+#endif
+CPU_TARGET_AVX512 void map_ray_intersect_packet16(map m, vec2f origin, map_ray_template *rays, vec4f *results) {
+    __m512 zero_ps = _mm512_setzero_ps();
+    __m512 infinity = _mm512_set1_ps(INFINITY);
+    __m512i zero = _mm512_setzero_si512();
+    __m512i one = _mm512_set1_epi32(1);
+    __m512i width = _mm512_set1_epi32(m.w);
+    __m512i height = _mm512_set1_epi32(m.h);
+
+    // the fields of the 16 templates
+    __m512i offsets = _mm512_mullo_epi32(
+            _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7,
+                8, 9, 10, 11, 12, 13, 14, 15),
+            _mm512_set1_epi32((int32) sizeof(map_ray_template)));
+    __m512 direction_x = _mm512_i32gather_ps(offsets, &rays->direction.x, 1);
+    __m512 direction_y = _mm512_i32gather_ps(offsets, &rays->direction.y, 1);
+    __m512 t_enter = _mm512_i32gather_ps(offsets, &rays->interval.x, 1);
+    __m512 t_exit = _mm512_i32gather_ps(offsets, &rays->interval.y, 1);
+
+    // pixel x covers [x, x + 1) from here on
+    __m512 o_x = _mm512_set1_ps(origin.x + 0.5f);
+    __m512 o_y = _mm512_set1_ps(origin.y + 0.5f);
+
+    __mmask16 moves_x = _mm512_cmp_ps_mask(direction_x, zero_ps, _CMP_NEQ_OQ);
+    __mmask16 moves_y = _mm512_cmp_ps_mask(direction_y, zero_ps, _CMP_NEQ_OQ);
+
+    // ### clip [t0, t1] to the map (Liang-Barsky), as map_ray_intersect_dda
+    __mmask16 active = 0xffff;
+    {
+        __m512 ta = _mm512_div_ps(_mm512_sub_ps(zero_ps, o_x), direction_x);
+        __m512 tb = _mm512_div_ps(
+                _mm512_sub_ps(_mm512_set1_ps((float) m.w), o_x), direction_x);
+        t_enter = _mm512_mask_max_ps(
+                t_enter, moves_x, t_enter, _mm512_min_ps(ta, tb));
+        t_exit = _mm512_mask_min_ps(
+                t_exit, moves_x, t_exit, _mm512_max_ps(ta, tb));
+        // a ray that doesn't move along x needs the origin in the map
+        int32 inside_x = 0.f <= origin.x + 0.5f && origin.x + 0.5f < (float) m.w;
+        if (!inside_x) active &= moves_x;
+
+        ta = _mm512_div_ps(_mm512_sub_ps(zero_ps, o_y), direction_y);
+        tb = _mm512_div_ps(
+                _mm512_sub_ps(_mm512_set1_ps((float) m.h), o_y), direction_y);
+        t_enter = _mm512_mask_max_ps(
+                t_enter, moves_y, t_enter, _mm512_min_ps(ta, tb));
+        t_exit = _mm512_mask_min_ps(
+                t_exit, moves_y, t_exit, _mm512_max_ps(ta, tb));
+        int32 inside_y = 0.f <= origin.y + 0.5f && origin.y + 0.5f < (float) m.h;
+        if (!inside_y) active &= moves_y;
+
+        active &= ~_mm512_cmp_ps_mask(t_enter, t_exit, _CMP_GE_OQ);
+    }
+
+    __m512i x = _mm512_min_epi32(_mm512_max_epi32(
+                _mm512_cvttps_epi32(_mm512_roundscale_ps(_mm512_add_ps(
+                            o_x, _mm512_mul_ps(direction_x, t_enter)),
+                        _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC)),
+                zero), _mm512_sub_epi32(width, one));
+    __m512i y = _mm512_min_epi32(_mm512_max_epi32(
+                _mm512_cvttps_epi32(_mm512_roundscale_ps(_mm512_add_ps(
+                            o_y, _mm512_mul_ps(direction_y, t_enter)),
+                        _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC)),
+                zero), _mm512_sub_epi32(height, one));
+
+    __mmask16 forward_x = _mm512_cmp_ps_mask(direction_x, zero_ps, _CMP_GT_OQ);
+    __mmask16 forward_y = _mm512_cmp_ps_mask(direction_y, zero_ps, _CMP_GT_OQ);
+    __m512i step_x = _mm512_mask_blend_epi32(
+            forward_x, _mm512_set1_epi32(-1), one);
+    __m512i step_y = _mm512_mask_blend_epi32(
+            forward_y, _mm512_set1_epi32(-1), one);
+    // (step > 0) as an int
+    __m512i forward_x_one = _mm512_maskz_mov_epi32(forward_x, one);
+    __m512i forward_y_one = _mm512_maskz_mov_epi32(forward_y, one);
+
+    // ray parameter of the next vertical and horizontal pixel border
+    __m512 t_delta_x = _mm512_mask_blend_ps(moves_x, infinity, _mm512_abs_ps(
+                _mm512_div_ps(_mm512_set1_ps(1.f), direction_x)));
+    __m512 t_delta_y = _mm512_mask_blend_ps(moves_y, infinity, _mm512_abs_ps(
+                _mm512_div_ps(_mm512_set1_ps(1.f), direction_y)));
+    __m512 t_max_x = _mm512_mask_blend_ps(moves_x, infinity, _mm512_div_ps(
+                _mm512_sub_ps(_mm512_cvtepi32_ps(
+                        _mm512_add_epi32(x, forward_x_one)), o_x),
+                direction_x));
+    __m512 t_max_y = _mm512_mask_blend_ps(moves_y, infinity, _mm512_div_ps(
+                _mm512_sub_ps(_mm512_cvtepi32_ps(
+                        _mm512_add_epi32(y, forward_y_one)), o_y),
+                direction_y));
+
+    __mmask16 hit = 0;
+
+    const int *bits = (const int *) m.occupancy->bits;
+    const int *distance = (const int *) m.distance;
+
+    while (active) {
+        // a bit for each pixel, 32 in each gathered word
+        __m512i index = _mm512_add_epi32(_mm512_mullo_epi32(y, width), x);
+        __m512i word = _mm512_mask_i32gather_epi32(
+                zero, active, _mm512_srli_epi32(index, 5), bits, 4);
+        __m512i bit = _mm512_and_si512(
+                _mm512_srlv_epi32(word, _mm512_and_si512(index, _mm512_set1_epi32(31))),
+                one);
+        __mmask16 new_hit = _mm512_mask_cmpeq_epi32_mask(active, bit, one);
+        hit |= new_hit;
+        active &= ~new_hit;
+
+        // box of half side radius around the pixel, see map_empty_box
+        __m512i radius = zero;
+        if (distance) {
+            // 32 bits at each uint16, see map_ray_intersect_packet
+            __m512i pixel_distance = _mm512_mask_i32gather_epi32(
+                    zero, active, index, distance, 2);
+            radius = _mm512_sub_epi32(
+                    _mm512_and_si512(pixel_distance, _mm512_set1_epi32(0xffff)),
+                    one);
+        }
+        __mmask16 boxed = _mm512_mask_cmpgt_epi32_mask(active, radius, zero);
+        __mmask16 stepped = active & ~boxed;
+
+        // ### leave the box from the first of its borders the ray crosses
+        __m512i box_x0 = _mm512_sub_epi32(x, radius);
+        __m512i box_x1 = _mm512_add_epi32(x, radius);
+        __m512i box_y0 = _mm512_sub_epi32(y, radius);
+        __m512i box_y1 = _mm512_add_epi32(y, radius);
+        __m512 box_t_x = _mm512_mask_blend_ps(moves_x, infinity, _mm512_div_ps(
+                    _mm512_sub_ps(_mm512_cvtepi32_ps(_mm512_mask_blend_epi32(
+                                forward_x, box_x0, _mm512_add_epi32(box_x1, one))),
+                        o_x),
+                    direction_x));
+        __m512 box_t_y = _mm512_mask_blend_ps(moves_y, infinity, _mm512_div_ps(
+                    _mm512_sub_ps(_mm512_cvtepi32_ps(_mm512_mask_blend_epi32(
+                                forward_y, box_y0, _mm512_add_epi32(box_y1, one))),
+                        o_y),
+                    direction_y));
+        __m512 box_t = _mm512_min_ps(box_t_x, box_t_y);
+        __mmask16 box_out =
+            _mm512_mask_cmp_ps_mask(boxed, box_t, t_exit, _CMP_GE_OQ);
+        boxed &= ~box_out;
+
+        __m512i box_next_x = _mm512_mask_blend_epi32(forward_x,
+                _mm512_sub_epi32(box_x0, one),
+                _mm512_add_epi32(box_x1, one));
+        __m512i box_inside_x = _mm512_min_epi32(_mm512_max_epi32(
+                    _mm512_cvttps_epi32(_mm512_roundscale_ps(_mm512_add_ps(
+                                o_x, _mm512_mul_ps(direction_x, box_t)),
+                            _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC)),
+                    box_x0), box_x1);
+        __m512i box_new_x = _mm512_mask_blend_epi32(
+                _mm512_cmp_ps_mask(box_t_x, box_t_y, _CMP_LE_OQ),
+                box_inside_x, box_next_x);
+        __m512i box_next_y = _mm512_mask_blend_epi32(forward_y,
+                _mm512_sub_epi32(box_y0, one),
+                _mm512_add_epi32(box_y1, one));
+        __m512i box_inside_y = _mm512_min_epi32(_mm512_max_epi32(
+                    _mm512_cvttps_epi32(_mm512_roundscale_ps(_mm512_add_ps(
+                                o_y, _mm512_mul_ps(direction_y, box_t)),
+                            _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC)),
+                    box_y0), box_y1);
+        __m512i box_new_y = _mm512_mask_blend_epi32(
+                _mm512_cmp_ps_mask(box_t_y, box_t_x, _CMP_LE_OQ),
+                box_inside_y, box_next_y);
+        __m512 box_t_max_x = _mm512_mask_blend_ps(moves_x, t_max_x, _mm512_div_ps(
+                    _mm512_sub_ps(_mm512_cvtepi32_ps(_mm512_add_epi32(
+                                box_new_x, forward_x_one)), o_x),
+                    direction_x));
+        __m512 box_t_max_y = _mm512_mask_blend_ps(moves_y, t_max_y, _mm512_div_ps(
+                    _mm512_sub_ps(_mm512_cvtepi32_ps(_mm512_add_epi32(
+                                box_new_y, forward_y_one)), o_y),
+                    direction_y));
+
+        // ### or one pixel along the axis of the nearest border
+        __mmask16 along_x =
+            _mm512_mask_cmp_ps_mask(stepped, t_max_x, t_max_y, _CMP_LT_OQ);
+        __mmask16 along_y = stepped & ~along_x;
+        __mmask16 step_out =
+            _mm512_mask_cmp_ps_mask(along_x, t_max_x, t_exit, _CMP_GE_OQ) |
+            _mm512_mask_cmp_ps_mask(along_y, t_max_y, t_exit, _CMP_GE_OQ);
+        along_x &= ~step_out;
+        along_y &= ~step_out;
+
+        x = _mm512_mask_mov_epi32(x, boxed, box_new_x);
+        y = _mm512_mask_mov_epi32(y, boxed, box_new_y);
+        t_max_x = _mm512_mask_mov_ps(t_max_x, boxed, box_t_max_x);
+        t_max_y = _mm512_mask_mov_ps(t_max_y, boxed, box_t_max_y);
+        x = _mm512_mask_add_epi32(x, along_x, x, step_x);
+        y = _mm512_mask_add_epi32(y, along_y, y, step_y);
+        t_max_x = _mm512_mask_add_ps(t_max_x, along_x, t_max_x, t_delta_x);
+        t_max_y = _mm512_mask_add_ps(t_max_y, along_y, t_max_y, t_delta_y);
+
+        // only rounding can bring the walk out of the clipped segment
+        __mmask16 inside =
+            _mm512_cmpgt_epi32_mask(x, _mm512_set1_epi32(-1)) &
+            _mm512_cmpgt_epi32_mask(width, x) &
+            _mm512_cmpgt_epi32_mask(y, _mm512_set1_epi32(-1)) &
+            _mm512_cmpgt_epi32_mask(height, y);
+        active = active & ~(box_out | step_out) & inside;
+    }
+
+    int32 lane_x[16];
+    int32 lane_y[16];
+    _mm512_storeu_si512(lane_x, x);
+    _mm512_storeu_si512(lane_y, y);
+    for(int32 lane = 0; lane < 16; ++lane) {
+        if (!((hit >> lane) & 1)) {
+            // alpha 1 means it hit nothing
+            results[lane] = (vec4f) { .r = 0.f, .g = 0.f, .b = 0.f, .a = 1.f };
+            continue;
+        }
+        vec4f pixel = map_pixel(&m, lane_y[lane] * m.w + lane_x[lane]);
+        results[lane] = (vec4f) {
+            .r = pixel.r,
+            .g = pixel.g,
+            .b = pixel.b,
+            .a = 0.f // alpha 0 means it hit something
+        };
+    }
+}
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC pop_options
+#endif
+
+// NOTE(gio): map_ray_intersect_packet with 4 lanes for the hosts with
+//              SSE4.1 and no AVX2. There are no gathers before AVX2, so the
+//              lanes still walking read their occupancy bit and distance
+//              one at a time, the rest of the step is on the 4 lanes
+CPU_TARGET_SSE41 void map_ray_intersect_packet4(map m, vec2f origin, map_ray_template *rays, vec4f *results) {
+    __m128 zero_ps = _mm_setzero_ps();
+    __m128 infinity = _mm_set1_ps(INFINITY);
+    __m128i zero = _mm_setzero_si128();
+    __m128i one = _mm_set1_epi32(1);
+    __m128i width = _mm_set1_epi32(m.w);
+    __m128i height = _mm_set1_epi32(m.h);
+
+    __m128 direction_x = _mm_setr_ps(
+            rays[0].direction.x, rays[1].direction.x,
+            rays[2].direction.x, rays[3].direction.x);
+    __m128 direction_y = _mm_setr_ps(
+            rays[0].direction.y, rays[1].direction.y,
+            rays[2].direction.y, rays[3].direction.y);
+    __m128 t_enter = _mm_setr_ps(
+            rays[0].interval.x, rays[1].interval.x,
+            rays[2].interval.x, rays[3].interval.x);
+    __m128 t_exit = _mm_setr_ps(
+            rays[0].interval.y, rays[1].interval.y,
+            rays[2].interval.y, rays[3].interval.y);
+
+    // pixel x covers [x, x + 1) from here on
+    __m128 o_x = _mm_set1_ps(origin.x + 0.5f);
+    __m128 o_y = _mm_set1_ps(origin.y + 0.5f);
+
+    // the axes a ray moves along, the others keep their INFINITY
+    __m128 moves_x = _mm_cmpneq_ps(direction_x, zero_ps);
+    __m128 moves_y = _mm_cmpneq_ps(direction_y, zero_ps);
+
+    // ### clip [t0, t1] to the map (Liang-Barsky), as map_ray_intersect_dda
+    __m128i active = _mm_set1_epi32(-1);
+    {
+        __m128 ta = _mm_div_ps(_mm_sub_ps(zero_ps, o_x), direction_x);
+        __m128 tb = _mm_div_ps(
+                _mm_sub_ps(_mm_set1_ps((float) m.w), o_x), direction_x);
+        t_enter = _mm_blendv_ps(t_enter,
+                _mm_max_ps(t_enter, _mm_min_ps(ta, tb)), moves_x);
+        t_exit = _mm_blendv_ps(t_exit,
+                _mm_min_ps(t_exit, _mm_max_ps(ta, tb)), moves_x);
+        // a ray that doesn't move along x needs the origin in the map
+        int32 inside_x = 0.f <= origin.x + 0.5f && origin.x + 0.5f < (float) m.w;
+        if (!inside_x) {
+            active = _mm_and_si128(active, _mm_castps_si128(moves_x));
+        }
+
+        ta = _mm_div_ps(_mm_sub_ps(zero_ps, o_y), direction_y);
+        tb = _mm_div_ps(
+                _mm_sub_ps(_mm_set1_ps((float) m.h), o_y), direction_y);
+        t_enter = _mm_blendv_ps(t_enter,
+                _mm_max_ps(t_enter, _mm_min_ps(ta, tb)), moves_y);
+        t_exit = _mm_blendv_ps(t_exit,
+                _mm_min_ps(t_exit, _mm_max_ps(ta, tb)), moves_y);
+        int32 inside_y = 0.f <= origin.y + 0.5f && origin.y + 0.5f < (float) m.h;
+        if (!inside_y) {
+            active = _mm_and_si128(active, _mm_castps_si128(moves_y));
+        }
+
+        active = _mm_andnot_si128(_mm_castps_si128(
+                    _mm_cmpge_ps(t_enter, t_exit)), active);
+    }
+
+    __m128i x = _mm_min_epi32(_mm_max_epi32(
+                _mm_cvttps_epi32(_mm_floor_ps(_mm_add_ps(
+                            o_x, _mm_mul_ps(direction_x, t_enter)))),
+                zero), _mm_sub_epi32(width, one));
+    __m128i y = _mm_min_epi32(_mm_max_epi32(
+                _mm_cvttps_epi32(_mm_floor_ps(_mm_add_ps(
+                            o_y, _mm_mul_ps(direction_y, t_enter)))),
+                zero), _mm_sub_epi32(height, one));
+
+    // -1 where the step is 1, 0 where it is -1
+    __m128i forward_x = _mm_castps_si128(_mm_cmpgt_ps(direction_x, zero_ps));
+    __m128i forward_y = _mm_castps_si128(_mm_cmpgt_ps(direction_y, zero_ps));
+    __m128i step_x = _mm_blendv_epi8(_mm_set1_epi32(-1), one, forward_x);
+    __m128i step_y = _mm_blendv_epi8(_mm_set1_epi32(-1), one, forward_y);
+
+    // ray parameter of the next vertical and horizontal pixel border
+    __m128 sign = _mm_set1_ps(-0.f);
+    __m128 t_delta_x = _mm_blendv_ps(infinity, _mm_andnot_ps(sign,
+                _mm_div_ps(_mm_set1_ps(1.f), direction_x)), moves_x);
+    __m128 t_delta_y = _mm_blendv_ps(infinity, _mm_andnot_ps(sign,
+                _mm_div_ps(_mm_set1_ps(1.f), direction_y)), moves_y);
+    __m128 t_max_x = _mm_blendv_ps(infinity, _mm_div_ps(
+                _mm_sub_ps(_mm_cvtepi32_ps(
+                        _mm_sub_epi32(x, forward_x)), o_x),
+                direction_x), moves_x);
+    __m128 t_max_y = _mm_blendv_ps(infinity, _mm_div_ps(
+                _mm_sub_ps(_mm_cvtepi32_ps(
+                        _mm_sub_epi32(y, forward_y)), o_y),
+                direction_y), moves_y);
+
+    __m128i hit = _mm_setzero_si128();
+
+    while (!_mm_testz_si128(active, active)) {
+        // the bit of each pixel, and the box of half side radius around
+        // it (see map_empty_box) if it is VOID
+        __m128i index = _mm_add_epi32(_mm_mullo_epi32(y, width), x);
+        int32 lane_index[4];
+        int32 lane_active[4];
+        int32 lane_bit[4];
+        int32 lane_radius[4];
+        _mm_storeu_si128((__m128i *) lane_index, index);
+        _mm_storeu_si128((__m128i *) lane_active, active);
+        for(int32 lane = 0; lane < 4; ++lane) {
+            lane_bit[lane] = 0;
+            lane_radius[lane] = 0;
+            if (!lane_active[lane]) continue;
+            int32 pixel_index = lane_index[lane];
+            lane_bit[lane] = (int32)
+                ((m.occupancy->bits[pixel_index >> 6] >> (pixel_index & 63)) & 1);
+            if (!lane_bit[lane] && m.distance) {
+                lane_radius[lane] = (int32) m.distance[pixel_index] - 1;
+            }
+        }
+        __m128i new_hit = _mm_and_si128(active, _mm_cmpeq_epi32(
+                    _mm_loadu_si128((__m128i *) lane_bit), one));
+        hit = _mm_or_si128(hit, new_hit);
+        active = _mm_andnot_si128(new_hit, active);
+
+        __m128i radius = _mm_loadu_si128((__m128i *) lane_radius);
+        __m128i boxed = _mm_and_si128(active, _mm_cmpgt_epi32(radius, zero));
+        __m128i stepped = _mm_andnot_si128(boxed, active);
+
+        // ### leave the box from the first of its borders the ray crosses
+        __m128i box_x0 = _mm_sub_epi32(x, radius);
+        __m128i box_x1 = _mm_add_epi32(x, radius);
+        __m128i box_y0 = _mm_sub_epi32(y, radius);
+        __m128i box_y1 = _mm_add_epi32(y, radius);
+        __m128 box_t_x = _mm_blendv_ps(infinity, _mm_div_ps(
+                    _mm_sub_ps(_mm_cvtepi32_ps(_mm_blendv_epi8(
+                                box_x0, _mm_add_epi32(box_x1, one), forward_x)),
+                        o_x),
+                    direction_x), moves_x);
+        __m128 box_t_y = _mm_blendv_ps(infinity, _mm_div_ps(
+                    _mm_sub_ps(_mm_cvtepi32_ps(_mm_blendv_epi8(
+                                box_y0, _mm_add_epi32(box_y1, one), forward_y)),
+                        o_y),
+                    direction_y), moves_y);
+        __m128 box_t = _mm_min_ps(box_t_x, box_t_y);
+        __m128i box_out = _mm_and_si128(boxed, _mm_castps_si128(
+                    _mm_cmpge_ps(box_t, t_exit)));
+        boxed = _mm_andnot_si128(box_out, boxed);
+
+        __m128i box_next_x = _mm_blendv_epi8(
+                _mm_sub_epi32(box_x0, one),
+                _mm_add_epi32(box_x1, one),
+                forward_x);
+        __m128i box_inside_x = _mm_min_epi32(_mm_max_epi32(
+                    _mm_cvttps_epi32(_mm_floor_ps(_mm_add_ps(
+                                o_x, _mm_mul_ps(direction_x, box_t)))),
+                    box_x0), box_x1);
+        __m128i box_new_x = _mm_blendv_epi8(box_inside_x, box_next_x,
+                _mm_castps_si128(_mm_cmple_ps(box_t_x, box_t_y)));
+        __m128i box_next_y = _mm_blendv_epi8(
+                _mm_sub_epi32(box_y0, one),
+                _mm_add_epi32(box_y1, one),
+                forward_y);
+        __m128i box_inside_y = _mm_min_epi32(_mm_max_epi32(
+                    _mm_cvttps_epi32(_mm_floor_ps(_mm_add_ps(
+                                o_y, _mm_mul_ps(direction_y, box_t)))),
+                    box_y0), box_y1);
+        __m128i box_new_y = _mm_blendv_epi8(box_inside_y, box_next_y,
+                _mm_castps_si128(_mm_cmple_ps(box_t_y, box_t_x)));
+        __m128 box_t_max_x = _mm_blendv_ps(t_max_x, _mm_div_ps(
+                    _mm_sub_ps(_mm_cvtepi32_ps(_mm_sub_epi32(
+                                box_new_x, forward_x)), o_x),
+                    direction_x), moves_x);
+        __m128 box_t_max_y = _mm_blendv_ps(t_max_y, _mm_div_ps(
+                    _mm_sub_ps(_mm_cvtepi32_ps(_mm_sub_epi32(
+                                box_new_y, forward_y)), o_y),
+                    direction_y), moves_y);
+
+        // ### or one pixel along the axis of the nearest border
+        __m128i along_x = _mm_and_si128(stepped, _mm_castps_si128(
+                    _mm_cmplt_ps(t_max_x, t_max_y)));
+        __m128i along_y = _mm_andnot_si128(along_x, stepped);
+        __m128i step_out = _mm_or_si128(
+                _mm_and_si128(along_x, _mm_castps_si128(
+                        _mm_cmpge_ps(t_max_x, t_exit))),
+                _mm_and_si128(along_y, _mm_castps_si128(
+                        _mm_cmpge_ps(t_max_y, t_exit))));
+        along_x = _mm_andnot_si128(step_out, along_x);
+        along_y = _mm_andnot_si128(step_out, along_y);
+
+        x = _mm_blendv_epi8(x, box_new_x, boxed);
+        y = _mm_blendv_epi8(y, box_new_y, boxed);
+        t_max_x = _mm_blendv_ps(t_max_x, box_t_max_x, _mm_castsi128_ps(boxed));
+        t_max_y = _mm_blendv_ps(t_max_y, box_t_max_y, _mm_castsi128_ps(boxed));
+        x = _mm_add_epi32(x, _mm_and_si128(along_x, step_x));
+        y = _mm_add_epi32(y, _mm_and_si128(along_y, step_y));
+        t_max_x = _mm_add_ps(t_max_x, _mm_and_ps(
+                    _mm_castsi128_ps(along_x), t_delta_x));
+        t_max_y = _mm_add_ps(t_max_y, _mm_and_ps(
+                    _mm_castsi128_ps(along_y), t_delta_y));
+
+        // only rounding can bring the walk out of the clipped segment
+        __m128i inside = _mm_and_si128(
+                _mm_and_si128(
+                    _mm_cmpgt_epi32(x, _mm_set1_epi32(-1)),
+                    _mm_cmpgt_epi32(width, x)),
+                _mm_and_si128(
+                    _mm_cmpgt_epi32(y, _mm_set1_epi32(-1)),
+                    _mm_cmpgt_epi32(height, y)));
+        active = _mm_and_si128(
+                _mm_andnot_si128(_mm_or_si128(box_out, step_out), active),
+                inside);
+    }
+
+    int32 lane_hit[4];
+    int32 lane_x[4];
+    int32 lane_y[4];
+    _mm_storeu_si128((__m128i *) lane_hit, hit);
+    _mm_storeu_si128((__m128i *) lane_x, x);
+    _mm_storeu_si128((__m128i *) lane_y, y);
+    for(int32 lane = 0; lane < 4; ++lane) {
+        if (!lane_hit[lane]) {
+            // alpha 1 means it hit nothing
+            results[lane] = (vec4f) { .r = 0.f, .g = 0.f, .b = 0.f, .a = 1.f };
+            continue;
+        }
+        vec4f pixel = map_pixel(&m, lane_y[lane] * m.w + lane_x[lane]);
+        results[lane] = (vec4f) {
+            .r = pixel.r,
+            .g = pixel.g,
+            .b = pixel.b,
+            .a = 0.f // alpha 0 means it hit something
+        };
+    }
+}
+#endif
+
+#ifndef RADIANCE_CASCADES_HEADLESS
+
 void map_setup_renderer(GLuint *vao, GLuint *vbo, GLuint *ebo) {
     float vertices[] = {
         -1.f, -1.f, 0.f, 1.f, // up left
@@ -257,6 +2281,8 @@ texture map_generate_texture(map m) {
     return tex;
 }
 
+#endif // RADIANCE_CASCADES_HEADLESS
+
 void map_draw_circle(map m, circle c) {
     vec2i draw_start = {
         .x = CLAMP((int32) (c.center.x - c.radius), 0.f, m.w-1),
@@ -8,8 +8,20 @@
 ///
 
 #include <stdint.h>
+#include <string.h>
 #include <math.h>
 
+// NOTE(gio): the F16C half float conversions are built with a target
+//              attribute next to the portable ones, for the callers to
+//              pick at runtime (see cpu_isa), gcc and clang on x86 only
+#if (defined(__GNUC__) || defined(__clang__)) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define MATHY_F16C 1
+#include <immintrin.h>
+#else
+#define MATHY_F16C 0
+#endif
+
 #ifndef ARR_LEN
 #define ARR_LEN(x) (sizeof((x)) / sizeof((x)[0]))
 #endif
@@ -129,6 +141,11 @@ typedef struct vec4f {
     };
 } vec4f;
 
+// IEEE 754 half floats, storage only: convert to vec4f to do math
+typedef struct vec4h {
+    uint16 e[4];
+} vec4h;
+
 typedef struct mat4f {
     union {
         float e[16];
@@ -139,18 +156,6 @@ typedef struct mat4f {
 vec4f
 vec4f_create(float x, float y, float z, float w);
 
-vec4f
-vec4f_divide(vec4f v, float x);
-
-vec4f
-vec4f_mult(vec4f v, float x);
-
-vec4f
-vec4f_sum_vec4f(vec4f v1, vec4f v2);
-
-vec4f
-vec4f_diff_vec4f(vec4f v1, vec4f v2);
-
 vec2f
 vec2f_sum_vec2f(vec2f v1, vec2f v2);
 
@@ -163,27 +168,57 @@ vec2f_length_squared(vec2f v);
 vec2f
 vec2f_normalize(vec2f v);
 
-vec4f
-mat4f_x_vec4f(mat4f m, vec4f v);
-
 mat4f
 mat4f_x_mat4f(mat4f m1, mat4f m2);
 
+uint16
+half_from_float(float f);
 
-#ifdef RADIANCE_CASCADES_MATHY_IMPLEMENTATION
+float
+float_from_half(uint16 h);
 
-vec4f vec4f_create(float x, float y, float z, float w) {
-    vec4f result;
+vec4h
+vec4h_from_vec4f(vec4f v);
 
-    result.x = x;
-    result.y = y;
-    result.z = z;
-    result.w = w;
+vec4f
+vec4f_from_vec4h(vec4h h);
 
-    return result;
-}
+void
+vec4h_from_vec4f_n(vec4h *dst, vec4f *src, int32 n);
+
+void
+vec4f_from_vec4h_n(vec4f *dst, vec4h *src, int32 n);
+
+#if MATHY_F16C
+__attribute__((target("f16c"))) vec4h
+vec4h_from_vec4f_f16c(vec4f v);
+
+__attribute__((target("f16c"))) vec4f
+vec4f_from_vec4h_f16c(vec4h h);
+
+__attribute__((target("avx,f16c"))) void
+vec4h_from_vec4f_n_f16c(vec4h *dst, vec4f *src, int32 n);
+
+__attribute__((target("avx,f16c"))) void
+vec4f_from_vec4h_n_f16c(vec4f *dst, vec4h *src, int32 n);
+#endif
 
-vec4f vec4f_divide(vec4f v, float x) {
+uint32
+morton_encode(uint32 x, uint32 y);
+
+vec2i
+morton_decode(uint32 code);
+
+
+// NOTE(gio): the vec4f arithmetic is in every merge and gather loop, so it's
+//              defined here for every includer (static inline) instead of
+//              with the implementation, letting the compiler keep the
+//              values in registers across calls. The fields are enough for
+//              gcc -O2 to vectorize them (SLP), intrinsics here would only
+//              add round trips through memory: a vec4f is a struct and its
+//              fields are written one by one by the callers
+
+static inline vec4f vec4f_divide(vec4f v, float x) {
     vec4f result;
 
     result.x = v.x / x;
@@ -194,7 +229,7 @@ vec4f vec4f_divide(vec4f v, float x) {
     return result;
 }
 
-vec4f vec4f_mult(vec4f v, float x) {
+static inline vec4f vec4f_mult(vec4f v, float x) {
     vec4f result;
 
     result.x = v.x * x;
@@ -205,7 +240,7 @@ vec4f vec4f_mult(vec4f v, float x) {
     return result;
 }
 
-vec4f vec4f_sum_vec4f(vec4f v1, vec4f v2) {
+static inline vec4f vec4f_sum_vec4f(vec4f v1, vec4f v2) {
     vec4f result;
 
     result.x = v1.x + v2.x;
@@ -216,7 +251,7 @@ vec4f vec4f_sum_vec4f(vec4f v1, vec4f v2) {
     return result;
 }
 
-vec4f vec4f_diff_vec4f(vec4f v1, vec4f v2) {
+static inline vec4f vec4f_diff_vec4f(vec4f v1, vec4f v2) {
     vec4f result;
 
     result.x = v1.x - v2.x;
@@ -227,6 +262,34 @@ vec4f vec4f_diff_vec4f(vec4f v1, vec4f v2) {
     return result;
 }
 
+static inline vec4f mat4f_x_vec4f(mat4f m, vec4f v) {
+    vec4f result = {};
+
+    for(int i = 0; i < 4; i++) {
+        float row_x_column = 0.f;
+        for(int j = 0; j < 4; j++) {
+            row_x_column += m.m[i][j] * v.e[j];
+        }
+        result.e[i] = row_x_column;
+    }
+
+    return result;
+}
+
+
+#ifdef RADIANCE_CASCADES_MATHY_IMPLEMENTATION
+
+vec4f vec4f_create(float x, float y, float z, float w) {
+    vec4f result;
+
+    result.x = x;
+    result.y = y;
+    result.z = z;
+    result.w = w;
+
+    return result;
+}
+
 vec2f vec2f_sum_vec2f(vec2f v1, vec2f v2) {
     vec2f result;
 
@@ -263,20 +326,6 @@ vec2f vec2f_normalize(vec2f v) {
     return result;
 }
 
-vec4f mat4f_x_vec4f(mat4f m, vec4f v) {
-    vec4f result = {};
-
-    for(int i = 0; i < 4; i++) {
-        float row_x_column = 0.f;
-        for(int j = 0; j < 4; j++) {
-            row_x_column += m.m[i][j] * v.e[j];
-        }
-        result.e[i] = row_x_column;
-    }
-
-    return result;
-}
-
 mat4f mat4f_x_mat4f(mat4f m1, mat4f m2) {
     mat4f result = {};
 
@@ -294,6 +343,158 @@ mat4f mat4f_x_mat4f(mat4f m1, mat4f m2) {
     return result;
 }
 
+
+// NOTE(gio): round to nearest even like the F16C instructions do, so the
+//              result does not depend on which path converted it
+uint16 half_from_float(float f) {
+    uint32 bits;
+    memcpy(&bits, &f, sizeof(bits));
+    uint32 sign = bits & 0x80000000;
+    bits ^= sign;
+
+    uint16 result;
+    if (bits >= (uint32) (127 + 16) << 23) {
+        // too big for a half: infinity, or a quiet nan
+        result = (bits > (uint32) 255 << 23) ? 0x7e00 : 0x7c00;
+    } else if (bits < (uint32) 113 << 23) {
+        // subnormal half, let the float addition do the rounding
+        uint32 denormal_bits = (uint32) ((127 - 15) + (23 - 10) + 1) << 23;
+        float denormal_magic;
+        memcpy(&denormal_magic, &denormal_bits, sizeof(denormal_magic));
+        float value;
+        memcpy(&value, &bits, sizeof(value));
+        value += denormal_magic;
+        memcpy(&bits, &value, sizeof(bits));
+        result = (uint16) (bits - denormal_bits);
+    } else {
+        uint32 mantissa_odd = (bits >> 13) & 1;
+        bits += ((uint32) (15 - 127) << 23) + 0xfff;
+        bits += mantissa_odd;
+        result = (uint16) (bits >> 13);
+    }
+
+    return result | (uint16) (sign >> 16);
+}
+
+float float_from_half(uint16 h) {
+    uint32 shifted_exponent = 0x7c00 << 13;
+    uint32 bits = (uint32) (h & 0x7fff) << 13;
+    uint32 exponent = bits & shifted_exponent;
+    bits += (uint32) (127 - 15) << 23;
+
+    float result;
+    if (exponent == shifted_exponent) {
+        // infinity or nan
+        bits += (uint32) (128 - 16) << 23;
+        memcpy(&result, &bits, sizeof(result));
+    } else if (exponent == 0) {
+        // zero or subnormal, renormalized by the float subtraction
+        uint32 magic_bits = (uint32) 113 << 23;
+        float magic;
+        memcpy(&magic, &magic_bits, sizeof(magic));
+        bits += 1 << 23;
+        memcpy(&result, &bits, sizeof(result));
+        result -= magic;
+    } else {
+        memcpy(&result, &bits, sizeof(result));
+    }
+
+    return (h & 0x8000) ? -result : result;
+}
+
+vec4h vec4h_from_vec4f(vec4f v) {
+    vec4h result;
+    for(int32 i = 0; i < 4; ++i) result.e[i] = half_from_float(v.e[i]);
+    return result;
+}
+
+vec4f vec4f_from_vec4h(vec4h h) {
+    vec4f result;
+    for(int32 i = 0; i < 4; ++i) result.e[i] = float_from_half(h.e[i]);
+    return result;
+}
+
+void vec4h_from_vec4f_n(vec4h *dst, vec4f *src, int32 n) {
+    for(int32 i = 0; i < n; ++i) dst[i] = vec4h_from_vec4f(src[i]);
+}
+
+void vec4f_from_vec4h_n(vec4f *dst, vec4h *src, int32 n) {
+    for(int32 i = 0; i < n; ++i) dst[i] = vec4f_from_vec4h(src[i]);
+}
+
+#if MATHY_F16C
+__attribute__((target("f16c"))) vec4h vec4h_from_vec4f_f16c(vec4f v) {
+    vec4h result;
+    __m128i halves = _mm_cvtps_ph(_mm_loadu_ps(v.e), _MM_FROUND_TO_NEAREST_INT);
+    _mm_storel_epi64((__m128i *) result.e, halves);
+    return result;
+}
+
+__attribute__((target("f16c"))) vec4f vec4f_from_vec4h_f16c(vec4h h) {
+    vec4f result;
+    _mm_storeu_ps(result.e, _mm_cvtph_ps(_mm_loadl_epi64((__m128i *) h.e)));
+    return result;
+}
+
+// NOTE(gio): bulk conversions, two vec4 for each F16C instruction
+__attribute__((target("avx,f16c"))) void vec4h_from_vec4f_n_f16c(
+        vec4h *dst,
+        vec4f *src,
+        int32 n) {
+    int32 i = 0;
+    for(; i + 2 <= n; i += 2) {
+        __m128i halves = _mm256_cvtps_ph(
+                _mm256_loadu_ps(src[i].e),
+                _MM_FROUND_TO_NEAREST_INT);
+        _mm_storeu_si128((__m128i *) dst[i].e, halves);
+    }
+    for(; i < n; ++i) dst[i] = vec4h_from_vec4f_f16c(src[i]);
+}
+
+__attribute__((target("avx,f16c"))) void vec4f_from_vec4h_n_f16c(
+        vec4f *dst,
+        vec4h *src,
+        int32 n) {
+    int32 i = 0;
+    for(; i + 2 <= n; i += 2) {
+        _mm256_storeu_ps(dst[i].e,
+                _mm256_cvtph_ps(_mm_loadu_si128((__m128i *) src[i].e)));
+    }
+    for(; i < n; ++i) dst[i] = vec4f_from_vec4h_f16c(src[i]);
+}
+#endif
+
+// NOTE(gio): Z-order curve, the bits of x and y (16 each at most) are
+//              interleaved with x in the even bits
+static uint32 morton_spread(uint32 v) {
+    v &= 0x0000ffff;
+    v = (v | (v << 8)) & 0x00ff00ff;
+    v = (v | (v << 4)) & 0x0f0f0f0f;
+    v = (v | (v << 2)) & 0x33333333;
+    v = (v | (v << 1)) & 0x55555555;
+    return v;
+}
+
+static uint32 morton_compact(uint32 v) {
+    v &= 0x55555555;
+    v = (v | (v >> 1)) & 0x33333333;
+    v = (v | (v >> 2)) & 0x0f0f0f0f;
+    v = (v | (v >> 4)) & 0x00ff00ff;
+    v = (v | (v >> 8)) & 0x0000ffff;
+    return v;
+}
+
+uint32 morton_encode(uint32 x, uint32 y) {
+    return morton_spread(x) | (morton_spread(y) << 1);
+}
+
+vec2i morton_decode(uint32 code) {
+    return (vec2i) {
+        .x = (int32) morton_compact(code),
+        .y = (int32) morton_compact(code >> 1)
+    };
+}
+
 #endif
 
 #endif //_RC_MATHY_H_
@@ -1,6 +1,10 @@
 #ifndef _RC_RENDER_H_
 #define _RC_RENDER_H_
 
+// NOTE(gio): define RADIANCE_CASCADES_HEADLESS to build without any GL
+//              dependency (e.g. the bench executable)
+#ifndef RADIANCE_CASCADES_HEADLESS
+
 #include <glad/glad.h>
 
 typedef GLuint shader_program;
@@ -212,4 +216,6 @@ void texture_render(GLuint vao, texture texture, shader_program shader) {
 
 #endif
 
+#endif // RADIANCE_CASCADES_HEADLESS
+
 #endif // _RC_RENDER_H_
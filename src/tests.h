@@ -14,6 +14,9 @@ test_spheres(map m);
 void
 test_penumbra(map m);
 
+void
+test_slit(map m);
+
 #ifdef RADIANCE_CASCADES_TESTS_IMPLEMENTATION
 
 void test_double_light(map m) {
@@ -0,0 +1,216 @@
+#ifndef _RC_THREADS_H_
+#define _RC_THREADS_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "mathy.h"
+
+///
+/// Persistent pool of worker threads.
+///
+/// The pool is created once and reused: `thread_pool_run` hands out the job
+/// indices [0, job_number) to the workers (and to the calling thread) and
+/// only returns when every job has been completed.
+/// A NULL pool, or a pool with a single thread, runs the jobs serially
+/// and in order on the calling thread.
+/// Inside a job `thread_pool_thread_index` tells which thread runs it, to
+/// keep scratch memory for each thread instead of each job.
+///
+
+typedef void (*thread_pool_job)(void *data, int32 job_index);
+
+typedef struct thread_pool {
+    pthread_t *threads; // thread_number - 1 workers, the caller is the last
+    int32 thread_number;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t work_cond;
+    pthread_cond_t done_cond;
+
+    // current dispatch, written under mutex
+    thread_pool_job job;
+    void *data;
+    int32 job_number;
+    int32 next_job; // claimed atomically
+    int32 workers_done; // workers that left the current dispatch
+    int32 workers_started; // to number the workers
+    uint64 generation;
+    int32 quit;
+} thread_pool;
+
+int32
+thread_pool_cpu_count(void);
+
+thread_pool *
+thread_pool_create(int32 thread_number);
+
+void
+thread_pool_run(thread_pool *pool, thread_pool_job job, void *data, int32 job_number);
+
+void
+thread_pool_destroy(thread_pool *pool);
+
+int32
+thread_pool_thread_index(void);
+
+#ifdef RADIANCE_CASCADES_THREADS_IMPLEMENTATION
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+// 0 on the calling thread (and outside any pool), from 1 on the workers
+static __thread int32 thread_pool_current_index = 0;
+
+int32 thread_pool_cpu_count(void) {
+    int32 count = 1;
+#ifdef _WIN32
+    const char *env = getenv("NUMBER_OF_PROCESSORS");
+    if (env) count = atoi(env);
+#else
+    count = (int32) sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    return MAX(count, 1);
+}
+
+static void thread_pool_work(
+        thread_pool *pool,
+        thread_pool_job job,
+        void *data,
+        int32 job_number) {
+    for(;;) {
+        int32 job_index =
+            __atomic_fetch_add(&pool->next_job, 1, __ATOMIC_RELAXED);
+        if (job_index >= job_number) break;
+
+        job(data, job_index);
+    }
+}
+
+static void *thread_pool_worker(void *arg) {
+    thread_pool *pool = (thread_pool *) arg;
+    uint64 seen_generation = 0;
+
+    thread_pool_current_index =
+        __atomic_add_fetch(&pool->workers_started, 1, __ATOMIC_RELAXED);
+
+    pthread_mutex_lock(&pool->mutex);
+    for(;;) {
+        while (!pool->quit && pool->generation == seen_generation) {
+            pthread_cond_wait(&pool->work_cond, &pool->mutex);
+        }
+        if (pool->quit) break;
+        seen_generation = pool->generation;
+        thread_pool_job job = pool->job;
+        void *data = pool->data;
+        int32 job_number = pool->job_number;
+        pthread_mutex_unlock(&pool->mutex);
+
+        thread_pool_work(pool, job, data, job_number);
+
+        pthread_mutex_lock(&pool->mutex);
+        // NOTE(gio): the dispatch is over only when every worker left it,
+        //              otherwise a late worker could steal a job index
+        //              from the next dispatch
+        pool->workers_done++;
+        pthread_cond_signal(&pool->done_cond);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+
+    return NULL;
+}
+
+thread_pool *thread_pool_create(int32 thread_number) {
+    if (thread_number <= 0) thread_number = thread_pool_cpu_count();
+
+    thread_pool *pool = calloc(1, sizeof(thread_pool));
+    pool->thread_number = thread_number;
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->work_cond, NULL);
+    pthread_cond_init(&pool->done_cond, NULL);
+
+    pool->threads = calloc(MAX(thread_number - 1, 1), sizeof(pthread_t));
+    for(int32 thread_index = 0;
+        thread_index < thread_number - 1;
+        ++thread_index) {
+        if (pthread_create(
+                    &pool->threads[thread_index],
+                    NULL,
+                    thread_pool_worker,
+                    pool) != 0) {
+            fprintf(stderr, "[ERROR] Failed to create worker thread %d\n",
+                    thread_index);
+            pool->thread_number = thread_index + 1;
+            break;
+        }
+    }
+
+    printf("thread_pool threads(%d)\n", pool->thread_number);
+    return pool;
+}
+
+void thread_pool_run(
+        thread_pool *pool,
+        thread_pool_job job,
+        void *data,
+        int32 job_number) {
+    if (job_number <= 0) return;
+
+    if (pool == NULL || pool->thread_number <= 1 || job_number == 1) {
+        for(int32 job_index = 0; job_index < job_number; ++job_index) {
+            job(data, job_index);
+        }
+        return;
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+    pool->job = job;
+    pool->data = data;
+    pool->job_number = job_number;
+    pool->next_job = 0;
+    pool->workers_done = 0;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->work_cond);
+    pthread_mutex_unlock(&pool->mutex);
+
+    // the calling thread works too
+    thread_pool_work(pool, job, data, job_number);
+
+    pthread_mutex_lock(&pool->mutex);
+    while (pool->workers_done < pool->thread_number - 1) {
+        pthread_cond_wait(&pool->done_cond, &pool->mutex);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+void thread_pool_destroy(thread_pool *pool) {
+    if (pool == NULL) return;
+
+    pthread_mutex_lock(&pool->mutex);
+    pool->quit = 1;
+    pthread_cond_broadcast(&pool->work_cond);
+    pthread_mutex_unlock(&pool->mutex);
+
+    for(int32 thread_index = 0;
+        thread_index < pool->thread_number - 1;
+        ++thread_index) {
+        pthread_join(pool->threads[thread_index], NULL);
+    }
+
+    pthread_cond_destroy(&pool->done_cond);
+    pthread_cond_destroy(&pool->work_cond);
+    pthread_mutex_destroy(&pool->mutex);
+    free(pool->threads);
+    free(pool);
+}
+
+// in [0, thread_number) of the pool running the job
+int32 thread_pool_thread_index(void) {
+    return thread_pool_current_index;
+}
+
+#endif // RADIANCE_CASCADES_THREADS_IMPLEMENTATION
+
+#endif // _RC_THREADS_H_